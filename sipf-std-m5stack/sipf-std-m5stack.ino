@@ -7,6 +7,13 @@
 #include <M5Stack.h>
 #include <string.h>
 #include "sipf_client.h"
+#include "sipf_client_typed.h"
+#include "sipf_gnss.h"
+#include "sipf_stats.h"
+#include "sipf_store.h"
+#include "sipf_transport.h"
+#include "sipf_txq.h"
+#include <SPIFFS.h>
 
 /*
 #define ENABLE_GNSS
@@ -30,6 +37,7 @@
  */
 static uint8_t buff[256];
 static uint32_t cnt_btn1;
+static SipfTransport sipf_transport;
 
 static int resetSipfModule()
 {
@@ -43,6 +51,9 @@ static int resetSipfModule()
 
   // UART初期化
   Serial2.begin(115200, SERIAL_8N1, 16, 17);
+  SipfTransportArduinoInit(&sipf_transport, &Serial2);
+  SipfTransportSet(&sipf_transport);
+  SipfRegCacheInvalidate();
 
   // 起動完了メッセージ待ち
   Serial.println("### MODULE OUTPUT ###");
@@ -133,14 +144,23 @@ static void drawResultWindow(void)
 }
 
 #ifdef ENABLE_GNSS
-static void printGnssLocation(GnssLocation *gnss_location_p) {
+/* 1e-6度の固定小数点を小数で表示する(floatを使わない) */
+static void printMicroDegree(int32_t v) {
+  uint32_t a = (v < 0) ? -(uint32_t)v : v;
+  M5.Lcd.printf("%s%u.%06u", (v < 0) ? "-" : "", a / 1000000, a % 1000000);
+}
+
+static void printGnssLocation(const GnssLocationFixed *gnss_location_p) {
   if (!gnss_location_p->fixed) {
     M5.Lcd.printf("Not fixed\n");
   }else{
    M5.Lcd.printf("Fixed\n");
   }
 
-   M5.Lcd.printf("%.6f %.6f\n", gnss_location_p->latitude, gnss_location_p->longitude);
+   printMicroDegree(gnss_location_p->latitude);
+   M5.Lcd.printf(" ");
+   printMicroDegree(gnss_location_p->longitude);
+   M5.Lcd.printf("\n");
 
    M5.Lcd.printf("%04d-%02d-%02d %02d:%02d:%02d (UTC)\n",
     gnss_location_p->year, gnss_location_p->month, gnss_location_p->day,
@@ -148,7 +168,7 @@ static void printGnssLocation(GnssLocation *gnss_location_p) {
    );
 }
 
-static void drawGnssLocation(GnssLocation *gnss_location_p) {
+static void drawGnssLocation(const GnssLocationFixed *gnss_location_p) {
 
   M5.Lcd.setTextSize(1);
 
@@ -169,8 +189,44 @@ static void drawGnssLocation(GnssLocation *gnss_location_p) {
 
   setCursorResultWindow();
 }
+
+static SipfGnssTracker gnss_tracker;
+
+/* 測位状態が変わったか10m以上動いたときだけ表示を更新する */
+static void onGnssEvent(SipfGnssTracker *trk, uint32_t events, const GnssLocationFixed *fix, void *arg)
+{
+  if (events & SIPF_GNSS_EV_ERROR) {
+    drawGnssLocation(NULL);
+  } else {
+    drawGnssLocation(fix);
+  }
+}
 #endif
 
+static SipfStore txq_store;
+static SipfStoreArduino txq_store_file;
+static SipfTxQueue txq;
+static void onTxQueueSent(SipfTxQueue *q, int result, uint64_t timestamp_ms, const uint8_t *otid, void *arg);
+
+/* モジュールからの受信(コマンドの応答以外)をPCへ */
+static void writeConsole(const uint8_t *buff, int len, void *arg)
+{
+  Serial.write(buff, len);
+}
+
+/* モジュールが再起動した(実行中のコマンドはすぐに失敗で終わる) */
+static void onModuleReboot(const char *line, int len, void *arg)
+{
+  setCursorResultWindow();
+  M5.Lcd.printf("Module restarted\n");
+}
+
+/* モジュールが出したエラー */
+static void onModuleError(const char *line, int len, void *arg)
+{
+  Serial.printf("module: %.*s\n", len, line);
+}
+
 void setup() {
   // put your setup code here, to run once:
   M5.begin();
@@ -204,6 +260,16 @@ void setup() {
       return;
     }
   }
+  // 送信キュー(圏外や電源断でもボタンを押した分は後から送る)
+  M5.Lcd.printf("Open TX queue..");
+  if (SPIFFS.begin(true) &&
+      (SipfStoreArduinoOpen(&txq_store, &txq_store_file, SPIFFS, "/txq.bin", 64 * 1024) == 0) &&
+      (SipfTxQueueOpen(&txq, &txq_store, SIPF_TXQ_DROP_OLDEST, onTxQueueSent, NULL) == 0)) {
+    M5.Lcd.printf(" OK(%u queued)\n", SipfTxQueueCount(&txq));
+  } else {
+    M5.Lcd.printf(" NG\n");
+    return;
+  }
 #ifdef ENABLE_GNSS
   M5.Lcd.printf("Enable GNSS..");
   if (SipfSetGnss(true) == 0) {
@@ -212,6 +278,9 @@ void setup() {
     M5.Lcd.printf(" NG\n");
     return;
   }
+  // 1秒ごとに取得, 測位できていない間は16秒まで間隔を延ばす
+  SipfGnssTrackerInit(&gnss_tracker, 1000, 16000, 10, onGnssEvent, NULL);
+  SipfGnssTrackerStart(&gnss_tracker);
 #endif
   drawResultWindow();
 
@@ -223,36 +292,154 @@ void setup() {
 
   Serial.println("+++ Ready +++");
   SipfClientFlushReadBuff();
+  // 以降はコマンドの応答以外の受信をPCへ中継する
+  SipfMuxAttachConsole(writeConsole, NULL);
+  SipfEventRegister("*** SIPF Client", onModuleReboot, NULL);
+  SipfEventRegister("ERR:", onModuleError, NULL);
 }
 
-void loop() {
-  // put your main code here, to run repeatedly:
-  int available_len;
-  /* PCとモジュールのシリアルポートを中継 */
-  available_len = Serial.available();
-  for (int i = 0; i < available_len; i++) {
-    unsigned char b = Serial.read();
-    Serial2.write(b);
+/**
+ * 非同期コマンドの完了通知
+ */
+static SipfRxDrain rx_drain;
+static SipfTxBatch tx_batch;
+static SipfObjObject objs[16];
+
+/* 今のUNIX時間[ms](最後に測位できた日時から進める. わからなければ0) */
+static uint64_t nowUnixMs(void)
+{
+#ifdef ENABLE_GNSS
+  GnssLocationFixed fix;
+  uint32_t age_ms;
+  if (SipfGnssTrackerGet(&gnss_tracker, &fix, &age_ms) == 0) {
+    uint64_t t = SipfGnssUnixMs(&fix);
+    if (t != 0) {
+      return t + age_ms;
+    }
   }
+#endif
+  return 0;
+}
 
-  available_len = Serial2.available();
-  for (int i = 0; i < available_len; i++) {
-    unsigned char b = Serial2.read();
-    Serial.write(b);
+static void onTxQueueSent(SipfTxQueue *q, int result, uint64_t timestamp_ms, const uint8_t *otid, void *arg)
+{
+  if (result == 0) {
+    M5.Lcd.printf("OK\nOTID: %s (%u queued)\n", otid, SipfTxQueueCount(q));
+    drawButton(0, cnt_btn1);
+  } else {
+    M5.Lcd.printf("NG: %d (%u queued, retry later)\n", result, SipfTxQueueCount(q));
   }
-#ifdef ENABLE_GNSS
-  /* GNSS */
-  static unsigned long last_gnss_updated = 0;
-  if(last_gnss_updated + 1000 < millis()){
-    last_gnss_updated = millis();
-    GnssLocation gnss_location;
-    int ret = SipfGetGnssLocation(&gnss_location);
-    if (ret == 0) {
-      drawGnssLocation(&gnss_location);
+}
+
+/* 受信したオブジェクトの値を型ごとに表示する */
+struct RxValuePrinter {
+  void operator()(uint8_t tag, uint8_t v) { M5.Lcd.printf("%u\r\n", v); }
+  void operator()(uint8_t tag, int8_t v) { M5.Lcd.printf("%d\r\n", v); }
+  void operator()(uint8_t tag, uint16_t v) { M5.Lcd.printf("%u\r\n", v); }
+  void operator()(uint8_t tag, int16_t v) { M5.Lcd.printf("%d\r\n", v); }
+  void operator()(uint8_t tag, uint32_t v) { M5.Lcd.printf("%u\r\n", v); }
+  void operator()(uint8_t tag, int32_t v) { M5.Lcd.printf("%d\r\n", v); }
+  void operator()(uint8_t tag, uint64_t v) { M5.Lcd.printf("%llu\r\n", v); }
+  void operator()(uint8_t tag, int64_t v) { M5.Lcd.printf("%lld\r\n", v); }
+  void operator()(uint8_t tag, float v) { M5.Lcd.printf("%f\r\n", v); }
+  void operator()(uint8_t tag, double v) { M5.Lcd.printf("%lf\r\n", v); }
+  void operator()(uint8_t tag, SipfObjTypeId type, const uint8_t *value, uint8_t len) {
+    if (type == OBJ_TYPE_BIN) {
+      M5.Lcd.printf("0x");
+      for (int j = 0; j < len; j++) {
+        M5.Lcd.printf("%02x", value[j]);
+      }
     } else {
-      drawGnssLocation(NULL);
+      for (int j = 0; j < len; j++) {
+        M5.Lcd.printf("%c", value[j]);
+      }
     }
+    M5.Lcd.printf("\r\n");
+  }
+};
+
+static int onRxMsg(const SipfRxMessage *msg, void *arg)
+{
+  RxValuePrinter printer;
+  int ret = msg->obj_cnt;
+  SipfObjObject *objs = msg->obj_list;
+  time_t t;
+  struct tm *ptm;
+  static char ts[128];
+  M5.Lcd.printf("OTID: %s\r\n", msg->otid);
+  //User send datetime.
+  t = (time_t)(msg->user_send_datetime_ms / 1000);
+  ptm = localtime(&t);
+  strftime(ts, sizeof(ts),"User send datetime(UTC)    : %Y/%m/%d %H:%M:%S\r\n", ptm);
+  M5.Lcd.printf(ts);
+  //SIPF receive datetime.
+  t = (time_t)(msg->sipf_recv_datetime_ms / 1000);
+  ptm = localtime(&t);
+  strftime(ts, sizeof(ts),"SIPF received datetime(UTC): %Y/%m/%d %H:%M:%S\r\n", ptm);
+  M5.Lcd.printf(ts);
+  //remain, qty
+  M5.Lcd.printf("remain=%d, qty=%d\r\n", msg->remain, msg->obj_qty);
+  //obj
+  for (int i = 0; i < ret; i++) {
+    M5.Lcd.printf("obj[%d]:tag=0x%02x, type=0x%02x, len=%d, value=", i, objs[i].tag_id, objs[i].type, objs[i].value_len);
+    SipfObjVisit(objs[i], printer);
+  }
+  return 0;
+}
+
+static SipfReq req_fput;
+
+/* ファイル送信(順番が来たらエンジンから呼ばれる. 送信中はUARTを占有する) */
+static int fputSample(void *arg)
+{
+  return SipfCmdFput("FPUT_SAMPLE_M5.txt", buff, sizeof(buff));
+}
+
+static void onFputDone(SipfReq *req, int ret, void *arg)
+{
+  if (ret == 0) {
+    M5.Lcd.printf("OK\n");
+  } else {
+    M5.Lcd.printf("NG: %d\n", ret);
+  }
+}
+
+static void onRxDone(SipfRxDrain *drain, int ret, void *arg)
+{
+  if (ret > 0) {
+    M5.Lcd.printf("%d message(s)\nOK\n", ret);
+  } else if (ret == 0) {
+    M5.Lcd.printf("RX buffer is empty.\nOK\n");
+  } else {
+    M5.Lcd.printf("NG: %d\n", ret);
+  }
+}
+
+#if SIPF_STATS
+static void printStatsLine(const char *line, void *arg)
+{
+  Serial.println(line);
+}
+#endif
+
+void loop() {
+  // put your main code here, to run repeatedly:
+  int available_len;
+  /* コマンドを進める */
+  SipfPoll();
+
+  /* PCからの入力をモジュールへ中継(コマンド実行中は溜めておいて後で送る. モジュールからの受信はSipfPoll()が中継する) */
+  available_len = Serial.available();
+  if (available_len > 0) {
+    uint8_t con[64];
+    int len = Serial.readBytes(con, (available_len < (int)sizeof(con)) ? available_len : (int)sizeof(con));
+    SipfMuxConsoleInput(con, len);
   }
+#ifdef ENABLE_GNSS
+  /* GNSS(次の周期までに送れなかった問い合わせは送らずに捨てる) */
+  SipfSetPriority(SIPF_PRIO_NORMAL, 1000);
+  SipfGnssTrackerPoll(&gnss_tracker);
+  SipfSetPriority(SIPF_PRIO_NORMAL, 0);
 #endif
 
   /* `TX1'ボタンを押した */
@@ -260,116 +447,29 @@ void loop() {
     cnt_btn1++;
     drawResultWindow();
     M5.Lcd.printf("ButtonA pushed: TX(tag_id=0x01 value=%d)\n", cnt_btn1);
-    memset(buff, 0, sizeof(buff));
-    int ret = SipfCmdTx(0x01, OBJ_TYPE_UINT32, (uint8_t*)&cnt_btn1, 4, buff);
-    if (ret == 0) {
-      M5.Lcd.printf("OK\nOTID: %s\n", buff);
-      drawButton(0, cnt_btn1);
-    } else {
-      M5.Lcd.printf("NG: %d\n", ret);
+    uint64_t ts = nowUnixMs();
+    SipfTxBatchBegin(&tx_batch);
+    SipfTxBatchAddValue(&tx_batch, 0x01, cnt_btn1);
+    if (ts != 0) {
+      SipfTxBatchAddValue(&tx_batch, 0x02, ts);  // 押した時刻(キューで待った分だけ遅れて届くので一緒に送る)
+    }
+    if (SipfTxQueuePut(&txq, &tx_batch, ts) != 0) {
+      M5.Lcd.printf("NG: TX queue is full\n");
     }
   }
+  /* キューに溜まったメッセージを送る */
+  SipfTxQueuePoll(&txq);
 
   /* `RX'ボタンを押した */
-  if (M5.BtnB.wasPressed()) {
+  if (M5.BtnB.wasPressed() && !rx_drain.req.busy) {
     drawResultWindow();
     M5.Lcd.printf("ButtonB pushed: RX request.\n");
-    memset(buff, 0, sizeof(buff));
-
-		static SipfObjObject objs[16];
-		uint64_t stm, rtm;
-		uint8_t remain, qty;
-    int ret = SipfCmdRx(buff, &stm, &rtm, &remain, &qty, objs, 16);
-    if (ret > 0) {
-      time_t t;
-      struct tm *ptm;
-      static char ts[128];
-      M5.Lcd.printf("OTID: %s\r\n", buff);
-      //User send datetime.
-      t = (time_t)(stm / 1000);
-      ptm = localtime(&t);
-      strftime(ts, sizeof(ts),"User send datetime(UTC)    : %Y/%m/%d %H:%M:%S\r\n", ptm);
-      M5.Lcd.printf(ts);
-      //SIPF receive datetime.
-      t = (time_t)(rtm / 1000);
-      ptm = localtime(&t);
-      strftime(ts, sizeof(ts),"SIPF received datetime(UTC): %Y/%m/%d %H:%M:%S\r\n", ptm);
-      M5.Lcd.printf(ts);
-      //remain, qty
-      M5.Lcd.printf("remain=%d, qty=%d\r\n", remain, qty);
-      //obj
-      for (int i = 0; i < ret; i++) {
-        M5.Lcd.printf("obj[%d]:tag=0x%02x, type=0x%02x, len=%d, value=", i, objs[i].tag_id, objs[i].type, objs[i].value_len);
-        uint8_t *p_value = objs[i].value;
-        SipfObjPrimitiveType v;
-        switch (objs[i].type) {
-        case OBJ_TYPE_UINT8:
-          memcpy(v.b, p_value, sizeof(uint8_t));
-          M5.Lcd.printf("%u\r\n", v.u8);
-          break;
-        case OBJ_TYPE_INT8:
-          memcpy(v.b, p_value, sizeof(int8_t));
-          M5.Lcd.printf("%d\r\n", v.i8);
-          break;
-        case OBJ_TYPE_UINT16:
-          memcpy(v.b, p_value, sizeof(uint16_t));
-          M5.Lcd.printf("%u\r\n", v.u16);
-          break;
-        case OBJ_TYPE_INT16:
-          memcpy(v.b, p_value, sizeof(int16_t));
-          M5.Lcd.printf("%d\r\n", v.i16);
-          break;
-        case OBJ_TYPE_UINT32:
-          memcpy(v.b, p_value, sizeof(uint32_t));
-          M5.Lcd.printf("%u\r\n", v.u32);
-          break;
-        case OBJ_TYPE_INT32:
-          memcpy(v.b, p_value, sizeof(int32_t));
-          M5.Lcd.printf("%d\r\n", v.i32);
-          break;
-        case OBJ_TYPE_UINT64:
-          memcpy(v.b, p_value, sizeof(uint64_t));
-          M5.Lcd.printf("%llu\r\n", v.u64);
-          break;
-        case OBJ_TYPE_INT64:
-          memcpy(v.b, p_value, sizeof(int64_t));
-          M5.Lcd.printf("%lld\r\n", v.i64);
-          break;
-        case OBJ_TYPE_FLOAT32:
-          memcpy(v.b, p_value, sizeof(float));
-          M5.Lcd.printf("%f\r\n", v.f);
-          break;
-        case OBJ_TYPE_FLOAT64:
-          memcpy(v.b, p_value, sizeof(double));
-          M5.Lcd.printf("%lf\r\n", v.d);
-          break;
-        case OBJ_TYPE_BIN:
-          M5.Lcd.printf("0x");
-          for (int j = 0; j < objs[i].value_len; j++) {
-            M5.Lcd.printf("%02x", objs[i].value[j]);
-          }
-          M5.Lcd.printf("\r\n");
-          break;
-        case OBJ_TYPE_STR_UTF8:
-          for (int j = 0; j < objs[i].value_len; j++) {
-            M5.Lcd.printf("%c", objs[i].value[j]);
-          }
-          M5.Lcd.printf("\r\n");
-          break;
-        default:
-          break;
-        } 
-      }
-      M5.Lcd.printf("OK\n");
-    } else if (ret == 0) {
-      M5.Lcd.printf("RX buffer is empty.\nOK\n");
-    } else {
-      M5.Lcd.printf("NG: %d\n", ret);
-    }
+    // 溜まっているメッセージをまとめて受信する(最大32件, 10秒まで)
+    SipfSubmitRxDrain(&rx_drain, NULL, objs, 16, 32, 10000, onRxMsg, onRxDone, NULL);
   }
 
   /* `FILE'ボタンを押した */
-  if (M5.BtnC.wasPressed()) {
+  if (M5.BtnC.wasPressed() && !req_fput.busy) {
     drawResultWindow();
     M5.Lcd.printf("ButtonC pushed: FILE PUT request.\n");
     //テキストファイルを用意
@@ -381,13 +481,25 @@ void loop() {
 
     M5.Lcd.printf("\n\n%s\n\n", (char *)buff);
 
-    int ret = SipfCmdFput("FPUT_SAMPLE_M5.txt", buff, sizeof(buff));
-    if (ret == 0) {
-      M5.Lcd.printf("OK\n");
-    } else {
-      M5.Lcd.printf("NG: %d\n", ret);
-    }
+    // 長い転送なので待っている送信や問い合わせを先に済ませてから始める
+    SipfSetPriority(SIPF_PRIO_BULK, 0);
+    SipfSubmitCall(&req_fput, fputSample, NULL, onFputDone, NULL);
+    SipfSetPriority(SIPF_PRIO_NORMAL, 0);
   }
 
+#if SIPF_STATS
+  /* 統計を1分ごとにUSBシリアルへ出す */
+  static unsigned long last_stats_dumped = 0;
+  if ((millis() - last_stats_dumped >= 60000) && !SipfIsBusy()) {
+    last_stats_dumped = millis();
+    SipfStatsDump(printStatsLine, NULL);
+    SipfMuxCounters mux;
+    SipfMuxGetCounters(&mux);
+    Serial.printf("console relayed in=%lu out=%lu, dropped in=%lu out=%lu\n",
+                  (unsigned long)mux.relayed_in, (unsigned long)mux.relayed_out,
+                  (unsigned long)mux.dropped_in, (unsigned long)mux.dropped_out);
+  }
+#endif
+
   M5.update();
 }
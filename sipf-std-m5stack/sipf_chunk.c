@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sipf_chunk.h"
+#include "sipf_crc.h"
+
+/*
+ * 進み具合の記憶領域の配置
+ *   [0, 64)      管理情報A
+ *   [64, 128)    管理情報B(世代の大きい方が有効. 交互に書くので書きかけで壊れても片方は残る)
+ *   [128, size)  送れたチャンクのCRC-32(チャンク番号順. マニフェストに書く)
+ * チャンクを送れたらCRC-32を書いてから管理情報の送れたチャンク数を進める
+ */
+#define CHUNK_MAGIC_META    (0x4b484353)    // "SCHK"
+#define CHUNK_META_SZ       (64)
+#define CHUNK_CRC_OFS       (CHUNK_META_SZ * 2)
+
+#define CHUNK_FLAG_MANIFEST (0x01)          // マニフェストまで送れた
+#define CHUNK_FLAG_LZ       (0x02)          // チャンクを圧縮して送っている
+
+#define CHUNK_RETRY_MS      (1000)
+#define CHUNK_RETRY_MAX_MS  (60000)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t sz_file;
+    uint32_t sz_chunk;
+    uint32_t done;
+    uint32_t flags;
+    char file_id[SIPF_CHUNK_FILE_ID_MAX];
+    uint32_t crc;
+}   ChunkMeta;
+
+static int chunkRead(const SipfStore *st, uint32_t off, void *buff, int len)
+{
+    return (st->read(st->ctx, off, (uint8_t*)buff, len) == len) ? 0 : -1;
+}
+
+static int chunkWrite(const SipfStore *st, uint32_t off, const void *buff, int len)
+{
+    return (st->write(st->ctx, off, (const uint8_t*)buff, len) == len) ? 0 : -1;
+}
+
+static uint32_t chunkFlags(const SipfChunkUpload *up)
+{
+    return (up->manifest_sent ? CHUNK_FLAG_MANIFEST : 0) | ((up->lz != NULL) ? CHUNK_FLAG_LZ : 0);
+}
+
+/**
+ * 管理情報を次の世代として書く
+ */
+static int chunkCommit(SipfChunkUpload *up)
+{
+    ChunkMeta meta;
+    memset(&meta, 0, sizeof(meta));
+    meta.magic = CHUNK_MAGIC_META;
+    meta.gen = up->gen + 1;
+    meta.sz_file = up->sz_file;
+    meta.sz_chunk = up->sz_chunk;
+    meta.done = up->done;
+    meta.flags = chunkFlags(up);
+    memcpy(meta.file_id, up->file_id, sizeof(meta.file_id));
+    meta.crc = SipfCrc32(0, (const uint8_t*)&meta, sizeof(meta));
+    if ((chunkWrite(up->progress, (meta.gen & 1) * CHUNK_META_SZ, &meta, sizeof(meta)) != 0) ||
+        (up->progress->sync(up->progress->ctx) != 0)) {
+        return -1;
+    }
+    up->gen = meta.gen;
+    return 0;
+}
+
+static uint32_t chunkSize(const SipfChunkUpload *up, uint32_t idx)
+{
+    uint32_t base = idx * up->sz_chunk;
+    return ((up->sz_file - base) < up->sz_chunk) ? (up->sz_file - base) : up->sz_chunk;
+}
+
+/**
+ * チャンクのFILE_ID
+ * lz_suffix: 圧縮して送るときに付く接尾辞も付ける(マニフェスト用)
+ */
+static void chunkId(const SipfChunkUpload *up, uint32_t idx, bool lz_suffix, char *dst, int len)
+{
+    snprintf(dst, len, "%s.p%04lu%s", up->file_id, (unsigned long)idx,
+             (lz_suffix && (up->lz != NULL)) ? SIPF_LZ_FILE_SUFFIX : "");
+}
+
+/**
+ * ファイルのidx番目のチャンクのCRC-32を求める
+ */
+static int chunkCrc(const SipfChunkUpload *up, uint32_t idx, uint32_t *crc)
+{
+    uint8_t buf[256];
+    uint32_t base = idx * up->sz_chunk;
+    uint32_t sz = chunkSize(up, idx);
+    *crc = 0;
+    for (uint32_t off = 0; off < sz;) {
+        int len = ((sz - off) < sizeof(buf)) ? (int)(sz - off) : (int)sizeof(buf);
+        if (chunkRead(up->src, base + off, buf, len) != 0) {
+            return -1;
+        }
+        *crc = SipfCrc32(*crc, buf, len);
+        off += len;
+    }
+    return 0;
+}
+
+/**
+ * 進み具合を復元する
+ * 同じファイル(FILE_ID, 大きさ, チャンクの大きさ, 圧縮の有無)の記録があれば, 送れたチャンクの中身が変わっていないか
+ * CRC-32で確かめて, 変わっていない最初のチャンクまでを送れたものとする. 記録が無ければ最初から送る
+ * src: 送るファイル(sz_fileバイト. SipfStorePosixOpen()やSipfStoreArduinoOpen()で開く)
+ * sz_chunk: チャンクの大きさ(0ならSIPF_CHUNK_SZ_DEFAULT)
+ * lz: NULLでなければチャンクを圧縮して送る(SipfCmdFputLzMeasured())
+ * return: 0: 成功, -1: FILE_IDが長すぎる・記憶領域にCRC-32が入りきらない・書き込めない
+ */
+int SipfChunkOpen(SipfChunkUpload *up, const SipfStore *progress, const SipfStore *src, uint32_t sz_file,
+                  const char *file_id, uint32_t sz_chunk, SipfLzEncoder *lz, SipfChunkCallback cb, void *arg)
+{
+    memset(up, 0, sizeof(SipfChunkUpload));
+    if (strlen(file_id) >= SIPF_CHUNK_FILE_ID_MAX) {
+        return -1;
+    }
+    up->progress = progress;
+    up->src = src;
+    up->lz = lz;
+    strcpy(up->file_id, file_id);
+    up->sz_file = sz_file;
+    up->sz_chunk = (sz_chunk > 0) ? sz_chunk : SIPF_CHUNK_SZ_DEFAULT;
+    up->cnt_chunk = (sz_file + (up->sz_chunk - 1)) / up->sz_chunk;
+    up->retry_ms = CHUNK_RETRY_MS;
+    up->retry_max_ms = CHUNK_RETRY_MAX_MS;
+    up->cur_retry_ms = CHUNK_RETRY_MS;
+    up->t_next = SipfClientMillis();
+    up->cb = cb;
+    up->arg = arg;
+    if (progress->size < (CHUNK_CRC_OFS + up->cnt_chunk * sizeof(uint32_t))) {
+        return -1;
+    }
+
+    // 新しい方の管理情報を使う
+    bool found = false;
+    ChunkMeta cur;
+    for (int i = 0; i < 2; i++) {
+        ChunkMeta meta;
+        if (chunkRead(progress, i * CHUNK_META_SZ, &meta, sizeof(meta)) != 0) {
+            continue;
+        }
+        uint32_t crc = meta.crc;
+        meta.crc = 0;
+        if ((meta.magic != CHUNK_MAGIC_META) || (crc != SipfCrc32(0, (const uint8_t*)&meta, sizeof(meta)))) {
+            continue;
+        }
+        if (!found || ((int32_t)(meta.gen - up->gen) > 0)) {
+            found = true;
+            up->gen = meta.gen;
+            cur = meta;
+        }
+    }
+    if (!found || (cur.sz_file != sz_file) || (cur.sz_chunk != up->sz_chunk) ||
+        ((cur.flags & CHUNK_FLAG_LZ) != (chunkFlags(up) & CHUNK_FLAG_LZ)) ||
+        (strncmp(cur.file_id, file_id, sizeof(cur.file_id)) != 0)) {
+        // 別のファイルの記録なので最初から
+        return chunkCommit(up);
+    }
+    up->done = (cur.done < up->cnt_chunk) ? cur.done : up->cnt_chunk;
+    up->manifest_sent = ((cur.flags & CHUNK_FLAG_MANIFEST) != 0) && (up->done == up->cnt_chunk);
+
+    // 送れたチャンクの中身が変わっていないか確かめる
+    for (uint32_t i = 0; i < up->done; i++) {
+        uint32_t crc, crc_sent;
+        if ((chunkRead(progress, CHUNK_CRC_OFS + i * sizeof(uint32_t), &crc_sent, sizeof(crc_sent)) != 0) ||
+            (chunkCrc(up, i, &crc) != 0) || (crc != crc_sent)) {
+            up->done = i;
+            up->manifest_sent = false;
+            return chunkCommit(up);
+        }
+    }
+    return 0;
+}
+
+/**
+ * 同じファイルを最初から送り直す
+ */
+int SipfChunkRestart(SipfChunkUpload *up)
+{
+    if (up->sending) {
+        return -1;
+    }
+    up->done = 0;
+    up->manifest_sent = false;
+    up->measured = false;
+    up->cur_retry_ms = up->retry_ms;
+    up->t_next = SipfClientMillis();
+    return chunkCommit(up);
+}
+
+/**
+ * 送信中のチャンクを読み出すreader(読んだ分のCRC-32を求める)
+ */
+static int chunkSrcRead(uint8_t *buff, int len, void *arg)
+{
+    SipfChunkUpload *up = (SipfChunkUpload*)arg;
+    if (chunkRead(up->src, up->base + up->off, buff, len) != 0) {
+        return -1;
+    }
+    up->crc = SipfCrc32(up->crc, buff, len);
+    up->off += len;
+    return len;
+}
+
+static int chunkSrcRewind(void *arg)
+{
+    SipfChunkUpload *up = (SipfChunkUpload*)arg;
+    up->off = 0;
+    up->crc = 0;
+    return 0;
+}
+
+/**
+ * マニフェストのno行目を作る
+ *   SIPF-CHUNKED 1
+ *   file <FILE_ID> <大きさ> <チャンクの大きさ> <チャンク数>
+ *   chunk <番号> <チャンクのFILE_ID> <位置> <大きさ> <CRC-32>
+ * return: 行の長さ, -1: CRC-32を読み出せない
+ */
+static int chunkManifestLine(SipfChunkUpload *up, uint32_t no, char *line, int len)
+{
+    if (no == 0) {
+        return snprintf(line, len, "SIPF-CHUNKED 1\n");
+    }
+    if (no == 1) {
+        return snprintf(line, len, "file %s %lu %lu %lu\n", up->file_id, (unsigned long)up->sz_file,
+                        (unsigned long)up->sz_chunk, (unsigned long)up->cnt_chunk);
+    }
+    uint32_t idx = no - 2;
+    uint32_t crc;
+    char id[sizeof(up->id)];
+    if (chunkRead(up->progress, CHUNK_CRC_OFS + idx * sizeof(uint32_t), &crc, sizeof(crc)) != 0) {
+        return -1;
+    }
+    chunkId(up, idx, true, id, sizeof(id));
+    return snprintf(line, len, "chunk %lu %s %lu %lu %08lx\n", (unsigned long)idx, id,
+                    (unsigned long)(idx * up->sz_chunk), (unsigned long)chunkSize(up, idx), (unsigned long)crc);
+}
+
+/**
+ * マニフェストを1行ずつ作りながら読み出すreader
+ */
+static int chunkManifestRead(uint8_t *buff, int len, void *arg)
+{
+    SipfChunkUpload *up = (SipfChunkUpload*)arg;
+    int got = 0;
+    while (got < len) {
+        if (up->line_idx >= up->line_len) {
+            if (up->line_no >= (up->cnt_chunk + 2)) {
+                break;
+            }
+            up->line_len = chunkManifestLine(up, up->line_no++, up->line, sizeof(up->line));
+            up->line_idx = 0;
+            if (up->line_len < 0) {
+                return -1;
+            }
+            continue;
+        }
+        int n = up->line_len - up->line_idx;
+        if (n > (len - got)) {
+            n = len - got;
+        }
+        memcpy(&buff[got], &up->line[up->line_idx], n);
+        up->line_idx += n;
+        got += n;
+    }
+    return (got > 0) ? got : -1;
+}
+
+/**
+ * 次のチャンクかマニフェストを送る(SIPF_REQ_CALLとしてエンジンから呼ばれる)
+ */
+static int chunkSend(void *arg)
+{
+    SipfChunkUpload *up = (SipfChunkUpload*)arg;
+    if (up->done < up->cnt_chunk) {
+        up->base = up->done * up->sz_chunk;
+        chunkSrcRewind(up);
+        // 圧縮するときはSipfCmdFputLzMeasured()が接尾辞を付ける
+        chunkId(up, up->done, false, up->id, sizeof(up->id));
+        if (up->lz != NULL) {
+            // 大きさはSipfChunkPoll()で測ってあるので圧縮しながら送るだけ
+            return SipfCmdFputLzMeasured(up->id, chunkSize(up, up->done), up->sz_lz, up->crc_lz, chunkSrcRead, up, up->lz);
+        }
+        return SipfCmdFputStream(up->id, chunkSize(up, up->done), chunkSrcRead, up);
+    }
+
+    // マニフェストの大きさを数えてから送る
+    uint32_t sz = 0;
+    for (uint32_t no = 0; no < (up->cnt_chunk + 2); no++) {
+        int len = chunkManifestLine(up, no, up->line, sizeof(up->line));
+        if (len < 0) {
+            return -1;
+        }
+        sz += len;
+    }
+    up->line_no = 0;
+    up->line_len = 0;
+    up->line_idx = 0;
+    snprintf(up->id, sizeof(up->id), "%s%s", up->file_id, SIPF_CHUNK_MANIFEST_SUFFIX);
+    return SipfCmdFputStream(up->id, sz, chunkManifestRead, up);
+}
+
+/**
+ * チャンクかマニフェストの送信の完了
+ */
+static void chunkOnSent(SipfReq *req, int result, void *arg)
+{
+    SipfChunkUpload *up = (SipfChunkUpload*)arg;
+    uint32_t now = SipfClientMillis();
+    uint32_t idx = up->done;
+
+    up->sending = false;
+    if (result == 0) {
+        if (up->done < up->cnt_chunk) {
+            // CRC-32を書いてから送れたチャンク数を進める
+            if (chunkWrite(up->progress, CHUNK_CRC_OFS + up->done * sizeof(uint32_t), &up->crc, sizeof(up->crc)) == 0) {
+                up->done++;
+            } else {
+                result = -1;
+            }
+        } else {
+            up->manifest_sent = true;
+        }
+        if ((result == 0) && (chunkCommit(up) != 0)) {
+            // 記録できなければ同じチャンクを送り直す
+            up->done = idx;
+            up->manifest_sent = false;
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        up->cur_retry_ms = up->retry_ms;
+        up->t_next = now;
+    } else {
+        // しばらく待ってから送れていない最初のチャンクから送り直す
+        up->t_next = now + up->cur_retry_ms;
+        up->cur_retry_ms = ((up->cur_retry_ms * 2) > up->retry_max_ms) ? up->retry_max_ms : (up->cur_retry_ms * 2);
+    }
+    if (up->cb != NULL) {
+        up->cb(up, idx, result, up->arg);
+    }
+}
+
+/**
+ * 次に送るチャンクを圧縮したときの大きさを測る(呼び出したスレッドで行う. 送り直すときは測り直さない)
+ * return: 0: 成功, -1: 読み出せない
+ */
+static int chunkMeasure(SipfChunkUpload *up)
+{
+    if ((up->lz == NULL) || (up->done >= up->cnt_chunk) || (up->measured && (up->lz_idx == up->done))) {
+        return 0;
+    }
+    up->measured = false;
+    up->base = up->done * up->sz_chunk;
+    chunkSrcRewind(up);
+    int32_t sz_lz = SipfLzMeasure(up->lz, chunkSize(up, up->done), chunkSrcRead, up, &up->crc_lz);
+    if (sz_lz < 0) {
+        return -1;
+    }
+    up->measured = true;
+    up->lz_idx = up->done;
+    up->sz_lz = sz_lz;
+    return 0;
+}
+
+/**
+ * 送れていないチャンクかマニフェストがあれば送る(loop()から呼ぶ)
+ * 送れたら続けて次を送る. 失敗したら間隔を空けて同じチャンクを送り直す
+ * 送信はSIPF_REQ_CALLの要求として呼び出したスレッドの優先度(SipfSetPriority())で積む
+ * 圧縮するときは積む前にここで大きさを測るので, SIPF_REQ_CALLの間は圧縮しながら送るだけになる
+ */
+void SipfChunkPoll(SipfChunkUpload *up)
+{
+    if (up->sending || up->manifest_sent) {
+        return;
+    }
+    if ((int32_t)(SipfClientMillis() - up->t_next) < 0) {
+        return;
+    }
+    if (chunkMeasure(up) != 0) {
+        // 送れなかったときと同じく間隔を空けてやり直す
+        chunkOnSent(&up->req, -1, up);
+        return;
+    }
+    if (SipfSubmitCall(&up->req, chunkSend, up, chunkOnSent, up) == 0) {
+        up->sending = true;
+    }
+}
+
+/**
+ * マニフェストまで送れたか
+ */
+bool SipfChunkIsDone(const SipfChunkUpload *up)
+{
+    return up->manifest_sent;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_CHUNK_H_
+#define _SIPF_CHUNK_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sipf_client.h"
+#include "sipf_lz.h"
+#include "sipf_store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIPF_CHUNK_SZ_DEFAULT       (64 * 1024)
+#define SIPF_CHUNK_FILE_ID_MAX      (32)        // FILE_IDの最大長('\0'を含む)
+#define SIPF_CHUNK_MANIFEST_SUFFIX  ".man"
+
+typedef struct SipfChunkUpload SipfChunkUpload;
+/* チャンクかマニフェストの送信を試みるたびに呼ばれる(idx: チャンク番号. マニフェストはチャンク数と同じ値) */
+typedef void (*SipfChunkCallback)(SipfChunkUpload *up, uint32_t idx, int result, void *arg);
+
+/**
+ * 大きなファイルをチャンクに分けて1つずつ$$FPUTで送り, 最後にマニフェスト(チャンクのFILE_ID, 位置, 大きさ, CRC-32)を送る
+ * 送れたチャンクは記憶領域(SipfStore)に記録するので, 失敗したり電源が切れたりしても送れていない最初のチャンクから続けられる
+ * チャンクのFILE_IDは "<file_id>.pNNNN"(lzを指定したときはさらにSIPF_LZ_FILE_SUFFIX), マニフェストは "<file_id>.man"
+ */
+struct SipfChunkUpload {
+    const SipfStore *progress;  // 進み具合の記録先
+    const SipfStore *src;       // 送るファイル(読み出しだけ使う)
+    SipfLzEncoder *lz;          // NULLでなければチャンクを圧縮して送る
+    char file_id[SIPF_CHUNK_FILE_ID_MAX];
+    uint32_t sz_file;
+    uint32_t sz_chunk;
+    uint32_t cnt_chunk;
+    uint32_t gen;               // 管理情報の世代
+    uint32_t done;              // 送れたチャンク数(先頭から)
+    bool manifest_sent;
+    uint32_t retry_ms;          // 送信に失敗したら待つ時間(失敗が続くとretry_max_msまで倍々に延ばす)
+    uint32_t retry_max_ms;
+    uint32_t cur_retry_ms;
+    uint32_t t_next;            // 次に送信してよい時刻[ms](SipfClientMillis())
+    bool sending;
+    uint32_t base;              // 送信中のチャンクの先頭
+    uint32_t off;               // 送信中のチャンクを読んだ位置
+    uint32_t crc;               // 送信中のチャンクを読んだ分のCRC-32
+    bool measured;              // 圧縮したときの大きさを測ってある(lz_idx番目のチャンク)
+    uint32_t lz_idx;
+    uint32_t sz_lz;             // 圧縮したときの大きさ
+    uint32_t crc_lz;            // 圧縮前のCRC-32
+    char id[SIPF_CHUNK_FILE_ID_MAX + 16];   // 送信中のFILE_ID
+    uint32_t line_no;           // マニフェストの次に読み出す行
+    char line[112];             // マニフェストの読み出し中の行
+    int line_len;
+    int line_idx;
+    SipfReq req;
+    SipfChunkCallback cb;
+    void *arg;
+};
+
+int SipfChunkOpen(SipfChunkUpload *up, const SipfStore *progress, const SipfStore *src, uint32_t sz_file,
+                  const char *file_id, uint32_t sz_chunk, SipfLzEncoder *lz, SipfChunkCallback cb, void *arg);
+int SipfChunkRestart(SipfChunkUpload *up);
+void SipfChunkPoll(SipfChunkUpload *up);
+bool SipfChunkIsDone(const SipfChunkUpload *up);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -3,152 +3,1620 @@
  *
  * SPDX-License-Identifier: MIT
  */
-#include <Arduino.h>
 #include "sipf_client.h"
+#include "sipf_gnss.h"
+#include "sipf_hex.h"
+#include "sipf_line.h"
+#include "sipf_lz.h"
+#include "sipf_stats.h"
+#include "sipf_transport.h"
 #include "xmodem.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define FPUT_RETRY_MAX	(3)
 
-static char cmd[512];
-static uint32_t fw_version;
+// 既定のクライアント(SipfClientSet()していないスレッドはこれを使う)
+static SipfClient client_default;
+// 呼び出したスレッドの今のクライアント
+static SIPF_THREAD_LOCAL SipfClient *client = &client_default;
 
-//UARTの受信バッファを読み捨てる
+/**
+ * クライアントを初期化する
+ * tr: モジュールとのトランスポート(NULLならSipfTransportSet()で設定したものを使う)
+ */
+void SipfClientInit(SipfClient *c, const SipfTransport *tr)
+{
+    memset(c, 0, sizeof(SipfClient));
+    c->tr = tr;
+    SipfRxArenaInit(&c->rx_arena, c->rx_value_buff, sizeof(c->rx_value_buff));
+}
+
+/**
+ * 呼び出したスレッドで操作するクライアントを切り替える(NULLなら既定のクライアント)
+ * クライアントのトランスポートと統計の記録先も切り替わる
+ */
+void SipfClientSet(SipfClient *c)
+{
+    client = (c != NULL) ? c : &client_default;
+    if (client->tr != NULL) {
+        SipfTransportSet(client->tr);
+    }
+#if SIPF_STATS
+    SipfStatsBind(client->stats);
+#endif
+}
+
+SipfClient *SipfClientGet(void)
+{
+    return client;
+}
+
+// スレッドの目印(アドレスがスレッドごとに違う)
+static SIPF_THREAD_LOCAL uint8_t thread_mark;
+
+static inline const void *sipfThisThread(void)
+{
+    return &thread_mark;
+}
+
+/* ワーカーがいて, 呼び出したスレッドがワーカーではない */
+static inline bool sipfIsForeign(void)
+{
+    return (client->worker != NULL) && (client->worker != sipfThisThread());
+}
+
+/**
+ * SIPF_REQ_CALLの関数の中から呼ばれたか(その間はエンジンが止まっているので他の要求は進まない)
+ */
+static inline bool sipfInCall(void)
+{
+    return !sipfIsForeign() && client->engine.in_call;
+}
+
+/**
+ * 呼び出したスレッドをクライアントのワーカーにする(clientは今のクライアントにもなる)
+ * 以降は他のスレッドからのSipfSubmit*()や同期版APIは受信箱に積まれ, ワーカーのSipfPoll()で順に実行される
+ * 他のスレッドのSipfPoll()は何もしない
+ */
+void SipfClientAttachWorker(SipfClient *c)
+{
+    SipfClientSet(c);
+    client->worker_tr = SipfTransportGet();
+    __atomic_store_n(&client->worker, sipfThisThread(), __ATOMIC_RELEASE);
+}
+
+/**
+ * 要求の投入と完了待ちで使う時計
+ * トランスポートはスレッドごとなので, SipfTransportSet()していないスレッドはクライアントかワーカーのものを使う
+ */
+static const SipfTransport *sipfClock(void)
+{
+    const SipfTransport *tr = SipfTransportGet();
+    if (tr == NULL) {
+        tr = (client->tr != NULL) ? client->tr : client->worker_tr;
+    }
+    return tr;
+}
+
+/**
+ * 今のクライアントの時計[ms]
+ * トランスポートを持たないスレッド(ワーカーを使うときのloop()など)でも, ワーカーと同じ時計で時間を測れる
+ */
+uint32_t SipfClientMillis(void)
+{
+    const SipfTransport *tr = sipfClock();
+    return (tr != NULL) ? tr->millis(tr->ctx) : 0;
+}
+
+static void sipfDelay(uint32_t ms)
+{
+    const SipfTransport *tr = sipfClock();
+    if (tr != NULL) {
+        tr->delay(tr->ctx, ms);
+    }
+}
+
+static void regCachePut(uint8_t addr, uint8_t value)
+{
+    client->reg_cache.value[addr] = value;
+    client->reg_cache.valid[addr >> 3] |= (1 << (addr & 7));
+}
+
+static bool regCacheGet(uint8_t addr, uint8_t *value)
+{
+    if ((client->reg_cache.valid[addr >> 3] & (1 << (addr & 7))) == 0) {
+        return false;
+    }
+    *value = client->reg_cache.value[addr];
+    return true;
+}
+
+/**
+ * レジスタのキャッシュを捨てる(モジュールをリセットしたときなど)
+ */
+void SipfRegCacheInvalidate(void)
+{
+    memset(client->reg_cache.valid, 0, sizeof(client->reg_cache.valid));
+}
+
+/**
+ * クライアントの既定の受信領域
+ */
+static SipfRxArena *sipfDefaultArena(void)
+{
+    if (client->rx_arena.buff == NULL) {
+        // SipfClientInit()していない既定のクライアント
+        SipfRxArenaInit(&client->rx_arena, client->rx_value_buff, sizeof(client->rx_value_buff));
+    }
+    return &client->rx_arena;
+}
+
+void SipfRxArenaInit(SipfRxArena *arena, uint8_t *buff, uint32_t size)
+{
+    arena->buff = buff;
+    arena->size = size;
+    arena->used = 0;
+}
+
+/**
+ * 領域を空にする(それまでに受信したSipfObjObject::valueは無効になる)
+ */
+void SipfRxArenaReset(SipfRxArena *arena)
+{
+    arena->used = 0;
+}
+
+uint32_t SipfRxArenaFree(const SipfRxArena *arena)
+{
+    return arena->size - arena->used;
+}
+
+/**
+ * モジュールが自発的に出す行の振り分け
+ * 組み込みの表(起動メッセージなど)とSipfEventRegister()で登録した表を行の先頭で照合する
+ */
+enum {
+    SIPF_LINE_ECHO,     // コマンドのエコーバック
+    SIPF_LINE_REPLY,    // コマンドの応答
+    SIPF_LINE_EVENT,    // 自発的な通知
+    SIPF_LINE_RESET,    // 自発的な通知のうちモジュールの再起動(実行中のコマンドの応答はもう来ない)
+};
+
+static const struct {
+    const char *prefix;
+    uint8_t state;      // SipfModuleState
+    bool reset;
+}   builtin_events[] = {
+    { "*** SIPF Client", SIPF_MODULE_BOOTING, true },
+    { "+++ Ready +++",   SIPF_MODULE_READY,   true },
+    { "ERR:",            SIPF_MODULE_ERROR,   false },
+};
+
+static bool sipfPrefixMatch(const char *line, int len, const char *prefix)
+{
+    int n = strlen(prefix);
+    return (len >= n) && (memcmp(line, prefix, n) == 0);
+}
+
+/**
+ * 行を分類して, 自発的な通知なら状態を更新して登録された通知先に渡す
+ * return: SIPF_LINE_*
+ */
+static int sipfLineDispatch(const char *line, int len)
+{
+    int cls = SIPF_LINE_REPLY;
+    for (int i = 0; i < (int)(sizeof(builtin_events) / sizeof(builtin_events[0])); i++) {
+        if (!sipfPrefixMatch(line, len, builtin_events[i].prefix)) {
+            continue;
+        }
+        cls = builtin_events[i].reset ? SIPF_LINE_RESET : SIPF_LINE_EVENT;
+        if ((builtin_events[i].state == SIPF_MODULE_BOOTING) && (client->module_state != SIPF_MODULE_BOOTING)) {
+            // 再起動したのでレジスタは初期値に戻っている
+            SipfRegCacheInvalidate();
+            client->reboot_cnt++;
+            client->t_boot = SipfTransportMillis();
+        }
+        client->module_state = builtin_events[i].state;
+        break;
+    }
+    for (int i = 0; i < client->event_cnt; i++) {
+        const SipfEventEntry *e = &client->events[i];
+        if (sipfPrefixMatch(line, len, e->prefix)) {
+            if (cls == SIPF_LINE_REPLY) {
+                cls = SIPF_LINE_EVENT;
+            }
+            e->handler(line, len, e->arg);
+        }
+    }
+    if ((cls == SIPF_LINE_REPLY) && (line[0] == '$')) {
+        cls = SIPF_LINE_ECHO;
+    }
+    return cls;
+}
+
+/**
+ * 行の先頭がprefixに一致する自発的な行をhandlerに通知する
+ * 起動メッセージ("*** SIPF Client", "+++ Ready +++")と"ERR:"は登録しなくてもSipfGetModuleState()に反映する
+ * コマンドの応答に一致するprefix("OK"など)は登録しないこと
+ * return: 0: 成功, -1: 登録できる数を超えた
+ */
+int SipfEventRegister(const char *prefix, SipfEventHandler handler, void *arg)
+{
+    if ((prefix == NULL) || (handler == NULL) || (client->event_cnt >= SIPF_EVENT_MAX)) {
+        return -1;
+    }
+    SipfEventEntry *e = &client->events[client->event_cnt++];
+    e->prefix = prefix;
+    e->handler = handler;
+    e->arg = arg;
+    return 0;
+}
+
+void SipfEventUnregister(const char *prefix, SipfEventHandler handler)
+{
+    for (int i = 0; i < client->event_cnt; i++) {
+        if ((strcmp(client->events[i].prefix, prefix) == 0) && (client->events[i].handler == handler)) {
+            memmove(&client->events[i], &client->events[i + 1], (client->event_cnt - i - 1) * sizeof(SipfEventEntry));
+            client->event_cnt--;
+            return;
+        }
+    }
+}
+
+SipfModuleState SipfGetModuleState(void)
+{
+    return (SipfModuleState)client->module_state;
+}
+
+/**
+ * PC(コンソール)との中継
+ * コマンドを実行していない間のモジュールからの受信はPCへ送り, コマンド実行中のPCからの入力は溜めておく
+ * PCがコマンドを送ったらOK/NGが返るまで(またはTMOUT_CMDの間なにも来なければ)エンジンは次の要求を始めない
+ */
+#define MUX_IN_MASK     (SIPF_MUX_CONSOLE_IN_SZ - 1)
+
+/**
+ * モジュールからの受信をPCへ送る(中継先がなければ捨てて数える)
+ */
+static void sipfMuxRelay(const uint8_t *buff, int len)
+{
+    if (client->mux.write == NULL) {
+        client->mux.cnt.dropped_out += len;
+    } else {
+        client->mux.write(buff, len, client->mux.arg);
+        client->mux.cnt.relayed_out += len;
+        client->mux.t_last = SipfTransportMillis();
+    }
+    // 行ごとにPCのコマンドの応答の終わり(OK/NGの行)と自発的な行を探す
+    for (int i = 0; i < len; i++) {
+        if ((buff[i] == '\r') || (buff[i] == '\n')) {
+            if (client->mux.line_len == 0) {
+                continue;
+            }
+            client->mux.line[client->mux.line_len] = '\0';
+            if ((client->mux.line_len == 2) &&
+                ((memcmp(client->mux.line, "OK", 2) == 0) || (memcmp(client->mux.line, "NG", 2) == 0))) {
+                client->mux.active = false;
+            }
+            sipfLineDispatch(client->mux.line, client->mux.line_len);
+            client->mux.line_len = 0;
+        } else if (client->mux.line_len < (sizeof(client->mux.line) - 1)) {
+            client->mux.line[client->mux.line_len++] = buff[i];
+        }
+    }
+}
+
+/**
+ * 行読み取りに残っているデータをPCへ送る
+ * complete: trueなら最後の改行まで(途中の行は残す)
+ */
+static void sipfMuxRelayPending(bool complete)
+{
+    uint8_t buff[128];
+    int n;
+    while ((n = SipfLineReaderTake(&client->line_reader, buff, sizeof(buff), complete)) > 0) {
+        sipfMuxRelay(buff, n);
+    }
+}
+
+/**
+ * PCからの入力をモジュールへ送る
+ */
+static void sipfMuxSend(const uint8_t *buff, int len)
+{
+    SipfTransportWrite(buff, len);
+    client->mux.cnt.relayed_in += len;
+    client->mux.active = true;
+    client->mux.t_last = SipfTransportMillis();
+}
+
+/**
+ * エンジンがUARTを使っていない間の中継(SipfPoll()から呼ぶ)
+ * return: true: PCのコマンドの応答待ち(エンジンは待つ)
+ */
+static bool sipfMuxPump(void)
+{
+    // 中継先がなくても自発的な行を見つけるために読む
+    uint8_t buff[128];
+    int n;
+    sipfMuxRelayPending(false);
+    do {
+        n = SipfTransportRead(buff, sizeof(buff));
+        if (n > 0) {
+            sipfMuxRelay(buff, n);
+        }
+    } while (n == (int)sizeof(buff));
+    // 溜めておいたPCからの入力を送る
+    while (client->mux.in_tail != client->mux.in_head) {
+        uint32_t off = client->mux.in_tail & MUX_IN_MASK;
+        uint32_t len = client->mux.in_head - client->mux.in_tail;
+        if (len > (SIPF_MUX_CONSOLE_IN_SZ - off)) {
+            len = SIPF_MUX_CONSOLE_IN_SZ - off;
+        }
+        sipfMuxSend(&client->mux.in[off], len);
+        client->mux.in_tail += len;
+    }
+    if (client->mux.active && ((uint32_t)(SipfTransportMillis() - client->mux.t_last) >= TMOUT_CMD)) {
+        // 応答が来なかった(またはOK/NGを返さないコマンドだった)
+        client->mux.active = false;
+    }
+    return client->mux.active;
+}
+
+/**
+ * モジュールからの受信のうちコマンドの応答でないものの渡し先を設定する(NULLで解除)
+ * 設定している間はSipfPoll()がコマンドを実行していないときの受信を全部writeへ渡す
+ */
+void SipfMuxAttachConsole(SipfMuxConsoleWrite write, void *arg)
+{
+    client->mux.write = write;
+    client->mux.arg = arg;
+}
+
+/**
+ * PCからの入力をモジュールへ送る
+ * コマンドの実行中は溜めておいて, 終わってから(次のコマンドより先に)送る. 溜めきれない分は捨てて数える
+ * SipfPoll()と同じスレッドから呼ぶこと
+ * return: 受け付けたバイト数
+ */
+int SipfMuxConsoleInput(const uint8_t *buff, int len)
+{
+    if (!client->engine.started && (client->mux.in_tail == client->mux.in_head)) {
+        sipfMuxSend(buff, len);
+        return len;
+    }
+    uint32_t space = SIPF_MUX_CONSOLE_IN_SZ - (client->mux.in_head - client->mux.in_tail);
+    uint32_t n = ((uint32_t)len < space) ? len : space;
+    for (uint32_t i = 0; i < n; i++) {
+        client->mux.in[(client->mux.in_head + i) & MUX_IN_MASK] = buff[i];
+    }
+    client->mux.in_head += n;
+    client->mux.cnt.dropped_in += len - n;
+    return n;
+}
+
+void SipfMuxGetCounters(SipfMuxCounters *cnt)
+{
+    *cnt = client->mux.cnt;
+}
+
+/**
+ * UARTの受信バッファを空にする
+ * コマンドの応答ではないのでPCへ中継する(中継先がなければ捨てる)
+ */
 void SipfClientFlushReadBuff(void)
+{
+    uint8_t buff[128];
+    sipfMuxRelayPending(false);
+    SipfLineReaderReset(&client->line_reader);
+    int len = SipfTransportAvailable();
+    while (len > 0) {
+        int n = SipfTransportRead(buff, (len < (int)sizeof(buff)) ? len : (int)sizeof(buff));
+        if (n <= 0) {
+            break;
+        }
+        sipfMuxRelay(buff, n);
+        len -= n;
+    }
+}
+
+//１行([CR] or [LF]の手前まで)をバッファに詰める
+int SipfUtilReadLine(uint8_t *buff, int buff_len, int timeout_ms)
+{
+    uint32_t t_recved, t_now;
+    SipfLineView view;
+
+    t_recved = SipfTransportMillis();
+    for (;;) {
+        if (SipfLineReaderNext(&client->line_reader, &view)) {
+            // 起動メッセージなどは通知もする(行はそのまま返す)
+            sipfLineDispatch(view.ptr, view.len);
+            //バッファに詰める
+            int len = (view.len < buff_len) ? view.len : (buff_len - 1);
+            memcpy(buff, view.ptr, len);
+            buff[len] = '\0';
+            return len + 1; //長さを返す
+        }
+        t_now = SipfTransportMillis();
+        if (SipfLineReaderFill(&client->line_reader) > 0) {
+            t_recved = t_now;
+            continue;
+        }
+        //タイムアウト判定
+        if ((int32_t)((t_recved + timeout_ms) - t_now) < 0) {
+            //キャラクター間タイムアウト
+            return -3;
+        }
+    }
+}
+
+/**
+ * コマンドエンジン
+ * 要求(SipfReq)をキューに積んでSipfPoll()で少しずつ進める
+ * SipfPoll()は受信済みのデータを処理するだけでブロックしない
+ */
+
+#if SIPF_STATS
+/**
+ * 応答の行が来るまでの時間を記録
+ */
+static void sipfStatsLine(SipfReq *req, int cls)
+{
+    if (cls == SIPF_LINE_ECHO) {
+        if (!client->engine.echo_seen) {
+            client->engine.echo_seen = true;
+            SipfStatsLatency(req->type, SIPF_STATS_PHASE_ECHO, SipfTransportMicros() - client->engine.t_start_us);
+        }
+    } else if (!client->engine.resp_seen) {
+        client->engine.resp_seen = true;
+        SipfStatsLatency(req->type, SIPF_STATS_PHASE_RESP, SipfTransportMicros() - client->engine.t_start_us);
+    }
+}
+#endif
+
+static void sipfReqFinish(SipfReq *req, int result)
+{
+    if (client->engine.started) {
+        SIPF_STATS_LATENCY(req->type, SIPF_STATS_PHASE_DONE, SipfTransportMicros() - client->engine.t_start_us);
+        SIPF_STATS_RESULT(req->type, result, req->tmout_char);
+    } else {
+        // 送信する前に期限が切れた
+        SIPF_STATS_ADD(prio[req->prio].expired, 1);
+    }
+
+    if ((req->type == SIPF_REQ_RX) && client->engine.started && (result < 0)) {
+        // 途中まで詰めたVALUEを捨てる(arena_markは送信を始めたときに決まるので, 始める前に期限が切れたものは何もしない)
+        req->u.rx.arena->used = req->u.rx.arena_mark;
+    }
+
+    // キューから外す
+    client->engine.head = req->next;
+    if (client->engine.head == NULL) {
+        client->engine.tail = NULL;
+    }
+    client->engine.started = false;
+    req->next = NULL;
+    req->result = result;
+    __atomic_store_n(&req->busy, false, __ATOMIC_RELEASE);  // 他のスレッドにresultを見せてから完了にする
+
+    // 完了通知(コールバックの中で同じ要求を再投入してもよい)
+    if (req->cb) {
+        req->cb(req, result, req->cb_arg);
+    }
+}
+
+#define REGS_DIFF(req, i)       ((req)->u.regs.diff[(i) >> 3] & (1 << ((i) & 7)))
+#define REGS_SET_DIFF(req, i)   ((req)->u.regs.diff[(i) >> 3] |= (1 << ((i) & 7)))
+#define REGS_KNOWN(req, i)      ((req)->u.regs.known[(i) >> 3] & (1 << ((i) & 7)))
+#define REGS_SET_KNOWN(req, i)  ((req)->u.regs.known[(i) >> 3] |= (1 << ((i) & 7)))
+
+static uint8_t sipfRegsAddr(SipfReq *req, int i)
+{
+    if (req->u.regs.list == NULL) {
+        return req->u.regs.base + i;
+    }
+    return req->u.regs.list[i].addr;
+}
+
+/**
+ * i番目のレジスタを次のフェーズで送るか
+ * 読み出しはキャッシュにないものだけ, 書き込みと検証は値が違ったものだけ
+ */
+static bool sipfRegsPending(SipfReq *req, int i)
+{
+    if (req->u.regs.phase == SIPF_REGS_PHASE_READ) {
+        return !REGS_KNOWN(req, i);
+    }
+    return REGS_DIFF(req, i);
+}
+
+/**
+ * 一括レジスタ書き込み: 応答待ちがSIPF_REG_PIPELINE個になるまでコマンドを送る
+ * 読み出し(全部) -> 書き込み(値が違うものだけ) -> 検証(書いたものだけ) の順に進む
+ */
+static void sipfRegsPump(SipfReq *req)
 {
     int len;
-    uint8_t b;
-    len = Serial2.available();
-    for (int i = 0; i < len; i++) {
-        Serial2.read();
+    while (req->u.regs.inflight < SIPF_REG_PIPELINE) {
+        // 次に送るレジスタを探す
+        int i = req->u.regs.next;
+        while ((i < req->u.regs.cnt) && !sipfRegsPending(req, i)) {
+            i++;
+        }
+        if (i >= req->u.regs.cnt) {
+            req->u.regs.next = i;
+            return;
+        }
+        if (req->u.regs.phase == SIPF_REGS_PHASE_WRITE) {
+            len = sprintf(client->cmd, "$W %02X %02X\r\n", req->u.regs.list[i].addr, req->u.regs.list[i].value);
+        } else {
+            len = sprintf(client->cmd, "$R %02X\r\n", sipfRegsAddr(req, i));
+        }
+        SipfTransportWrite((uint8_t*)client->cmd, len);
+        req->u.regs.inflight++;
+        req->u.regs.next = i + 1;
+    }
+}
+
+/**
+ * 応答待ちがなくなったら次のフェーズへ進める
+ */
+static void sipfRegsAdvance(SipfReq *req)
+{
+    while ((req->u.regs.inflight == 0) && (req->u.regs.next >= req->u.regs.cnt)) {
+        bool any = false;
+        for (int j = 0; j < (int)sizeof(req->u.regs.diff); j++) {
+            any |= (req->u.regs.diff[j] != 0);
+        }
+        if (!any || (req->u.regs.phase == SIPF_REGS_PHASE_VERIFY)) {
+            // 全部一致した
+            sipfReqFinish(req, 0);
+            return;
+        }
+        req->u.regs.phase++;
+        req->u.regs.next = 0;
+        req->u.regs.done = 0;
+        sipfRegsPump(req);
+    }
+}
+
+static void sipfReqStart(SipfReq *req)
+{
+    int len = 0;
+
+    // コマンド送信前にそろっている行は応答ではないのでPCへ中継する(途中の行は残しておく)
+    SipfLineReaderFill(&client->line_reader);
+    sipfMuxRelayPending(true);
+    client->mux.line_len = 0;   // 途中の行の続きはエンジンが読む
+
+    SIPF_STATS_QUEUE_WAIT(req->prio, SipfTransportMicros() - req->t_submit_us);
+
+    req->state = 0;
+    req->timeout_ms = TMOUT_CMD;
+    req->tmout_char = false;
+    if (req->type == SIPF_REQ_CALL) {
+        // UARTを占有して関数を呼ぶ(戻るまでエンジンは止まる)
+        client->engine.started = true;
+#if SIPF_STATS
+        client->engine.t_start_us = SipfTransportMicros();
+#endif
+        client->engine.in_call = true;
+        int ret = req->u.call.fn(req->u.call.arg);
+        client->engine.in_call = false;
+        sipfReqFinish(req, ret);
+        return;
+    }
+
+    switch (req->type) {
+    case SIPF_REQ_W:
+        len = sprintf(client->cmd, "$W %02X %02X\r\n", req->u.w.addr, req->u.w.value);
+        req->timeout_ms = TMOUT_CHAR;
+        break;
+    case SIPF_REQ_R:
+        len = sprintf(client->cmd, "$R %02X\r\n", req->u.r.addr);
+        break;
+    case SIPF_REQ_TX:
+        len = req->u.tx.batch->len;
+        len += sprintf(&req->u.tx.batch->line[len], "\r\n");
+        SipfTransportWrite((uint8_t*)req->u.tx.batch->line, len);
+        req->u.tx.batch->line[req->u.tx.batch->len] = '\0';    // 改行を外してさらに追加できるようにしておく
+        len = 0;
+        break;
+    case SIPF_REQ_RX:
+        len = sprintf(client->cmd, "$$RX\r\n");
+        req->u.rx.cnt = 0;
+        if (req->u.rx.arena == sipfDefaultArena()) {
+            // 既定の領域は前回の受信内容を上書きする(従来のSipfCmdRx()と同じ)
+            SipfRxArenaReset(sipfDefaultArena());
+        }
+        req->u.rx.arena_mark = req->u.rx.arena->used;
+        break;
+    case SIPF_REQ_GNSSEN:
+        len = sprintf(client->cmd, "$$GNSSEN %d\r\n", req->u.gnssen.is_active?1:0);
+        break;
+    case SIPF_REQ_GNSSLOC:
+        len = sprintf(client->cmd, "$$GNSSLOC\r\n");
+        break;
+    case SIPF_REQ_REGS:
+        req->u.regs.phase = SIPF_REGS_PHASE_READ;
+        req->u.regs.next = 0;
+        req->u.regs.done = 0;
+        req->u.regs.inflight = 0;
+        req->u.regs.has_value = false;
+        memset(req->u.regs.diff, 0, sizeof(req->u.regs.diff));
+        memset(req->u.regs.known, 0, sizeof(req->u.regs.known));
+        for (int i = 0; i < req->u.regs.cnt; i++) {
+            // キャッシュにある値は読まずに比べる
+            uint8_t v;
+            if (regCacheGet(sipfRegsAddr(req, i), &v)) {
+                REGS_SET_KNOWN(req, i);
+                if ((req->u.regs.list != NULL) && (v != req->u.regs.list[i].value)) {
+                    REGS_SET_DIFF(req, i);
+                }
+            }
+        }
+        sipfRegsPump(req);
+        break;
+    case SIPF_REQ_CALL:
+        // 上で完了している
+        break;
+    }
+    if (len > 0) {
+        SipfTransportWrite((uint8_t*)client->cmd, len);
+    }
+
+    client->engine.started = true;
+    client->engine.t_last = SipfTransportMillis();
+#if SIPF_STATS
+    client->engine.t_start_us = SipfTransportMicros();
+    client->engine.echo_seen = false;
+    client->engine.resp_seen = false;
+#endif
+
+    if (req->type == SIPF_REQ_REGS) {
+        // 全部キャッシュで済んだ場合はここで完了する
+        sipfRegsAdvance(req);
+    }
+}
+
+/**
+ * $Wコマンドの応答
+ */
+static void sipfHandleW(SipfReq *req, char *line, int len)
+{
+    if (memcmp(line, "OK", 2) == 0) {
+        //OK
+        regCachePut(req->u.w.addr, req->u.w.value);
+        sipfReqFinish(req, 0);
+    } else if (memcmp(line, "NG", 2) == 0) {
+        //NG
+        sipfReqFinish(req, 1);
+    }
+}
+
+/**
+ * $Rコマンドの応答
+ */
+static void sipfHandleR(SipfReq *req, char *line, int len)
+{
+    switch (req->state) {
+    case 0: // Value待ち
+        if (line[0] == '$') {
+            //エコーバック
+            return;
+        }
+        if (memcmp(line, "NG", 2) == 0) {
+            //NG
+            sipfReqFinish(req, 1);
+            return;
+        }
+        if (len == 2) {
+            //Valueらしきもの
+            if (SipfHexDecodeU8(line, req->u.r.value) != 0) {
+                //HEXじゃない
+                sipfReqFinish(req, -1);
+                return;
+            }
+            req->state = 1;
+            req->timeout_ms = TMOUT_CHAR;   // キャラクタ間タイムアウト
+            req->tmout_char = true;
+        }
+        break;
+    case 1: // OK待ち
+        if (memcmp(line, "OK", 2) == 0) {
+            //OK
+            regCachePut(req->u.r.addr, *req->u.r.value);
+            sipfReqFinish(req, 0);
+        }
+        break;
+    }
+}
+
+/**
+ * 一括レジスタ書き込みの応答
+ * パイプラインで送っているので応答は送った順に対応させる
+ */
+static void sipfHandleRegs(SipfReq *req, char *line, int len)
+{
+    if (line[0] == '$') {
+        //エコーバック
+        return;
+    }
+    if (memcmp(line, "NG", 2) == 0) {
+        //NG
+        sipfReqFinish(req, -1);
+        return;
+    }
+    if (memcmp(line, "OK", 2) != 0) {
+        if (len == 2) {
+            //Valueらしきもの
+            if (SipfHexDecodeU8(line, &req->u.regs.value) != 0) {
+                sipfReqFinish(req, -1);
+                return;
+            }
+            req->u.regs.has_value = true;
+        }
+        return;
+    }
+
+    // いちばん古い応答待ちのレジスタが完了した
+    if (req->u.regs.inflight == 0) {
+        return;
+    }
+    int i = req->u.regs.done;
+    while (!sipfRegsPending(req, i)) {
+        i++;
+    }
+    req->u.regs.done = i + 1;
+    req->u.regs.inflight--;
+    if (req->u.regs.phase == SIPF_REGS_PHASE_WRITE) {
+        regCachePut(req->u.regs.list[i].addr, req->u.regs.list[i].value);
+    } else {
+        if (!req->u.regs.has_value) {
+            // 値が来ないままOKになった
+            sipfReqFinish(req, -1);
+            return;
+        }
+        req->u.regs.has_value = false;
+        regCachePut(sipfRegsAddr(req, i), req->u.regs.value);
+        if ((req->u.regs.list != NULL) && (req->u.regs.value != req->u.regs.list[i].value)) {
+            if (req->u.regs.phase == SIPF_REGS_PHASE_VERIFY) {
+                // 書いたはずの値になっていない
+                sipfReqFinish(req, -1);
+                return;
+            }
+            REGS_SET_DIFF(req, i);
+        }
+    }
+
+    sipfRegsPump(req);
+    sipfRegsAdvance(req);
+}
+
+/**
+ * $$GNSSENコマンドの応答
+ */
+static void sipfHandleGnssEn(SipfReq *req, char *line, int len)
+{
+    if (line[0] == '$') {
+        //エコーバック
+        return;
+    }
+    if (memcmp(line, "NG", 2) == 0) {
+        // NG
+        sipfReqFinish(req, -1);
+    } else if (memcmp(line, "OK", 2) == 0) {
+        // OK
+        sipfReqFinish(req, 0);
+    }
+}
+
+/**
+ * $$GNSSLOCコマンドの応答
+ */
+static void sipfHandleGnssLoc(SipfReq *req, char *line, int len)
+{
+    switch (req->state) {
+    case 0: // 位置情報待ち
+        if (line[0] == '$') {
+            // エコーバック
+            return;
+        }
+        if (memcmp(line, "NG", 2) == 0) {
+            // NG
+            sipfReqFinish(req, -1);
+            return;
+        }
+        if (line[0] == 'A' || line[0] == 'V') {
+            // 位置情報
+            GnssLocationFixed fix;
+            if (SipfGnssParse(line, len, &fix) != 0) {
+                sipfReqFinish(req, -2);
+                return;
+            }
+            if (req->u.gnssloc.fix != NULL) {
+                *req->u.gnssloc.fix = fix;
+            }
+            if (req->u.gnssloc.loc != NULL) {
+                SipfGnssToFloat(&fix, req->u.gnssloc.loc);
+            }
+            req->state = 1;
+            req->timeout_ms = TMOUT_CHAR;   // キャラクタ間タイムアウト
+            req->tmout_char = true;
+        }
+        break;
+    case 1: // OK応答待ち
+        if (memcmp(line, "NG", 2) == 0) {
+            // NG
+            sipfReqFinish(req, -1);
+        } else if (memcmp(line, "OK", 2) == 0) {
+            // OK
+            sipfReqFinish(req, 0);
+        }
+        break;
+    }
+}
+
+/**
+ * $$TXコマンドの応答
+ */
+static void sipfHandleTx(SipfReq *req, char *line, int len)
+{
+    switch (req->state) {
+    case 0: // OTID待ち
+        if (line[0] == '$') {
+            //エコーバック
+            return;
+        }
+        if (len == 32) {
+            //OTIDらしきもの
+            memcpy(req->u.tx.otid, line, 32);
+            req->state = 1;
+            req->timeout_ms = TMOUT_CHAR;   // キャラクタ間タイムアウト
+            req->tmout_char = true;
+            return;
+        }
+        if (memcmp(line, "NG", 2) == 0) {
+            //NG
+            sipfReqFinish(req, -1);
+        }
+        break;
+    case 1: // OK待ち
+        if (memcmp(line, "OK", 2) == 0) {
+            //OK
+            sipfReqFinish(req, 0);
+        }
+        break;
+    }
+}
+
+/**
+ * $$RXコマンドの応答
+ */
+static void sipfHandleRx(SipfReq *req, char *line, int len)
+{
+	enum cmd_rx_stat {
+		W_OTID,		//OTID待ち
+		W_SEND_DTM,	//ユーザーサーバー送信時刻待ち
+		W_RECV_DTM,	//SIPF受信時刻待ち
+		W_REMAIN,	//REMAIN待ち
+		W_QTY,		//OBJQTY待ち
+		W_OBJS,		//OBJ待ち
+	};
+    char *value_top;
+    int ret;
+
+	switch (req->state) {
+	/* OTID待ち */
+	case W_OTID:
+		if (line[0] == '$') {
+			// エコーバックを受信したら読み捨て
+			return;
+		}
+		if (memcmp(line, "OK", 2) == 0) {
+			// 受信データなし
+			sipfReqFinish(req, 0);
+			return;
+		}
+		if (len != 32) {
+			// OTIDじゃないっぽい
+			sipfReqFinish(req, -1);
+			return;
+		}
+		memcpy(req->u.rx.otid, line, 32);
+		req->state = W_SEND_DTM;	    // ユーザーサーバー送信時刻待ちへ
+		req->timeout_ms = TMOUT_CHAR;	// キャラクタ間タイムアウトに設定
+		break;
+	/* ユーザーサーバー送信時刻待ち */
+	case W_SEND_DTM:
+		if (len != 16) {
+			// ユーザーサーバーの送信時刻(64bit整数)じゃないっぽい
+			sipfReqFinish(req, -1);
+			return;
+		}
+		if (SipfHexDecodeU64(line, req->u.rx.user_send_datetime_ms) != 0) {
+			// HEXから数値への変換ができなかった
+			sipfReqFinish(req, -1);
+			return;
+		}
+		req->state = W_RECV_DTM;
+		break;
+	/* SIPF受信時刻待ち */
+	case W_RECV_DTM:
+		if (len != 16) {
+			// SIPFの受信時刻(64bit整数)じゃないっぽい
+			sipfReqFinish(req, -1);
+			return;
+		}
+		if (SipfHexDecodeU64(line, req->u.rx.sipf_recv_datetime_ms) != 0) {
+			// HEXから数値への変換ができなかった
+			sipfReqFinish(req, -1);
+			return;
+		}
+		req->state = W_REMAIN;
+		break;
+	/* REMAIN待ち */
+	case W_REMAIN:
+		if ((len != 2) || (SipfHexDecodeU8(line, req->u.rx.remain) != 0)) {
+			// REMAIN(8bit整数)じゃないっぽい
+			sipfReqFinish(req, -1);
+			return;
+		}
+		req->state = W_QTY;
+		break;
+	/* OBJQTY待ち */
+	case W_QTY:
+		if ((len != 2) || (SipfHexDecodeU8(line, req->u.rx.obj_cnt) != 0)) {
+			// OBJQTY(8bit整数)じゃないっぽい
+			sipfReqFinish(req, -1);
+			return;
+		}
+		req->state = W_OBJS;
+		break;
+	/* OBJ待ち */
+	case W_OBJS:
+		if (memcmp(line, "OK", 2) == 0) {
+			// OBJECTを受信しきった
+			sipfReqFinish(req, req->u.rx.cnt);
+			return;
+		}
+		if (memcmp(line, "NG", 2) == 0) {
+			// エラーらしい
+			sipfReqFinish(req, -1);
+			return;
+		}
+		if (req->u.rx.cnt >= req->u.rx.obj_list_sz) {
+			// リストの上限に達した
+			return;
+		}
+		if (len >= 11) {
+			// OBJECTっぽい
+    		if ((line[2] != ' ') || (line[5] != ' ') || (line[8] != ' ')) {
+    			// OBJCTじゃない
+    			sipfReqFinish(req, -1);
+    			return;
+    		}
+
+    		SipfObjObject *obj = &req->u.rx.obj_list[req->u.rx.cnt++];
+    		int ret_tag, ret_type;
+    		if (client->fw_version >= 0x00030001) {
+                ret_tag = SipfHexDecodeU8(&line[0], &obj->tag_id);  // TAG_ID
+                ret_type = SipfHexDecodeU8(&line[3], &obj->type);   // TYPE
+            } else {
+                ret_type = SipfHexDecodeU8(&line[0], &obj->type);   // TYPE
+                ret_tag = SipfHexDecodeU8(&line[3], &obj->tag_id);  // TAG_ID
+            }
+    		if ((ret_tag != 0) || (ret_type != 0) || (SipfHexDecodeU8(&line[6], &obj->value_len) != 0)) {
+    			// HEXから変換できなかった
+    			sipfReqFinish(req, -1);
+    			return;
+    		}
+    		if (len != (9 + obj->value_len * 2)) {
+    			// VALUE_LENと長さが合わない
+    			sipfReqFinish(req, -1);
+    			return;
+    		}
+    		//VALUE
+    		SipfRxArena *arena = req->u.rx.arena;
+    		if (obj->value_len > (arena->size - arena->used)) {
+    			// VALUEの置き場所が足りない
+    			sipfReqFinish(req, -1);
+    			return;
+    		}
+    		obj->value = &arena->buff[arena->used];	//VALUEの先頭のポインタをvalueに設定
+    		value_top = &line[9];
+    		if ((obj->type == OBJ_TYPE_BIN) || (obj->type == OBJ_TYPE_STR_UTF8)) {
+    			//そのままの順でHEXから変換してバッファに追加
+    			ret = SipfHexDecode(obj->value, value_top, obj->value_len);
+    		} else {
+    			//バイトスワップしてHEXから変換してバッファに追加
+    			ret = SipfHexDecodeRev(obj->value, value_top, obj->value_len);
+    		}
+    		if (ret != 0) {
+    			// HEXからの変換に失敗
+    			sipfReqFinish(req, -1);
+    			return;
+    		}
+    		arena->used += obj->value_len;
+		}
+		break;
+	}
+}
+
+static void sipfReqHandleLine(SipfReq *req, char *line, int len)
+{
+    switch (req->type) {
+    case SIPF_REQ_W:
+        sipfHandleW(req, line, len);
+        break;
+    case SIPF_REQ_R:
+        sipfHandleR(req, line, len);
+        break;
+    case SIPF_REQ_TX:
+        sipfHandleTx(req, line, len);
+        break;
+    case SIPF_REQ_RX:
+        sipfHandleRx(req, line, len);
+        break;
+    case SIPF_REQ_GNSSEN:
+        sipfHandleGnssEn(req, line, len);
+        break;
+    case SIPF_REQ_GNSSLOC:
+        sipfHandleGnssLoc(req, line, len);
+        break;
+    case SIPF_REQ_REGS:
+        sipfHandleRegs(req, line, len);
+        break;
+    case SIPF_REQ_CALL:
+        // 応答は受けない
+        break;
+    }
+}
+
+/**
+ * 要求をエンジンのキューに優先度順に入れる(同じ優先度なら後ろ. 実行中の先頭は追い越さない)
+ */
+static void sipfQueueInsert(SipfReq *req)
+{
+    SipfReq *prev = NULL;
+    SipfReq *cur = client->engine.head;
+    if ((client->engine.tail != NULL) && (client->engine.tail->prio <= req->prio)) {
+        // 末尾でよい(ほとんどはここ)
+        prev = client->engine.tail;
+        cur = NULL;
+    } else if ((cur != NULL) && client->engine.started) {
+        prev = cur;
+        cur = cur->next;
+    }
+    while ((cur != NULL) && (cur->prio <= req->prio)) {
+        prev = cur;
+        cur = cur->next;
+    }
+    req->next = cur;
+    if (prev) {
+        prev->next = req;
+    } else {
+        client->engine.head = req;
+    }
+    if (cur == NULL) {
+        client->engine.tail = req;
+    }
+}
+
+/**
+ * prevの次にある要求をキューの先頭に移す(prevがNULLならもう先頭)
+ */
+static void sipfQueueToHead(SipfReq *prev, SipfReq *req)
+{
+    if (prev == NULL) {
+        return;
+    }
+    prev->next = req->next;
+    if (client->engine.tail == req) {
+        client->engine.tail = prev;
+    }
+    req->next = client->engine.head;
+    client->engine.head = req;
+}
+
+/**
+ * 次に送信する要求を選んでキューの先頭に置く
+ * 期限を過ぎた要求は送らずにSIPF_RESULT_EXPIREDで完了させる
+ * 待ち時間SIPF_PRIO_AGING_MSごとに優先度を1つ上げて比べる(SIPF_PRIO_NORMALまで. 同じなら先に投入したもの)
+ * return: 選んだ要求, NULL: 待っている要求がない
+ */
+static SipfReq *sipfReqSelect(void)
+{
+    uint32_t t_now = SipfTransportMillis();
+    SipfReq *best = NULL;
+    SipfReq *best_prev = NULL;
+    int best_prio = SIPF_PRIO_NUM;
+    SipfReq *prev = NULL;
+    SipfReq *req = client->engine.head;
+    while (req != NULL) {
+        if (req->has_deadline && ((int32_t)(t_now - req->t_deadline) > 0)) {
+            sipfQueueToHead(prev, req);
+            sipfReqFinish(req, SIPF_RESULT_EXPIRED);
+            if (client->engine.started) {
+                // 完了通知の中で次の要求が始まった
+                return NULL;
+            }
+            // 完了通知でキューが変わっているかもしれないので最初から
+            best = NULL;
+            best_prev = NULL;
+            best_prio = SIPF_PRIO_NUM;
+            prev = NULL;
+            req = client->engine.head;
+            continue;
+        }
+        int prio = req->prio;
+        if (prio > SIPF_PRIO_NORMAL) {
+            prio -= (int)((t_now - req->t_submit) / SIPF_PRIO_AGING_MS);
+            prio = (prio < SIPF_PRIO_NORMAL) ? SIPF_PRIO_NORMAL : prio;
+        }
+        if ((prio < best_prio) || ((prio == best_prio) && ((int32_t)(req->t_submit - best->t_submit) < 0))) {
+            best = req;
+            best_prev = prev;
+            best_prio = prio;
+        }
+        prev = req;
+        req = req->next;
+    }
+    if (best != NULL) {
+        sipfQueueToHead(best_prev, best);
+    }
+    return best;
+}
+
+/**
+ * 受信箱の要求をエンジンのキューへ(投入された順に)移す
+ */
+static void sipfInboxDrain(void)
+{
+    SipfReq *list = __atomic_exchange_n(&client->inbox, (SipfReq*)NULL, __ATOMIC_ACQUIRE);
+    SipfReq *fifo = NULL;
+    while (list != NULL) {
+        SipfReq *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while (fifo != NULL) {
+        SipfReq *next = fifo->next;
+        sipfQueueInsert(fifo);
+        fifo = next;
+    }
+}
+
+/**
+ * コマンドエンジンを進める
+ * loop()から定期的に呼ぶ. 受信済みのデータを処理したらすぐに戻る
+ */
+void SipfPoll(void)
+{
+    if (client->worker != NULL) {
+        if (client->worker != sipfThisThread()) {
+            // UARTはワーカーだけが触る
+            return;
+        }
+        if (__atomic_load_n(&client->inbox, __ATOMIC_RELAXED) != NULL) {
+            sipfInboxDrain();
+        }
+    }
+    if (client->engine.in_call) {
+        // SIPF_REQ_CALLの関数が戻るまでは先頭の要求を進めない(終わらせると関数の途中で次の要求が始まる)
+        return;
+    }
+    SipfReq *req = client->engine.head;
+    if (!client->engine.started) {
+        if (sipfMuxPump()) {
+            // PCのコマンドの応答待ち
+            return;
+        }
+        if (req == NULL) {
+            return;
+        }
+        req = sipfReqSelect();
+        if (req == NULL) {
+            return;
+        }
+        if ((client->module_state == SIPF_MODULE_BOOTING) &&
+            ((uint32_t)(SipfTransportMillis() - client->t_boot) < TMOUT_BOOT)) {
+            // 起動中のモジュールにはコマンドを送らない(期限の切れた要求は上で捨てている)
+            return;
+        }
+        // コマンド送信
+        sipfReqStart(req);
+        return;
+    }
+
+    uint32_t t_now = SipfTransportMillis();
+    if (SipfLineReaderFill(&client->line_reader) > 0) {
+        client->engine.t_last = t_now;
+    }
+    SipfLineView view;
+    while (SipfLineReaderNext(&client->line_reader, &view)) {
+        if (view.overflow) {
+            // 応答として扱えない長さの行が来た
+            sipfReqFinish(req, -1);
+            return;
+        }
+        int cls = sipfLineDispatch(view.ptr, view.len);
+        if (cls == SIPF_LINE_RESET) {
+            // モジュールが再起動した. 応答はもう来ないのでタイムアウトを待たずに失敗にする
+            sipfReqFinish(req, -1);
+            return;
+        }
+        if (cls == SIPF_LINE_EVENT) {
+            continue;
+        }
+#if SIPF_STATS
+        sipfStatsLine(req, cls);
+#endif
+        sipfReqHandleLine(req, view.ptr, view.len);
+        if (client->engine.head != req || !client->engine.started) {
+            // 完了した. 残りの行は次のコマンドで
+            return;
+        }
+    }
+
+    //タイムアウト判定
+    if ((int32_t)((client->engine.t_last + req->timeout_ms) - t_now) < 0) {
+        sipfReqFinish(req, -3);
     }
 }
 
-//１行([CR] or [LF]の手前まで)をバッファに詰める
-int SipfUtilReadLine(uint8_t *buff, int buff_len, int timeout_ms)
+/**
+ * 実行中または待ち中の要求があるか
+ */
+bool SipfIsBusy(void)
 {
-    uint32_t t_recved, t_now;
-    int ret;
-    int len, idx = 0;
-    uint8_t b;
+    return client->engine.head != NULL;
+}
 
-    memset(buff, 0, buff_len);
-    t_recved = millis();
-    for (;;) {
-        t_now = millis();
-        len = Serial2.available();
-        for (int i = 0; i < len; i++) {
-            ret = Serial2.read();;
-            if (ret >= 0) {
-                b = (uint8_t)ret;
-                //
-                if (idx < buff_len) {
-                    //行末を判定
-                    if ((b == '\r') || (b == '\n')) {
-                        buff[idx] = '\0';
-                        return idx + 1; //長さを返す
-                    }
-                    //バッファに詰める
-                    buff[idx] = b;
-                    idx++;
-                }
-            }
-            t_recved = t_now;
-        }
-        //タイムアウト判定
-        if ((int32_t)((t_recved + timeout_ms) - t_now) < 0) {
-            //キャラクター間タイムアウト
-            return -3;
-        }
+/* SipfSetPriority()の設定(スレッドごと) */
+static SIPF_THREAD_LOCAL uint8_t sched_prio = SIPF_PRIO_NORMAL;
+static SIPF_THREAD_LOCAL uint32_t sched_deadline_ms = 0;
+
+/**
+ * 呼び出したスレッドが以降に投入する要求(同期版APIを含む)の優先度と期限を設定する
+ * deadline_ms: 投入からこの時間[ms]までに送信を始められなければ送らずにSIPF_RESULT_EXPIREDで完了する(0なら期限なし)
+ */
+void SipfSetPriority(SipfReqPrio prio, uint32_t deadline_ms)
+{
+    sched_prio = (prio < SIPF_PRIO_NUM) ? prio : SIPF_PRIO_BULK;
+    sched_deadline_ms = deadline_ms;
+}
+
+/**
+ * 要求をキューに積む
+ */
+static int sipfReqSubmit(SipfReq *req, SipfReqType type, SipfReqCallback cb, void *arg)
+{
+    if (__atomic_load_n(&req->busy, __ATOMIC_ACQUIRE)) {
+        // 実行中
+        return -1;
+    }
+    if (sipfClock() == NULL) {
+        // 時計が無いと期限や待ち時間を決められない(SipfClientInit()かSipfTransportSet()していない)
+        return -1;
+    }
+    req->type = type;
+    req->cb = cb;
+    req->cb_arg = arg;
+    req->result = 0;
+    req->busy = true;
+    req->next = NULL;
+    req->prio = sched_prio;
+    req->t_submit = SipfClientMillis();
+    req->has_deadline = (sched_deadline_ms != 0);
+    req->t_deadline = req->t_submit + sched_deadline_ms;
+#if SIPF_STATS
+    req->t_submit_us = SipfTransportMicros();
+#endif
+    if (sipfIsForeign()) {
+        // ワーカーの受信箱に積む(ロックしない. 他の投入と競合したらやりなおすだけ)
+        SipfReq *head = __atomic_load_n(&client->inbox, __ATOMIC_RELAXED);
+        do {
+            req->next = head;
+        } while (!__atomic_compare_exchange_n(&client->inbox, &head, req, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        return 0;
     }
-    return idx; //読み込んだ長さ
+    sipfQueueInsert(req);
+    return 0;
 }
 
 /**
- * $Wコマンドを送信
+ * 要求が完了するまでエンジンを回す
  */
-static int sipfSendW(uint8_t addr, uint8_t value)
+static int sipfReqRun(SipfReq *req)
 {
-    int len;
-    int ret;
-    
-    //UART受信バッファを読み捨てる
-    SipfClientFlushReadBuff();
+    return SipfReqWait(req, 0);
+}
 
-    // $Wコマンド送信
-    len = sprintf(cmd, "$W %02X %02X\r\n", addr, value);
-    ret = Serial2.write((uint8_t*)cmd, len);
+/**
+ * 完了を待つ間の1回分
+ * ワーカー(またはワーカーを使わない場合)はエンジンを回し, 他のスレッドは1ms待つ
+ */
+static void sipfWaitStep(void)
+{
+    if (sipfIsForeign()) {
+        sipfDelay(1);
+    } else {
+        SipfPoll();
+    }
+}
 
-    // $Wコマンド応答待ち
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CHAR); // キャラクタ間タイムアウトを指定して1行読む
-        if (ret == -3) {
-            //タイムアウト
+/**
+ * 待っている要求をキューから外して-1で完了させる(SIPF_REQ_CALLの関数の中で待とうとしたとき)
+ */
+static int sipfReqCancel(SipfReq *req)
+{
+    SipfReq *prev = NULL;
+    SipfReq *cur = client->engine.head;
+    while ((cur != NULL) && (cur != req)) {
+        prev = cur;
+        cur = cur->next;
+    }
+    if ((cur == NULL) || ((prev == NULL) && client->engine.started)) {
+        // キューにない, または実行中のSIPF_REQ_CALL自身
+        return -1;
+    }
+    if (prev != NULL) {
+        prev->next = req->next;
+    } else {
+        client->engine.head = req->next;
+    }
+    if (client->engine.tail == req) {
+        client->engine.tail = prev;
+    }
+    req->next = NULL;
+    req->result = -1;
+    __atomic_store_n(&req->busy, false, __ATOMIC_RELEASE);
+    if (req->cb) {
+        req->cb(req, -1, req->cb_arg);
+    }
+    return -1;
+}
+
+/**
+ * 要求の完了を待って結果を返す
+ * timeout_ms: 0なら完了するまで待つ
+ * SIPF_REQ_CALLの関数の中では待てない(関数が戻るまで要求は進まないので, 取り下げて-1を返す)
+ * return: 要求の結果, -3: タイムアウト(要求は実行中のままなので完了するまで再利用しないこと), -1: SIPF_REQ_CALLの中から呼んだ
+ */
+int SipfReqWait(SipfReq *req, uint32_t timeout_ms)
+{
+    if (sipfInCall() && __atomic_load_n(&req->busy, __ATOMIC_ACQUIRE)) {
+        return sipfReqCancel(req);
+    }
+    uint32_t t_start = SipfClientMillis();
+    while (__atomic_load_n(&req->busy, __ATOMIC_ACQUIRE)) {
+        if ((timeout_ms > 0) && ((SipfClientMillis() - t_start) >= timeout_ms)) {
             return -3;
         }
-        if (memcmp(cmd, "OK", 2) == 0) {
-            //OK
-            return 0;
-        } else if (memcmp(cmd, "NG", 2) == 0) {
-            //NG
-            return 1;
+        sipfWaitStep();
+    }
+    return req->result;
+}
+
+int SipfSubmitRegWrite(SipfReq *req, uint8_t addr, uint8_t value, SipfReqCallback cb, void *arg)
+{
+    req->u.w.addr = addr;
+    req->u.w.value = value;
+    return sipfReqSubmit(req, SIPF_REQ_W, cb, arg);
+}
+
+int SipfSubmitRegRead(SipfReq *req, uint8_t addr, uint8_t *value, SipfReqCallback cb, void *arg)
+{
+    req->u.r.addr = addr;
+    req->u.r.value = value;
+    return sipfReqSubmit(req, SIPF_REQ_R, cb, arg);
+}
+
+int SipfSubmitSetRegs(SipfReq *req, const SipfRegValue *list, int cnt, SipfReqCallback cb, void *arg)
+{
+    if ((cnt <= 0) || (cnt > SIPF_REG_BULK_MAX)) {
+        return -1;
+    }
+    req->u.regs.list = list;
+    req->u.regs.cnt = cnt;
+    return sipfReqSubmit(req, SIPF_REQ_REGS, cb, arg);
+}
+
+int SipfSubmitRegPrefetch(SipfReq *req, uint8_t addr, int cnt, SipfReqCallback cb, void *arg)
+{
+    if ((cnt <= 0) || ((addr + cnt) > 256)) {
+        return -1;
+    }
+    req->u.regs.list = NULL;
+    req->u.regs.base = addr;
+    req->u.regs.cnt = cnt;
+    return sipfReqSubmit(req, SIPF_REQ_REGS, cb, arg);
+}
+
+int SipfSubmitTx(SipfReq *req, SipfTxBatch *batch, uint8_t *otid, SipfReqCallback cb, void *arg)
+{
+    if (batch->obj_cnt == 0) {
+        return -1;
+    }
+    req->u.tx.batch = batch;
+    req->u.tx.otid = otid;
+    return sipfReqSubmit(req, SIPF_REQ_TX, cb, arg);
+}
+
+int SipfSubmitRx(SipfReq *req, uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz, SipfReqCallback cb, void *arg)
+{
+    return SipfSubmitRxArena(req, sipfDefaultArena(), otid, user_send_datetime_ms, sipf_recv_datetime_ms, remain, obj_cnt, obj_list, obj_list_sz, cb, arg);
+}
+
+static int sipfRxDrainNext(SipfRxDrain *d);
+
+/**
+ * ドレインの1回分の$$RXが完了した
+ */
+static void sipfRxDrainOnRx(SipfReq *req, int result, void *arg)
+{
+    SipfRxDrain *d = (SipfRxDrain*)arg;
+    if (result < 0) {
+        // 失敗(それまでのメッセージはon_msgに渡し済み)
+        if (d->on_done) {
+            d->on_done(d, result, d->arg);
+        }
+        return;
+    }
+    if (d->msg.otid[0] == '\0') {
+        // もう受信するメッセージがない
+        if (d->on_done) {
+            d->on_done(d, d->cnt, d->arg);
         }
-        delay(1);
+        return;
     }
+
+    // 1メッセージ受信した
+    d->msg.obj_cnt = (uint8_t)result;
+    d->cnt++;
+    bool stop = false;
+    if (d->on_msg && (d->on_msg(&d->msg, d->arg) != 0)) {
+        stop = true;    // 呼び出し側が打ち切った
+    }
+    if (d->msg.remain == 0) {
+        stop = true;    // 残りなし
+    }
+    if ((d->max_msgs != 0) && (d->cnt >= d->max_msgs)) {
+        stop = true;    // メッセージ数の上限
+    }
+    if ((d->budget_ms != 0) && ((uint32_t)(SipfClientMillis() - d->t_start) >= d->budget_ms)) {
+        stop = true;    // 時間切れ
+    }
+    if (stop || (sipfRxDrainNext(d) != 0)) {
+        if (d->on_done) {
+            d->on_done(d, d->cnt, d->arg);
+        }
+    }
+}
+
+static int sipfRxDrainNext(SipfRxDrain *d)
+{
+    d->msg.otid[0] = '\0';
+    d->msg.otid[32] = '\0';
+    // 完了通知の中から投入するので, 優先度は呼び出し元のスレッドの設定ではなく最初の投入時のものにする
+    uint8_t prio = sched_prio;
+    uint32_t deadline_ms = sched_deadline_ms;
+    sched_prio = d->prio;
+    sched_deadline_ms = (d->cnt == 0) ? deadline_ms : 0;    // 期限は最初の$$RXだけ
+    int ret = SipfSubmitRxArena(&d->req, d->arena, d->msg.otid, &d->msg.user_send_datetime_ms, &d->msg.sipf_recv_datetime_ms,
+                             &d->msg.remain, &d->msg.obj_qty, d->msg.obj_list, d->obj_list_sz, sipfRxDrainOnRx, d);
+    sched_prio = prio;
+    sched_deadline_ms = deadline_ms;
     return ret;
 }
 
 /**
- * $Rコマンド送信
+ * REMAINが0になるまで$$RXを繰り返す
+ * メッセージを受信するたびにon_msgを呼び, 終わったらon_doneを呼ぶ(result: on_msgに渡したメッセージ数 or エラー)
  */
-static int sipfSendR(uint8_t addr, uint8_t *read_value)
+int SipfSubmitRxDrain(SipfRxDrain *drain, SipfRxArena *arena, SipfObjObject *obj_list, uint8_t obj_list_sz, uint16_t max_msgs, uint32_t budget_ms, SipfRxMsgCallback on_msg, SipfRxDrainDone on_done, void *arg)
 {
-    int len, ret;
-    char *endptr;
-    SipfClientFlushReadBuff();
+    if (drain->req.busy) {
+        return -1;
+    }
+    drain->arena = (arena != NULL) ? arena : sipfDefaultArena();
+    drain->msg.obj_list = obj_list;
+    drain->obj_list_sz = obj_list_sz;
+    drain->max_msgs = max_msgs;
+    drain->budget_ms = budget_ms;
+    drain->t_start = SipfClientMillis();
+    drain->prio = sched_prio;
+    drain->cnt = 0;
+    drain->on_msg = on_msg;
+    drain->on_done = on_done;
+    drain->arg = arg;
+    return sipfRxDrainNext(drain);
+}
 
-    // $Rコマンド送信
-    len = sprintf(cmd, "$R %02X\r\n", addr);
-    ret = Serial2.write((uint8_t*)cmd, len);
+/**
+ * $$RXの要求(VALUEはarenaの空いているところに詰める)
+ */
+int SipfSubmitRxArena(SipfReq *req, SipfRxArena *arena, uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz, SipfReqCallback cb, void *arg)
+{
+    if (arena == NULL) {
+        return -1;
+    }
+    req->u.rx.arena = arena;
+    req->u.rx.otid = otid;
+    req->u.rx.user_send_datetime_ms = user_send_datetime_ms;
+    req->u.rx.sipf_recv_datetime_ms = sipf_recv_datetime_ms;
+    req->u.rx.remain = remain;
+    req->u.rx.obj_cnt = obj_cnt;
+    req->u.rx.obj_list = obj_list;
+    req->u.rx.obj_list_sz = obj_list_sz;
+    return sipfReqSubmit(req, SIPF_REQ_RX, cb, arg);
+}
 
-    // $Rコマンド応答待ち
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CMD);
-        if (ret == -3) {
-            //タイムアウト
-            return -3;
-        }
-        if (cmd[0] == '$') {
-            //エコーバック
-            continue;
-        }
-        if (memcmp(cmd, "NG", 2) == 0) {
-            //NG
-            return 1;
-        }
-        if (strlen(cmd) == 2) {
-            //Valueらしきもの
-            *read_value = strtol(cmd, &endptr, 16);
-            if (*endptr != '\0') {
-                //Null文字以外で変換が終わってる
-                return -1;
-            }
-            break;
-        }
+int SipfSubmitSetGnss(SipfReq *req, bool is_active, SipfReqCallback cb, void *arg)
+{
+    req->u.gnssen.is_active = is_active;
+    return sipfReqSubmit(req, SIPF_REQ_GNSSEN, cb, arg);
+}
+
+int SipfSubmitGnssLocation(SipfReq *req, GnssLocation *loc, SipfReqCallback cb, void *arg)
+{
+    if (loc == NULL) {
+        return -1;
     }
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CHAR); // キャラクタ間タイムアウトを指定して1行読む
-        if (ret == -3) {
-            //タイムアウト
-            return -3;
-        }
-        if (memcmp(cmd, "OK", 2) == 0) {
-            //OK
-            break;
-        }
+    req->u.gnssloc.loc = loc;
+    req->u.gnssloc.fix = NULL;
+    return sipfReqSubmit(req, SIPF_REQ_GNSSLOC, cb, arg);
+}
+
+int SipfSubmitGnssLocationFixed(SipfReq *req, GnssLocationFixed *fix, SipfReqCallback cb, void *arg)
+{
+    if (fix == NULL) {
+        return -1;
+    }
+    req->u.gnssloc.loc = NULL;
+    req->u.gnssloc.fix = fix;
+    return sipfReqSubmit(req, SIPF_REQ_GNSSLOC, cb, arg);
+}
+
+/**
+ * fn(fn_arg)をエンジンの順番が来たときに(ワーカーがいればワーカーのスレッドで)呼ぶ
+ * fnの中ではUARTを直接使ってよい. 戻り値が要求の結果になる
+ * fnが戻るまでエンジンは止まるので, fnの中で使える同期版APIはSipfCmdFput*()とSipfUtilReadLine()などのUARTを直接使うものだけ
+ * SipfCmdTx()やSipfSetGnss(), SipfGetGnssLocation()などエンジンを通す同期版APIは-1を返す(SipfSubmit*()で積むのはよい)
+ */
+int SipfSubmitCall(SipfReq *req, SipfReqFunc fn, void *fn_arg, SipfReqCallback cb, void *arg)
+{
+    req->u.call.fn = fn;
+    req->u.call.arg = fn_arg;
+    return sipfReqSubmit(req, SIPF_REQ_CALL, cb, arg);
+}
+
+/**
+ * $Wコマンドを送信
+ */
+static int sipfSendW(uint8_t addr, uint8_t value)
+{
+    SipfReq req = {};
+    if (SipfSubmitRegWrite(&req, addr, value, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sipfReqRun(&req);
+}
+
+/**
+ * $Rコマンド送信
+ */
+static int sipfSendR(uint8_t addr, uint8_t *read_value)
+{
+    SipfReq req = {};
+    if (SipfSubmitRegRead(&req, addr, read_value, NULL, NULL) != 0) {
+        return -1;
     }
-    return 0;   
+    return sipfReqRun(&req);
 }
 
 /**
@@ -159,12 +1627,17 @@ int SipfSetAuthMode(uint8_t mode)
 {
     int ret;
     uint8_t val;
+    if (regCacheGet(0x00, &val) && (val == mode)) {
+        //すでに設定済み
+        return 0;
+    }
     if (sipfSendW(0x00, mode) != 0) {
         //$W 送信失敗
         return -1;
     }
     for (;;) {
-        delay(200);
+        //反映されるまではキャッシュではなくモジュールに問い合わせる
+        SipfTransportDelay(200);
         ret = sipfSendR(0x00, &val);
         if (ret != 0) {
             return ret;
@@ -176,46 +1649,78 @@ int SipfSetAuthMode(uint8_t mode)
     return 0;
 }
 
+/**
+ * レジスタを一括で書き込む
+ * 値が同じレジスタは書かずに, 書いたレジスタは最後にまとめて読み返して確認する
+ */
+int SipfSetRegs(const SipfRegValue *list, int cnt)
+{
+    SipfReq req = {};
+    if (SipfSubmitSetRegs(&req, list, cnt, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sipfReqRun(&req);
+}
+
+/**
+ * レジスタを読む(キャッシュにあればモジュールには問い合わせない)
+ */
+int SipfRegRead(uint8_t addr, uint8_t *value)
+{
+    if (regCacheGet(addr, value)) {
+        return 0;
+    }
+    return sipfSendR(addr, value);
+}
+
+/**
+ * addrからcnt個のレジスタをまとめてキャッシュに読み込む(キャッシュにあるものは読まない)
+ */
+int SipfRegPrefetch(uint8_t addr, int cnt)
+{
+    SipfReq req = {};
+    if (SipfSubmitRegPrefetch(&req, addr, cnt, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sipfReqRun(&req);
+}
+
 /**
  * 認証情報を設定
  */
 int SipfSetAuthInfo(char *user_name, char *password)
 {
+    SipfRegValue regs[2 + 80 + 80];    // 完了まで戻らないのでスタックでよい(324バイト. スレッドごとに別になる)
+    int cnt = 0;
     int len;
-    //ユーザー名の長さを設定
+
+    //ユーザー名の長さとユーザー名
     len = strlen(user_name);
     if (len > 80) {
         return -1;
     }
-    if (sipfSendW(0x10, (uint8_t)len) != 0) {
-        return -1;  //$W送信失敗
-    }
-    delay(200);
-    //ユーザー名を設定
+    regs[cnt].addr = 0x10;
+    regs[cnt++].value = (uint8_t)len;
     for (int i = 0; i < len; i++) {
-        if (sipfSendW(0x20 + i, (uint8_t)user_name[i]) != 0) {
-            return -1;  //$W送信失敗
-        }
-        delay(200);
+        regs[cnt].addr = 0x20 + i;
+        regs[cnt++].value = (uint8_t)user_name[i];
     }
 
-    //パスワードの長さを設定
+    //パスワードの長さとパスワード
     len = strlen(password);
     if (len > 80) {
         return -1;
     }
-    if (sipfSendW(0x80, (uint8_t)len) != 0) {
-        return -1;  //$W送信失敗
-    }
-    delay(200);
-    //パスワードを設定
+    regs[cnt].addr = 0x80;
+    regs[cnt++].value = (uint8_t)len;
     for (int i = 0; i < len; i++) {
-        if (sipfSendW(0x90 + i, (uint8_t)password[i]) != 0) {
-            return -1;  //$W送信失敗
-        }
-        delay(200);
+        regs[cnt].addr = 0x90 + i;
+        regs[cnt++].value = (uint8_t)password[i];
     }
 
+    if (SipfSetRegs(regs, cnt) != 0) {
+        return -1;  //書き込み失敗
+    }
     return 0;
 }
 
@@ -223,488 +1728,185 @@ int SipfSetAuthInfo(char *user_name, char *password)
  * Fwバージョンを取得
  */
 int SipfGetFwVersion(uint32_t *version)
-{
-	uint8_t v = 0;
-	if (sipfSendR(0xf1, &v) != 0) {
-		return -1;
-	}
-	fw_version = (uint32_t)v << 24;	// MAJOR
-	if (sipfSendR(0xf2, &v) != 0) {
-		return -1;
-	}
-	fw_version |= (uint32_t)v << 16;// MINOR
-	if (sipfSendR(0xf3, &v) != 0) {
-		return -1;
-	}
-	fw_version |= (uint32_t)v;		// RELEASE下位
-	if (sipfSendR(0xf4, &v) != 0) {
-		return -1;
-	}
-	fw_version |= (uint32_t)v << 8;	// RELEASE上位
-
-    if (version) {
-        *version = fw_version;
-    }
-
-	return 0;
-}
-
-int SipfSetGnss(bool is_active) {
-    int len;
-    int ret;
-
-    //UART受信バッファを読み捨てる
-    SipfClientFlushReadBuff();
-
-    // $$GNSSENコマンド送信
-    len = sprintf(cmd, "$$GNSSEN %d\r\n", is_active?1:0);
-    ret = Serial2.write((uint8_t*)cmd, len);
-
-    // 応答待ち
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CMD);
-        if (ret == -3) {
-            // タイムアウト
-            return -3;
-        }
-        if (cmd[0] == '$') {
-            //エコーバック
-            continue;
-        }
-        if (memcmp(cmd, "NG", 2) == 0) {
-            // NG
-            return -1;
-        }
-        if (memcmp(cmd, "OK", 2) == 0) {
-            // OK
-            break;
-        }
-    }
-
-    return 0;
-}
-
-
-int SipfGetGnssLocation(GnssLocation *loc) {
-    int len;
-    int ret;
+{
+	uint8_t v[4];
+	if (SipfRegPrefetch(0xf1, 4) != 0) {
+		return -1;
+	}
+	for (int i = 0; i < 4; i++) {
+		regCacheGet(0xf1 + i, &v[i]);
+	}
+	client->fw_version = (uint32_t)v[0] << 24;	// MAJOR
+	client->fw_version |= (uint32_t)v[1] << 16;	// MINOR
+	client->fw_version |= (uint32_t)v[2];		// RELEASE下位
+	client->fw_version |= (uint32_t)v[3] << 8;	// RELEASE上位
 
-    if (loc == NULL) {
-      return -1;
+    if (version) {
+        *version = client->fw_version;
     }
 
-    //UART受信バッファを読み捨てる
-    SipfClientFlushReadBuff();
+	return 0;
+}
 
-    // $$GNSSLOCコマンド送信
-    len = sprintf(cmd, "$$GNSSLOC\r\n");
-    ret = Serial2.write((uint8_t*)cmd, len);
+int SipfSetGnss(bool is_active) {
+    SipfReq req = {};
+    if (SipfSubmitSetGnss(&req, is_active, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sipfReqRun(&req);
+}
 
-    // 位置情報待ち
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CMD); // コマンドタイムアウトまでに応答がなかったら諦める
-        if (ret == -3) {
-            //タイムアウト
-            return -3;
-        }
 
-        if (cmd[0] == '$') {
-            // エコーバック
-            continue;
-        }
-        if (memcmp(cmd, "NG", 2) == 0) {
-            // NG
-            return -1;
-        }
-        if (cmd[0] == 'A' || cmd[0] == 'V') {
-            // 位置情報
-            int counter = 0;
-            char *head = cmd;
-            char *next = cmd;
-            bool is_last = false;
-            for(;;) {
-              while(*next != '\0' && *next != ','){
-                next++;
-              }
-              is_last = (*next == '\0');
-              *next = '\0';
-              next++;
-              String str = String(head);
-
-              switch(counter){
-                case 0: // FIXED
-                  if (head[0] == 'A')
-                    loc->fixed = true;
-                  else if (head[0] == 'V')
-                    loc->fixed = false;
-                  else
-                    return -2;
-                  break;
-                case 1: // Longitude
-                  loc->longitude = str.toFloat();
-                  break;
-                case 2: // Latitude
-                  loc->latitude = str.toFloat();
-                  break;
-                case 3: // Altitude
-                  loc->altitude = str.toFloat();
-                  break;
-                case 4: // Speed
-                  loc->speed = str.toFloat();
-                  break;
-                case 5: // Heading
-                  loc->heading = str.toFloat();
-                  break;
-                case 6: // Datetime
-                  if (strlen(head) != 20) {
-                    return -2;
-                  }
-                  if (head[4] != '-' || head[7] != '-' || head[10] != 'T' || head[13] != ':' ||  head[16] != ':' ||  head[19] != 'Z'){
-                    return -2;
-                  }
-                  head[4] = '\0';
-                  head[7] = '\0';
-                  head[10] = '\0';
-                  head[13] = '\0';
-                  head[16] = '\0';
-                  head[19] = '\0';
-                  loc->year = atoi(&head[0]);
-                  loc->month = atoi(&head[5]);
-                  loc->day = atoi(&head[8]);
-                  loc->hour = atoi(&head[11]);
-                  loc->minute = atoi(&head[14]);
-                  loc->second = atoi(&head[17]);
-                  break;
-              }
-
-              if (is_last){
-                if (counter != 6) {
-                  return -2;
-                }
-                break;
-              }
-              head = next;
-              counter++;
-            }
-            break;
-        }
+int SipfGetGnssLocation(GnssLocation *loc) {
+    SipfReq req = {};
+    if (SipfSubmitGnssLocation(&req, loc, NULL, NULL) != 0) {
+        return -1;
     }
+    return sipfReqRun(&req);
+}
 
-    // OK応答待ち
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CHAR); // キャラクタ間タイムアウトまでになにも応答なかったら諦める
-        if (ret == -3) {
-            // タイムアウト
-            return -3;
-        }
-        if (memcmp(cmd, "NG", 2) == 0) {
-            // NG
-            return -1;
-        }
-        if (memcmp(cmd, "OK", 2) == 0) {
-            // OK
-            break;
-        }
+int SipfGetGnssLocationFixed(GnssLocationFixed *fix) {
+    SipfReq req = {};
+    if (SipfSubmitGnssLocationFixed(&req, fix, NULL, NULL) != 0) {
+        return -1;
     }
-
-    return 0;
+    return sipfReqRun(&req);
 }
 
+/**
+ * $$TXのオブジェクトのバッチを開始
+ */
+void SipfTxBatchBegin(SipfTxBatch *batch)
+{
+    batch->len = sprintf(batch->line, "$$TX");
+    batch->obj_cnt = 0;
+}
 
-int SipfCmdTx(uint8_t tag_id, SipfObjTypeId type, uint8_t *value, uint8_t value_len, uint8_t *otid)
+/**
+ * バッチにオブジェクトを追加
+ * return: 0: 追加した, -1: 1回の$$TXに収まらない(バッチは変更しない)
+ */
+int SipfTxBatchAdd(SipfTxBatch *batch, uint8_t tag_id, SipfObjTypeId type, uint8_t *value, uint8_t value_len)
 {
-    int len;
-    int ret;
-    
-    //UART受信バッファを読み捨てる
-    SipfClientFlushReadBuff();
+    int len = batch->len;
+
+    // " TT YY " + VALUE + "\r\n" が収まるか
+    if ((len + 7 + (value_len * 2) + 2) >= SIPF_TX_LINE_MAX) {
+        return -1;
+    }
 
-    // $$TXコマンド送信
-    len = sprintf(cmd, "$$TX %02X %02X ", tag_id, (uint8_t)type);
+    batch->line[len++] = ' ';
+    len += SipfHexEncode(&batch->line[len], &tag_id, 1);
+    batch->line[len++] = ' ';
+    uint8_t type_id = (uint8_t)type;
+    len += SipfHexEncode(&batch->line[len], &type_id, 1);
+    batch->line[len++] = ' ';
     switch (type) {
         case OBJ_TYPE_BIN:
         case OBJ_TYPE_STR_UTF8:
-			//順番どおりに文字列に変換
-            for (int i = 0; i < value_len; i++) {
-                len += sprintf(&cmd[len], "%02X", value[i]);
-            }
+            //順番どおりに文字列に変換
+            len += SipfHexEncode(&batch->line[len], value, value_len);
             break;
         default:
             // リトルエンディアンだからアドレス上位から順に文字列に変換
-            for (int i = (value_len - 1); i >= 0; i--) {
-                len += sprintf(&cmd[len], "%02X", value[i]);
-            }
-            break;
-    }
-
-    len += sprintf(&cmd[len], "\r\n");
-    ret = Serial2.write((uint8_t*)cmd, len);
-
-    // OTID待ち
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CMD); // コマンドタイムアウトまでになにも応答がなかったら諦める
-        if (ret == -3) {
-            //タイムアウト
-            return -3;
-        }
-        if (cmd[0] == '$') {
-            //エコーバック
-            continue;
-        }
-        if (ret == 33) {
-            //OTIDらしきもの
-            memcpy(otid, cmd, 32);
-            break;
-        }
-        if (memcmp(cmd, "NG", 2) == 0) {
-            //NG
-            return -1;
-        }
-    }
-    for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CHAR); // キャラクタ間タイムアウトまでになにも応答なかったら諦める
-        if (ret == -3) {
-            //タイムアウト
-            return -3;
-        }
-        if (memcmp(cmd, "OK", 2) == 0) {
-            //OK
+            len += SipfHexEncodeRev(&batch->line[len], value, value_len);
             break;
-        }
     }
+    batch->line[len] = '\0';
+    batch->len = len;
+    batch->obj_cnt++;
     return 0;
 }
 
 /**
- * 2桁の16進数文字列を数値に変換
+ * バッチのオブジェクトをまとめて1回の$$TXで送信
  */
-static int utilHexToUint8(char *hex, uint8_t *value)
+int SipfTxBatchCommit(SipfTxBatch *batch, uint8_t *otid)
 {
-	if ((hex[0] >= '0') && (hex[0] <= '9')) {
-		*value = (hex[0] - '0') << 4;
-	} else if ((hex[0] >= 'A') && (hex[0] <= 'F')) {
-		*value = (hex[0] - 'A' + 10) << 4;
-	} else if ((hex[0] >= 'a') && (hex[0] <= 'f')) {
-		*value = (hex[0] - 'a' + 10) << 4;
-	} else {
-		return -1;
-	}
-
-	if ((hex[1] >= '0') && (hex[1] <= '9')) {
-		*value |= (hex[1] - '0') & 0x0f;
-	} else if ((hex[1] >= 'A') && (hex[1] <= 'F')) {
-		*value |= (hex[1] - 'A' + 10) & 0x0f;
-	} else if ((hex[1] >= 'a') && (hex[1] <= 'f')) {
-		*value |= (hex[1] - 'a' + 10) & 0x0f;
-	} else {
-		return -1;
-	}
+    SipfReq req = {};
+    if (SipfSubmitTx(&req, batch, otid, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sipfReqRun(&req);
+}
 
-	return *value;
+int SipfCmdTx(uint8_t tag_id, SipfObjTypeId type, uint8_t *value, uint8_t value_len, uint8_t *otid)
+{
+    // 複数のスレッドから呼ばれてもよいようにバッチは呼び出し側のスタックに置く
+    SipfTxBatch batch;
+    SipfTxBatchBegin(&batch);
+    if (SipfTxBatchAdd(&batch, tag_id, type, value, value_len) != 0) {
+        return -1;
+    }
+    return SipfTxBatchCommit(&batch, otid);
 }
 
 /**
  * $$RX送信
  */
-static uint8_t rxValueBuff[1024];
 int SipfCmdRx(uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz)
 {
-	enum cmd_rx_stat {
-		W_OTID,		//OTID待ち
-		W_SEND_DTM,	//ユーザーサーバー送信時刻待ち
-		W_RECV_DTM,	//SIPF受信時刻待ち
-		W_REMAIN,	//REMAIN待ち
-		W_QTY,		//OBJQTY待ち
-		W_OBJS,		//OBJ待ち
-	};
+    SipfReq req = {};
+    if (SipfSubmitRx(&req, otid, user_send_datetime_ms, sipf_recv_datetime_ms, remain, obj_cnt, obj_list, obj_list_sz, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sipfReqRun(&req);
+}
 
-    int len;
-    int ret;
+typedef struct {
+    SipfRxMsgCallback on_msg;
+    void *arg;
+    bool done;
+    int result;
+}   SipfRxDrainSync;
 
-    //UART受信バッファを読み捨てる
-    SipfClientFlushReadBuff();
+static int sipfRxDrainMsgSync(const SipfRxMessage *msg, void *arg)
+{
+    SipfRxDrainSync *s = (SipfRxDrainSync*)arg;
+    return s->on_msg ? s->on_msg(msg, s->arg) : 0;
+}
 
-    // $$RXコマンド送信
-    len = sprintf(cmd, "$$RX\r\n");
-    ret = Serial2.write((uint8_t*)cmd, len);
+static void sipfRxDrainOnDoneSync(SipfRxDrain *drain, int result, void *arg)
+{
+    SipfRxDrainSync *s = (SipfRxDrainSync*)arg;
+    s->result = result;
+    __atomic_store_n(&s->done, true, __ATOMIC_RELEASE);  // 待っているスレッドにresultを見せてから完了にする
+}
 
-    // 応答を受け取る
-    enum cmd_rx_stat rx_stat = W_OTID;
-    int line_timeout_ms = TMOUT_CMD;	// 最初はSIPFからの応答を待つのでコマンドタイムアウトを設定
-    uint8_t cnt = 0;
-    uint16_t idx = 0;
-    char *value_top;
-    for (;;) {
-    	ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), line_timeout_ms);	// 1行読む
-        Serial.write(cmd);
-    	if (ret == -3) {
-    		//タイムアウト
-    		return -3;
-    	}
-
-        ret--;  //文字列末尾のNULL文字分引く
-
-    	if (ret == 0) {
-    		// 何もなければもういちど
-    		continue;
-    	}
-
-    	if ((ret == 1) && ((cmd[0] == '\r') || (cmd[0] == '\n'))) {
-    		// 空行は読み飛ばし
-    		continue;
-    	}
-
-    	switch (rx_stat) {
-    	/* OTID待ち */
-    	case W_OTID:
-    		if (cmd[0] == '$') {
-    			// エコーバックを受信したら読み捨て
-    			continue;
-    		}
-    		if (memcmp(cmd, "OK", 2) == 0) {
-    			// 受信データなし
-    			return 0;
-    		}
-    		if (ret != 32) {
-    			// OTIDじゃないっぽい
-    			return -1;
-    		}
-    		memcpy(otid, cmd, 32);
-    		rx_stat = W_SEND_DTM;		    // ユーザーサーバー送信時刻待ちへ
-    		line_timeout_ms = TMOUT_CHAR;	// キャラクタ間タイムアウトに設定
-    		break;
-    	/* ユーザーサーバー送信時刻待ち */
-    	case W_SEND_DTM:
-    		if (ret != 16) {
-    			// ユーザーサーバーの送信時刻(64bit整数)じゃないっぽい
-    			return -1;
-    		}
-    		*user_send_datetime_ms = 0;
-    		for (int i = 0; i < 8; i++) {
-    			uint8_t v;
-    			if (utilHexToUint8(&cmd[i*2], &v) == -1) {
-    				// HEXから数値への変換ができなかった
-    				return -1;
-    			}
-    			*user_send_datetime_ms |= (uint64_t)v << (56-(i*8));
-    		}
-    		rx_stat = W_RECV_DTM;
-    		break;
-    	/* SIPF受信時刻待ち */
-    	case W_RECV_DTM:
-    		if (ret != 16) {
-    			// SIPFの受信時刻(64bit整数)じゃないっぽい
-    			return -1;
-    		}
-    		*sipf_recv_datetime_ms = 0;
-    		for (int i = 0; i < 8; i++) {
-    			uint8_t v;
-    			if (utilHexToUint8(&cmd[i*2], &v) == -1) {
-    				// HEXから数値への変換ができなかった
-    				return -1;
-    			}
-    			*sipf_recv_datetime_ms |= (uint64_t)v << (56-(i*8));
-    		}
-    		rx_stat = W_REMAIN;
-    		break;
-    	/* REMAIN待ち */
-    	case W_REMAIN:
-    		if (ret != 2) {
-    			// REMAIN(8bit整数)じゃないっぽい
-    			return -1;
-    		}
-    		if (utilHexToUint8(cmd, remain) == -1) {
-    			// HEXから変換できなかった
-    			return -1;
-    		}
-    		rx_stat = W_QTY;
-    		break;
-    	/* OBJQTY待ち */
-    	case W_QTY:
-    		if (ret != 2) {
-    			// OBJQTY(8bit整数)じゃないっぽい
-    			return -1;
-    		}
-    		if (utilHexToUint8(cmd, obj_cnt) == -1) {
-    			// HEXから変換できなかった
-    			return -1;
-    		}
-    		rx_stat = W_OBJS;
-    		break;
-    	/* OBJ待ち */
-    	case W_OBJS:
-    		if (memcmp(cmd, "OK", 2) == 0) {
-    			// OBJECTを受信しきった
-    			return cnt;
-    		}
-    		if (memcmp(cmd, "NG", 2) == 0) {
-    			// エラーらしい
-    			return -1;
-    		}
-    		if (cnt >= obj_list_sz) {
-    			// リストの上限に達した
-    			continue;
-    		}
-    		if (ret >= 11) {
-    			// OBJECTっぽい
-        		if ((cmd[2] != ' ') || (cmd[5] != ' ') || (cmd[8] != ' ')) {
-        			// OBJCTじゃない
-        			return -1;
-        		}
-
-        		SipfObjObject *obj = &obj_list[cnt++];
-        		if (fw_version >= 0x00030001) {
-                    // TAG_ID
-                    if (utilHexToUint8(&cmd[0], &obj->tag_id) == -1) {
-                        // HEXから変換できなかった
-                        return -1;
-                    }
-                    // TYPE
-                    if (utilHexToUint8(&cmd[3], &obj->type) == -1) {
-                        // HEXから変換できなかった
-                        return -1;
-                    }
-                } else {
-                    // TYPE
-                    if (utilHexToUint8(&cmd[0], &obj->type) == -1) {
-                        // HEXから変換できなかった
-                        return -1;
-                    }
-                    // TAG_ID
-                    if (utilHexToUint8(&cmd[3], &obj->tag_id) == -1) {
-                        // HEXから変換できなかった
-                        return -1;
-                    }
-                }
-        		// VALUE_LEN
-        		if (utilHexToUint8(&cmd[6], &obj->value_len) == -1) {
-        			// HEXから変換できなかった
-        			return -1;
-        		}
-        		//VALUE
-        		obj->value = &rxValueBuff[idx];	//VALUEの先頭のポインタをvalueに設定
-        		value_top = &cmd[9];
-        		if ((obj->type == OBJ_TYPE_BIN) || (obj->type == OBJ_TYPE_STR_UTF8)) {
-        			//そのままの順でHEXから変換してバッファに追加
-        			for (int i = 0; i < obj->value_len; i++) {
-        				if (utilHexToUint8(&value_top[i*2], &rxValueBuff[idx++]) == -1) {
-        					// HEXからの変換に失敗
-        					return -1;
-        				}
-        			}
-        		} else {
-        			//バイトスワップしてHEXから変換してバッファに追加
-        			for (int i = obj->value_len; i > 0; i--) {
-        				if (utilHexToUint8(&value_top[(i-1)*2], &rxValueBuff[idx++]) == -1) {
-        					// HEXからの変換に失敗
-        					return -1;
-        				}
-        			}
-        		}
-    		}
-    		break;
-    	}
+/**
+ * REMAINが0になるまで$$RXを繰り返す(完了まで戻らない)
+ * return: on_msgに渡したメッセージ数, 負ならエラー
+ */
+int SipfCmdRxDrain(SipfObjObject *obj_list, uint8_t obj_list_sz, uint16_t max_msgs, uint32_t budget_ms, SipfRxMsgCallback on_msg, void *arg)
+{
+    SipfRxDrain drain = {};
+    SipfRxDrainSync sync = { on_msg, arg, false, 0 };
+    if (sipfInCall()) {
+        // SIPF_REQ_CALLの関数の中では完了しない
+        return -1;
     }
+    if (SipfSubmitRxDrain(&drain, NULL, obj_list, obj_list_sz, max_msgs, budget_ms, sipfRxDrainMsgSync, sipfRxDrainOnDoneSync, &sync) != 0) {
+        return -1;
+    }
+    // 1回ごとの$$RXの完了ではなくon_doneを待つ(次の$$RXは完了通知の中で投入される)
+    while (!__atomic_load_n(&sync.done, __ATOMIC_ACQUIRE)) {
+        sipfWaitStep();
+    }
+    return sync.result;
+}
+
+/**
+ * $$RX送信(VALUEはarenaに詰める)
+ * arenaをリセットするまでは前に受信したメッセージのVALUEも有効なまま
+ * 入りきらなければ-1を返す(モジュールからは取り出し済みなのでそのメッセージは失われる)
+ */
+int SipfCmdRxArena(SipfRxArena *arena, uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz)
+{
+    SipfReq req = {};
+    if (SipfSubmitRxArena(&req, arena, otid, user_send_datetime_ms, sipf_recv_datetime_ms, remain, obj_cnt, obj_list, obj_list_sz, NULL, NULL) != 0) {
+        return -1;
+    }
+    return sipfReqRun(&req);
 }
 
 /**
@@ -714,32 +1916,86 @@ static int sipfCmdFputWaitNg(void)
 {
 	int ret;
     for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CHAR);
+        ret = SipfUtilReadLine((uint8_t*)client->cmd, sizeof(client->cmd), TMOUT_CHAR);
         if (ret == -3) {
             //タイムアウト
             return -3;
         }
-        if (memcmp(cmd, "NG", 2) == 0) {
+        if (memcmp(client->cmd, "NG", 2) == 0) {
             //OK
             break;
         }
     }
     return 0;
 }
-static uint8_t buf_xmodem_buff[XMODEM_SZ_BLOCK];
-int SipfCmdFput(char *file_id, uint8_t *file_body, size_t sz_file)
+
+/**
+ * ブロックごとの時間計測の通知先を設定する(NULLで解除)
+ */
+void SipfSetFputTimingHook(SipfFputTimingHook hook, void *arg)
+{
+    client->fput_timing_hook = hook;
+    client->fput_timing_hook_arg = arg;
+}
+
+/**
+ * 直前の$$FPUTの時間計測の集計を取得する
+ */
+void SipfFputGetTiming(SipfFputTiming *timing)
+{
+    *timing = client->fput_timing;
+}
+
+/**
+ * readerからsz_blockバイト読み出してフレームを組み立てる
+ * return: フレームの長さ, -1: 読み出せない
+ */
+static int sipfFputPrepare(uint8_t *frame, uint8_t bn, size_t sz_block, SipfFputReader reader, void *arg)
+{
+    for (size_t got = 0; got < sz_block;) {
+        int ret = reader(&frame[XMODEM_FRAME_DATA_OFS + got], sz_block - got, arg);
+        if (ret <= 0) {
+            return -1;
+        }
+        got += ret;
+    }
+    return XmodemFrameBlock(frame, bn, sz_block);
+}
+
+/**
+ * $$FPUTでXMODEM-1K(1024Byteブロック)を使うか
+ * モジュールが'C'(CRCモード)で送信要求したときだけ有効で, NAKなら従来の128Byteブロックで送る
+ */
+void SipfSetFputBlock1k(bool enable)
+{
+    client->fput_block1k = enable;
+}
+
+/**
+ * SipfCmdFputStream()の本体
+ */
+static int sipfCmdFputStream(char *file_id, size_t sz_file, SipfFputReader reader, void *arg)
 {
     int len, ret;
+    // XMODEMの転送はエンジンを通さないので先に積まれている要求を終わらせる(SIPF_REQ_CALLで呼ばれたときは順番が来ている)
+    while (SipfIsBusy() && !client->engine.in_call) {
+        SipfPoll();
+    }
     //UART受信バッファを読み捨てる
     SipfClientFlushReadBuff();
+    // XMODEM開始(コマンドを送った後に捨てるとすぐに来た送信要求まで捨ててしまう)
+    XmodemBegin();
+    XmodemSetBlock1k(client->fput_block1k);
     // $$FPUTコマンド送信
-    len = sprintf(cmd, "$$FPUT %s %08X\r\n", file_id, sz_file);
-    ret = Serial2.write((uint8_t*)cmd, len);
+    len = sprintf(client->cmd, "$$FPUT %s %08X\r\n", file_id, sz_file);
+    ret = SipfTransportWrite((uint8_t*)client->cmd, len);
+#if SIPF_STATS
+    uint32_t t_cmd = SipfTransportMicros();
+#endif
 
-    // XMODEM開始
-    XmodemBegin();
     // 送信要求待ち(タイムアウト30秒)
     XmodemSendRet xret = XmodemSendWaitRequest(30000);
+    SIPF_STATS_LATENCY(SIPF_STATS_CMD_FPUT, SIPF_STATS_PHASE_ECHO, SipfTransportMicros() - t_cmd);
     switch (xret) {
     case XMODEM_SEND_RET_OK:
         break;
@@ -750,16 +2006,66 @@ int SipfCmdFput(char *file_id, uint8_t *file_body, size_t sz_file)
         return xret;
     }
     // ブロック送信
+    // ブロックNのACKを待つ間にブロックN+1を組み立てておく. 再送は組み立て済みのフレームをそのまま送る
+    memset(&client->fput_timing, 0, sizeof(client->fput_timing));
+    uint32_t t_start = SipfTransportMicros();
     uint8_t fget_bn = 1;
-    size_t sz_block;
-    for (int idx = 0; idx < sz_file; idx += XMODEM_SZ_BLOCK) {
-        for (int i = 0; i < FPUT_RETRY_MAX; i++) {
-            if ((sz_file - idx) < XMODEM_SZ_BLOCK) {
-                sz_block = len % XMODEM_SZ_BLOCK;
-            } else {
-                sz_block = XMODEM_SZ_BLOCK;
+    size_t sz_xmodem = XmodemSendBlockSize();   // 受信側の要求とSipfSetFputBlock1k()で決まる
+    size_t idx = 0;
+    size_t sz_block[2] = { 0, 0 };
+    int sz_frame[2];
+    int cur = 0;
+    bool has_next;
+    if (sz_file > 0) {
+        sz_block[cur] = (sz_file < sz_xmodem) ? sz_file : sz_xmodem;
+        sz_frame[cur] = sipfFputPrepare(client->fput_frame[cur], fget_bn, sz_block[cur], reader, arg);
+        if (sz_frame[cur] < 0) {
+            // 読み出せない. 転送を中断してNG待ち
+            XmodemTransmitCancel();
+            sipfCmdFputWaitNg();
+            return -1;
+        }
+        idx += sz_block[cur];
+    }
+    while (sz_block[cur] > 0) {
+        has_next = false;
+        int i;
+        for (i = 0; i < FPUT_RETRY_MAX; i++) {
+            SipfFputBlockTiming bt = { fget_bn, (uint16_t)sz_block[cur], (uint8_t)i, 0, 0, 0 };
+            uint32_t t0 = SipfTransportMicros();
+            xret = XmodemSendFrame(client->fput_frame[cur], sz_frame[cur]);
+            uint32_t t1 = SipfTransportMicros();
+            if ((xret == XMODEM_SEND_RET_OK) && !has_next && (idx < sz_file)) {
+                // 次のブロックを組み立てる
+                int nxt = cur ^ 1;
+                sz_block[nxt] = ((sz_file - idx) < sz_xmodem) ? (sz_file - idx) : sz_xmodem;
+                sz_frame[nxt] = sipfFputPrepare(client->fput_frame[nxt], fget_bn + 1, sz_block[nxt], reader, arg);
+                if (sz_frame[nxt] < 0) {
+                    XmodemTransmitCancel();
+                    sipfCmdFputWaitNg();
+                    return -1;
+                }
+                idx += sz_block[nxt];
+                has_next = true;
+            }
+            uint32_t t2 = SipfTransportMicros();
+            if (xret == XMODEM_SEND_RET_OK) {
+                xret = XmodemSendWaitAck(10000); //タイムアウト10秒
+            }
+            uint32_t t3 = SipfTransportMicros();
+
+            // 時間計測
+            bt.us_write = t1 - t0;
+            bt.us_prepare = t2 - t1;
+            bt.us_wait = t3 - t2;
+            client->fput_timing.us_write += bt.us_write;
+            client->fput_timing.us_prepare += bt.us_prepare;
+            client->fput_timing.us_wait += bt.us_wait;
+            if (client->fput_timing_hook) {
+                client->fput_timing_hook(&bt, client->fput_timing_hook_arg);
             }
-            xret = XmodemSendBlock(&fget_bn, &file_body[idx], sz_block, 10000); //タイムアウト10秒
+            SIPF_STATS_LATENCY(SIPF_STATS_CMD_FPUT, SIPF_STATS_PHASE_RESP, bt.us_wait);
+
             switch (xret) {
             case XMODEM_SEND_RET_OK:
                 goto next_block;
@@ -768,7 +2074,9 @@ int SipfCmdFput(char *file_id, uint8_t *file_body, size_t sz_file)
                 sipfCmdFputWaitNg();
                 return xret;
             case XMODEM_SEND_RET_RETRY:
-                // 同じブロックを再送
+                // 同じフレームを再送
+                client->fput_timing.retries++;
+                SIPF_STATS_RETRY(SIPF_STATS_CMD_FPUT);
                 continue;
             case XMODEM_SEND_RET_TIMEOUT:
             case XMODEM_SEND_RET_FAILED:
@@ -778,24 +2086,166 @@ int SipfCmdFput(char *file_id, uint8_t *file_body, size_t sz_file)
             }
             break;
         }
+        if (i >= FPUT_RETRY_MAX) {
+            // 再送しても受け取ってもらえない
+            XmodemTransmitCancel();
+            sipfCmdFputWaitNg();
+            return -1;
+        }
 next_block:
+        client->fput_timing.blocks++;
         fget_bn++;  // ブロック番号を加算
+        if (!has_next) {
+            break;
+        }
+        cur ^= 1;
     }
+    client->fput_timing.us_total = SipfTransportMicros() - t_start;
 	
     // XMODEM転送終了
 	XmodemSendEnd(500);
 
     // $$FGETコマンドの応答を見る
     for (;;) {
-        ret = SipfUtilReadLine((uint8_t*)cmd, sizeof(cmd), TMOUT_CMD);
+        ret = SipfUtilReadLine((uint8_t*)client->cmd, sizeof(client->cmd), TMOUT_CMD);
         if (ret == -3) {
             // タイムアウト
             return -3;
         }
-        if (memcmp(cmd, "OK", 2) == 0) {
+        if (memcmp(client->cmd, "OK", 2) == 0) {
             // OK
             break;
         }
     }
     return 0;
 }
+
+/**
+ * $$FPUTでファイルを送信する(readerからブロックごとに読み出す)
+ * reader: buffにlenバイト読み込んで読んだバイト数を返す. 負ならエラー
+ * XMODEMのブロック1つ分しかバッファしないので大きなファイルでもメモリ使用量は一定
+ */
+typedef struct {
+    char *file_id;
+    size_t sz_file;
+    SipfFputReader reader;
+    void *arg;
+}   SipfFputCall;
+
+static int sipfFputCall(void *arg)
+{
+    SipfFputCall *c = (SipfFputCall*)arg;
+    return SipfCmdFputStream(c->file_id, c->sz_file, c->reader, c->arg);
+}
+
+int SipfCmdFputStream(char *file_id, size_t sz_file, SipfFputReader reader, void *arg)
+{
+    if (sipfIsForeign()) {
+        // ワーカーのスレッドで転送してもらう
+        SipfFputCall c = { file_id, sz_file, reader, arg };
+        SipfReq req = {};
+        if (SipfSubmitCall(&req, sipfFputCall, &c, NULL, NULL) != 0) {
+            return -1;
+        }
+        return SipfReqWait(&req, 0);
+    }
+#if SIPF_STATS
+    uint32_t t_start = SipfTransportMicros();
+#endif
+    int ret = sipfCmdFputStream(file_id, sz_file, reader, arg);
+    SIPF_STATS_LATENCY(SIPF_STATS_CMD_FPUT, SIPF_STATS_PHASE_DONE, SipfTransportMicros() - t_start);
+    SIPF_STATS_RESULT(SIPF_STATS_CMD_FPUT, ret, false);
+    return ret;
+}
+
+typedef struct {
+    const uint8_t *body;
+    size_t idx;
+}   SipfFputMemReader;
+
+static int sipfFputReadMem(uint8_t *buff, int len, void *arg)
+{
+    SipfFputMemReader *m = (SipfFputMemReader*)arg;
+    memcpy(buff, &m->body[m->idx], len);
+    m->idx += len;
+    return len;
+}
+
+/**
+ * stdioのファイル(ESP32ではSPIFFSやSDのVFSも)から読み出すreader
+ * arg: FILE*
+ */
+int SipfFputReadStdio(uint8_t *buff, int len, void *arg)
+{
+    size_t n = fread(buff, 1, len, (FILE*)arg);
+    if (n == 0) {
+        return -1;
+    }
+    return (int)n;
+}
+
+/**
+ * $$FPUTでメモリ上のファイルを送信する
+ */
+int SipfCmdFput(char *file_id, uint8_t *file_body, size_t sz_file)
+{
+    SipfFputMemReader m = { file_body, 0 };
+    return SipfCmdFputStream(file_id, sz_file, sipfFputReadMem, &m);
+}
+
+static int sipfFputRewindMem(void *arg)
+{
+    ((SipfFputMemReader*)arg)->idx = 0;
+    return 0;
+}
+
+/**
+ * SipfFputReadStdio()で読んだファイルを先頭に戻す
+ */
+int SipfFputRewindStdio(void *arg)
+{
+    return (fseek((FILE*)arg, 0, SEEK_SET) == 0) ? 0 : -1;
+}
+
+/**
+ * $$FPUTで圧縮して送信する(readerからブロックごとに読み出す)
+ * FILE_IDの後ろにSIPF_LZ_FILE_SUFFIXを付けて送る. 展開はホスト側で行う(tools/sipf_lz)
+ * $$FPUTは先に大きさを送るので, 一度圧縮して大きさを求めてからrewindで先頭に戻してもう一度圧縮しながら送る
+ * 1回目はUARTを使わずに呼んだスレッドで行い, 2回目はブロックのACKを待つ間に次のブロックを圧縮する
+ * lz: 圧縮器の作業領域(転送が終わるまで使う)
+ */
+int SipfCmdFputLzStream(char *file_id, size_t sz_file, SipfFputReader reader, SipfFputRewind rewind, void *arg, SipfLzEncoder *lz)
+{
+    uint32_t crc;
+    int32_t sz_lz = SipfLzMeasure(lz, sz_file, reader, arg, &crc);
+    if ((sz_lz < 0) || (rewind(arg) != 0)) {
+        return -1;
+    }
+    return SipfCmdFputLzMeasured(file_id, sz_file, sz_lz, crc, reader, arg, lz);
+}
+
+/**
+ * $$FPUTで圧縮して送信する(大きさとCRC-32はSipfLzMeasure()で求めておいたもの)
+ * 先に測っておけば, SIPF_REQ_CALLの中では圧縮しながら送るだけになる
+ * reader: 先頭から読み出せる状態にしておく
+ */
+int SipfCmdFputLzMeasured(char *file_id, size_t sz_file, uint32_t sz_lz, uint32_t crc, SipfFputReader reader, void *arg, SipfLzEncoder *lz)
+{
+    char lz_id[64];
+    if ((strlen(file_id) + strlen(SIPF_LZ_FILE_SUFFIX)) >= sizeof(lz_id)) {
+        return -1;
+    }
+    snprintf(lz_id, sizeof(lz_id), "%s%s", file_id, SIPF_LZ_FILE_SUFFIX);
+
+    SipfLzEncodeBegin(lz, sz_file, crc, reader, arg);
+    return SipfCmdFputStream(lz_id, sz_lz, SipfLzEncodeRead, lz);
+}
+
+/**
+ * $$FPUTでメモリ上のファイルを圧縮して送信する
+ */
+int SipfCmdFputLz(char *file_id, uint8_t *file_body, size_t sz_file, SipfLzEncoder *lz)
+{
+    SipfFputMemReader m = { file_body, 0 };
+    return SipfCmdFputLzStream(file_id, sz_file, sipfFputReadMem, sipfFputRewindMem, &m, lz);
+}
@@ -6,8 +6,15 @@
 #ifndef _SIPF_OBJ_PARSER_H_
 #define _SIPF_OBJ_PARSER_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "sipf_line.h"
+#include "sipf_lz.h"
+#include "sipf_transport.h"
+#include "xmodem.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -63,24 +70,391 @@ typedef struct {
   int second;
 } GnssLocation;
 
+/* 位置情報(固定小数点) */
+typedef struct {
+  bool fixed;
+  int32_t longitude;    // 1e-6度
+  int32_t latitude;     // 1e-6度
+  int32_t altitude;     // 1e-3
+  int32_t speed;        // 1e-3
+  int32_t heading;      // 1e-3度
+  int year;
+  int month;
+  int day;
+  int hour;
+  int minute;
+  int second;
+} GnssLocationFixed;
+
+#define SIPF_TX_LINE_MAX    (1024)  // $$TXコマンド1行の最大長(モジュールが1行で受け付けられる長さ)
+
+typedef struct {
+    char    line[SIPF_TX_LINE_MAX];
+    int     len;
+    uint8_t obj_cnt;
+}   SipfTxBatch;
+
+typedef enum {
+    SIPF_REQ_W,         // $W
+    SIPF_REQ_R,         // $R
+    SIPF_REQ_TX,        // $$TX
+    SIPF_REQ_RX,        // $$RX
+    SIPF_REQ_GNSSEN,    // $$GNSSEN
+    SIPF_REQ_GNSSLOC,   // $$GNSSLOC
+    SIPF_REQ_REGS,      // $R/$Wによる一括レジスタ書き込み
+    SIPF_REQ_CALL,      // 関数を呼ぶ(その間UARTを占有してよい. $$FPUTなど)
+}   SipfReqType;
+
+#define SIPF_REG_PIPELINE   (4)     // 一括レジスタ書き込みで応答を待たずに送るコマンド数
+#define SIPF_REG_BULK_MAX   (256)   // 一括レジスタ書き込みで扱えるレジスタ数
+
+typedef struct {
+    uint8_t addr;
+    uint8_t value;
+}   SipfRegValue;
+
+enum {
+    SIPF_REGS_PHASE_READ,   // 現在値の読み出し
+    SIPF_REGS_PHASE_WRITE,  // 値が違うものだけ書き込み
+    SIPF_REGS_PHASE_VERIFY, // 書いたものだけ読み返し
+};
+
+#ifndef SIPF_RX_VALUE_BUFF_SZ
+#define SIPF_RX_VALUE_BUFF_SZ   (1024)  // SipfCmdRx()のVALUEを置く既定の領域のサイズ
+#endif
+
+/**
+ * $$RXで受信したVALUEを置く領域
+ * 受信するたびに後ろに詰めていくのでSipfRxArenaReset()するまで前のメッセージのVALUEも有効
+ */
+typedef struct {
+    uint8_t *buff;
+    uint32_t size;
+    uint32_t used;
+}   SipfRxArena;
+
+void SipfRxArenaInit(SipfRxArena *arena, uint8_t *buff, uint32_t size);
+void SipfRxArenaReset(SipfRxArena *arena);
+uint32_t SipfRxArenaFree(const SipfRxArena *arena);
+
+/**
+ * 要求の優先度(小さいほど先に実行する. 同じ優先度は投入順)
+ * 実行中の要求は追い越さない. SIPF_REQ_CALL($$FPUTなど)も途中では譲らず, 終わってから次を選ぶ
+ */
+typedef enum {
+    SIPF_PRIO_URGENT,   // 警報など. 待っている要求を追い越す
+    SIPF_PRIO_NORMAL,   // 定期的な送信やGNSSの読み出し(既定)
+    SIPF_PRIO_BULK,     // $$FPUTなど長くUARTを占有するもの. 他に待っている要求がないときに始める(長く待つとNORMAL扱い)
+    SIPF_PRIO_NUM
+}   SipfReqPrio;
+
+#ifndef SIPF_PRIO_AGING_MS
+#define SIPF_PRIO_AGING_MS  (2000)  // これだけ待つごとに優先度を1つ上げて扱う(SIPF_PRIO_NORMALまで. 飢餓防止)
+#endif
+
+#define SIPF_RESULT_EXPIRED (-4)    // 期限までに送信を始められなかったので送らずに完了した(応答のタイムアウトの-3とは別)
+
+typedef struct SipfReq SipfReq;
+typedef void (*SipfReqCallback)(SipfReq *req, int result, void *arg);
+typedef int (*SipfReqFunc)(void *arg);
+
+/**
+ * コマンドエンジンへの要求
+ * 完了(コールバック呼び出し)まで呼び出し側が保持すること
+ */
+struct SipfReq {
+    SipfReqType type;
+    union {
+        struct { uint8_t addr; uint8_t value; } w;
+        struct { uint8_t addr; uint8_t *value; } r;
+        struct { SipfTxBatch *batch; uint8_t *otid; } tx;
+        struct {
+            uint8_t *otid;
+            uint64_t *user_send_datetime_ms;
+            uint64_t *sipf_recv_datetime_ms;
+            uint8_t *remain;
+            uint8_t *obj_cnt;
+            SipfObjObject *obj_list;
+            uint8_t obj_list_sz;
+            uint8_t cnt;
+            SipfRxArena *arena;     // VALUEの置き場所
+            uint32_t arena_mark;    // 失敗したときにここまで戻す
+        } rx;
+        struct { bool is_active; } gnssen;
+        struct { GnssLocation *loc; GnssLocationFixed *fix; } gnssloc;
+        struct {
+            const SipfRegValue *list;   // NULLなら読み出しのみ(先読み)
+            uint8_t base;       // list==NULLのときの先頭アドレス
+            uint16_t cnt;
+            uint16_t next;      // 次に送るインデックス
+            uint16_t done;      // 次に応答が来るはずのインデックス
+            uint8_t inflight;   // 応答待ちの数
+            uint8_t phase;
+            uint8_t value;
+            bool has_value;
+            uint8_t diff[SIPF_REG_BULK_MAX / 8];   // 書き込みが必要なレジスタ
+            uint8_t known[SIPF_REG_BULK_MAX / 8];  // キャッシュから値が分かっているレジスタ
+        } regs;
+        struct { SipfReqFunc fn; void *arg; } call;
+    } u;
+    SipfReqCallback cb;
+    void *cb_arg;
+    int result;         // 結果(同期版APIの戻り値と同じ)
+    bool busy;          // キューに積まれてから完了するまでtrue
+    int state;
+    int timeout_ms;
+    bool tmout_char;        // timeout_msがキャラクタ間タイムアウト(統計でtmout_cmdと分けて数える)
+    uint8_t prio;           // SipfReqPrio(投入したスレッドのSipfSetPriority()の値)
+    bool has_deadline;
+    uint32_t t_deadline;    // この時刻[ms]までに送信を始められなければ送らずにSIPF_RESULT_EXPIREDで完了する
+    uint32_t t_submit;      // 投入した時刻[ms]
+    uint32_t t_submit_us;   // 投入した時刻(待ち時間の統計用)
+    SipfReq *next;
+};
+
 #define TMOUT_CMD   (10000)   // コマンド応答までのタイムアウト[ms]
 #define TMOUT_CHAR  (500)     // キャラクタ間タイムアウト[ms]
+#define TMOUT_BOOT  (300000)  // 起動メッセージから起動完了までのタイムアウト[ms]
 
 int SipfSetAuthMode(uint8_t mode);
 int SipfSetAuthInfo(char *user_name, char *password);
 
 int SipfGetFwVersion(uint32_t *version);
 
+int SipfSetRegs(const SipfRegValue *list, int cnt);
+
+void SipfRegCacheInvalidate(void);
+int SipfRegRead(uint8_t addr, uint8_t *value);
+int SipfRegPrefetch(uint8_t addr, int cnt);
+
 int SipfCmdTx(uint8_t tag_id, SipfObjTypeId type, uint8_t *value, uint8_t value_len, uint8_t *otid);
+
+void SipfTxBatchBegin(SipfTxBatch *batch);
+int SipfTxBatchAdd(SipfTxBatch *batch, uint8_t tag_id, SipfObjTypeId type, uint8_t *value, uint8_t value_len);
+int SipfTxBatchCommit(SipfTxBatch *batch, uint8_t *otid);
+/* $$RXで受信した1メッセージ */
+typedef struct {
+    uint8_t otid[33];
+    uint64_t user_send_datetime_ms;
+    uint64_t sipf_recv_datetime_ms;
+    uint8_t remain;         // モジュールに残っているメッセージ数
+    uint8_t obj_qty;        // メッセージのOBJQTY
+    uint8_t obj_cnt;        // obj_listに入れたオブジェクト数
+    SipfObjObject *obj_list;
+}   SipfRxMessage;
+
+/* 0を返すと続けて受信, 0以外で打ち切る */
+typedef int (*SipfRxMsgCallback)(const SipfRxMessage *msg, void *arg);
+
+typedef struct SipfRxDrain SipfRxDrain;
+typedef void (*SipfRxDrainDone)(SipfRxDrain *drain, int result, void *arg);
+
+/**
+ * REMAINが0になるまで$$RXを繰り返す要求
+ * 完了(on_done)まで呼び出し側が保持すること
+ */
+struct SipfRxDrain {
+    SipfReq req;
+    SipfRxMessage msg;
+    SipfRxArena *arena;         // NULLなら既定の領域(VALUEはon_msgの中でだけ有効)
+    uint8_t obj_list_sz;
+    uint16_t max_msgs;          // 受信するメッセージ数の上限(0なら無制限)
+    uint32_t budget_ms;         // 新たに$$RXを出すのをやめるまでの時間(0なら無制限)
+    uint32_t t_start;
+    uint8_t prio;               // 2回目以降の$$RXの優先度(最初の投入時の値を引き継ぐ)
+    uint16_t cnt;               // on_msgに渡したメッセージ数
+    SipfRxMsgCallback on_msg;
+    SipfRxDrainDone on_done;
+    void *arg;
+};
+
 int SipfCmdRx(uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz);
+int SipfCmdRxDrain(SipfObjObject *obj_list, uint8_t obj_list_sz, uint16_t max_msgs, uint32_t budget_ms, SipfRxMsgCallback on_msg, void *arg);
+int SipfCmdRxArena(SipfRxArena *arena, uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz);
 
 int SipfCmdFput(char *file_id, uint8_t *file_body, size_t sz_file);
+typedef int (*SipfFputReader)(uint8_t *buff, int len, void *arg);
+int SipfCmdFputStream(char *file_id, size_t sz_file, SipfFputReader reader, void *arg);
+int SipfFputReadStdio(uint8_t *buff, int len, void *arg);
+typedef int (*SipfFputRewind)(void *arg);
+int SipfCmdFputLz(char *file_id, uint8_t *file_body, size_t sz_file, SipfLzEncoder *lz);
+int SipfCmdFputLzStream(char *file_id, size_t sz_file, SipfFputReader reader, SipfFputRewind rewind, void *arg, SipfLzEncoder *lz);
+int SipfCmdFputLzMeasured(char *file_id, size_t sz_file, uint32_t sz_lz, uint32_t crc, SipfFputReader reader, void *arg, SipfLzEncoder *lz);
+int SipfFputRewindStdio(void *arg);
+
+/* $$FPUTのブロックごとの時間[us] */
+typedef struct {
+    uint8_t bn;
+    uint16_t sz;
+    uint8_t retry;          // 何回目の再送か
+    uint32_t us_write;      // フレームをUARTに書き込んだ時間(送信バッファが詰まっていれば線路の時間)
+    uint32_t us_prepare;    // 次のブロックの読み出しと組み立て(CPU)
+    uint32_t us_wait;       // ACKを待った時間
+}   SipfFputBlockTiming;
+
+/* $$FPUT全体の集計[us] */
+typedef struct {
+    uint32_t blocks;
+    uint32_t retries;
+    uint32_t us_write;
+    uint32_t us_prepare;
+    uint32_t us_wait;
+    uint32_t us_total;      // 最初のブロックからEOTの手前まで
+}   SipfFputTiming;
+
+typedef void (*SipfFputTimingHook)(const SipfFputBlockTiming *timing, void *arg);
+void SipfSetFputTimingHook(SipfFputTimingHook hook, void *arg);
+void SipfFputGetTiming(SipfFputTiming *timing);
+void SipfSetFputBlock1k(bool enable);
+
+struct SipfStats;
+
+#ifndef SIPF_MUX_CONSOLE_IN_SZ
+#define SIPF_MUX_CONSOLE_IN_SZ  (256)   // コマンド実行中のPCからの入力を溜めておくサイズ(2のべき乗)
+#endif
+
+/* モジュールからの受信のうちコマンドの応答でないものを渡す先(PCのシリアルへ書く) */
+typedef void (*SipfMuxConsoleWrite)(const uint8_t *buff, int len, void *arg);
+
+#define SIPF_EVENT_MAX      (8)     // SipfEventRegister()で登録できる数
+#define SIPF_EVENT_LINE_MAX (64)    // コマンドを実行していない間の行で通知に渡す先頭の長さ
+
+/**
+ * モジュールが自発的に出す行(コマンドの応答ではないもの)の通知先
+ * line: '\0'終端(コマンドを実行していない間の行は先頭SIPF_EVENT_LINE_MAX-1バイトまで)
+ */
+typedef void (*SipfEventHandler)(const char *line, int len, void *arg);
+
+typedef struct {
+    const char *prefix;     // 行の先頭がこれに一致したら通知する
+    SipfEventHandler handler;
+    void *arg;
+}   SipfEventEntry;
+
+/* 起動メッセージなどから分かるモジュールの状態 */
+typedef enum {
+    SIPF_MODULE_UNKNOWN,
+    SIPF_MODULE_BOOTING,    // "*** SIPF Client"が来た(再起動した)
+    SIPF_MODULE_READY,      // "+++ Ready +++"が来た
+    SIPF_MODULE_ERROR,      // "ERR:"が来た(接続リトライオーバーなど)
+}   SipfModuleState;
+
+/* PC(コンソール)との中継のバイト数 */
+typedef struct {
+    uint32_t relayed_out;   // モジュール -> PC
+    uint32_t relayed_in;    // PC -> モジュール
+    uint32_t dropped_out;   // 中継先がなくて捨てたモジュールからの受信
+    uint32_t dropped_in;    // 溜める領域があふれて捨てたPCからの入力
+}   SipfMuxCounters;
+
+/**
+ * モジュール1台ぶんのクライアントの状態
+ * SipfClientSet()で呼び出したスレッドの「今のクライアント」にすると, 以降のAPIはそのモジュールを操作する
+ * 複数のモジュールはスレッドごとにクライアントを持つか, 1つのループでSipfClientSet()で切り替えて使う
+ * (要求はSipfSubmit*()したときのクライアントに積まれて, そのクライアントでSipfPoll()したときに進む)
+ * 1台のモジュールを複数のスレッドから使うときは, SipfClientAttachWorker()したスレッドだけがSipfPoll()し,
+ * 他のスレッドはSipfClientSet()してSipfSubmit*()(ロックなしで受信箱に積むだけ)か同期版APIを呼ぶ
+ */
+typedef struct {
+    const SipfTransport *tr;    // NULLならSipfTransportSet()で設定したもの
+    struct SipfStats *stats;    // 統計の記録先(SIPF_STATSのとき, NULLなら共通の領域)
+
+    char cmd[SIPF_TX_LINE_MAX]; // $$TXのエコーバックが収まる長さ
+    uint32_t fw_version;
+    SipfLineReader line_reader;
+
+    // レジスタのシャドウ($W/$Rで分かった値を覚えておく)
+    struct {
+        uint8_t value[256];
+        uint8_t valid[256 / 8];
+    }   reg_cache;
+
+    uint8_t rx_value_buff[SIPF_RX_VALUE_BUFF_SZ];
+    SipfRxArena rx_arena;       // SipfCmdRx()のVALUEを置く既定の領域
+
+    // コマンドエンジン
+    struct {
+        SipfReq *head;      // 実行中(または次に実行する)要求
+        SipfReq *tail;
+        bool started;       // headのコマンドを送信済み
+        uint32_t t_last;    // 最後に受信した(またはコマンドを送信した)時刻
+        uint32_t t_start_us;    // コマンドを送信した時刻(SIPF_STATSのとき)
+        bool echo_seen;
+        bool resp_seen;
+        bool in_call;       // SIPF_REQ_CALLの関数を実行中
+    }   engine;
+
+    // ワーカー: SipfClientAttachWorker()したスレッドだけがUARTを触る
+    const void *worker;         // ワーカーのスレッド(NULLなら使わない)
+    const SipfTransport *worker_tr; // ワーカーのトランスポート(他のスレッドは時計と待ちにこれを使う)
+    SipfReq *inbox;             // 他のスレッドから投入された要求(新しい順につないだスタック)
+
+    // PC(コンソール)との中継: コマンドを実行していない間のUARTはPCのもの
+    struct {
+        SipfMuxConsoleWrite write;  // NULLなら中継しない(コマンドの応答以外は捨てる)
+        void *arg;
+        uint8_t in[SIPF_MUX_CONSOLE_IN_SZ];    // コマンド実行中に来たPCからの入力
+        uint32_t in_head;
+        uint32_t in_tail;
+        bool active;        // PCが送ったコマンドの応答待ち(OK/NGが来るまでエンジンは次の要求を始めない)
+        uint32_t t_last;    // PCとモジュールのどちらかが最後に送った時刻
+        char line[SIPF_EVENT_LINE_MAX];    // 中継中の行の先頭(OK/NGと自発的な行の判定用)
+        uint8_t line_len;
+        SipfMuxCounters cnt;
+    }   mux;
+
+    // モジュールが自発的に出す行の通知
+    SipfEventEntry events[SIPF_EVENT_MAX];
+    uint8_t event_cnt;
+    uint8_t module_state;       // SipfModuleState
+    uint32_t reboot_cnt;        // 再起動(起動メッセージ)を見た回数
+    uint32_t t_boot;            // 起動メッセージを見た時刻(起動完了までエンジンは次の要求を始めない)
+
+    // $$FPUT: 送信中のブロックと次のブロック(ファイル全体は持たない)
+    uint8_t fput_frame[2][XMODEM_SZ_FRAME_MAX];
+    bool fput_block1k;
+    SipfFputTiming fput_timing;
+    SipfFputTimingHook fput_timing_hook;
+    void *fput_timing_hook_arg;
+}   SipfClient;
+
+void SipfClientInit(SipfClient *client, const SipfTransport *tr);
+void SipfClientSet(SipfClient *client);
+SipfClient *SipfClientGet(void);
+void SipfClientAttachWorker(SipfClient *client);
+uint32_t SipfClientMillis(void);
 
 int SipfUtilReadLine(uint8_t *buff, int buff_len, int timeout_ms);
 void SipfClientFlushReadBuff(void);
 
+void SipfMuxAttachConsole(SipfMuxConsoleWrite write, void *arg);
+int SipfMuxConsoleInput(const uint8_t *buff, int len);
+void SipfMuxGetCounters(SipfMuxCounters *cnt);
+
+int SipfEventRegister(const char *prefix, SipfEventHandler handler, void *arg);
+void SipfEventUnregister(const char *prefix, SipfEventHandler handler);
+SipfModuleState SipfGetModuleState(void);
+
 int SipfSetGnss(bool is_active);
 int SipfGetGnssLocation(GnssLocation *loc);
+int SipfGetGnssLocationFixed(GnssLocationFixed *fix);
+
+void SipfPoll(void);
+bool SipfIsBusy(void);
+void SipfSetPriority(SipfReqPrio prio, uint32_t deadline_ms);
+int SipfSubmitRegWrite(SipfReq *req, uint8_t addr, uint8_t value, SipfReqCallback cb, void *arg);
+int SipfSubmitRegRead(SipfReq *req, uint8_t addr, uint8_t *value, SipfReqCallback cb, void *arg);
+int SipfSubmitSetRegs(SipfReq *req, const SipfRegValue *list, int cnt, SipfReqCallback cb, void *arg);
+int SipfSubmitRegPrefetch(SipfReq *req, uint8_t addr, int cnt, SipfReqCallback cb, void *arg);
+int SipfSubmitTx(SipfReq *req, SipfTxBatch *batch, uint8_t *otid, SipfReqCallback cb, void *arg);
+int SipfSubmitRxArena(SipfReq *req, SipfRxArena *arena, uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz, SipfReqCallback cb, void *arg);
+int SipfSubmitRxDrain(SipfRxDrain *drain, SipfRxArena *arena, SipfObjObject *obj_list, uint8_t obj_list_sz, uint16_t max_msgs, uint32_t budget_ms, SipfRxMsgCallback on_msg, SipfRxDrainDone on_done, void *arg);
+int SipfSubmitRx(SipfReq *req, uint8_t *otid, uint64_t *user_send_datetime_ms, uint64_t *sipf_recv_datetime_ms, uint8_t *remain, uint8_t *obj_cnt, SipfObjObject *obj_list, uint8_t obj_list_sz, SipfReqCallback cb, void *arg);
+int SipfSubmitSetGnss(SipfReq *req, bool is_active, SipfReqCallback cb, void *arg);
+int SipfSubmitGnssLocation(SipfReq *req, GnssLocation *loc, SipfReqCallback cb, void *arg);
+int SipfSubmitGnssLocationFixed(SipfReq *req, GnssLocationFixed *fix, SipfReqCallback cb, void *arg);
+int SipfSubmitCall(SipfReq *req, SipfReqFunc fn, void *fn_arg, SipfReqCallback cb, void *arg);
+int SipfReqWait(SipfReq *req, uint32_t timeout_ms);
 
 
 
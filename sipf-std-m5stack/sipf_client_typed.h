@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_CLIENT_TYPED_H_
+#define _SIPF_CLIENT_TYPED_H_
+
+/*
+ * SipfCmdTx()/SipfCmdRx()のC++向け型付きAPI
+ * C++の型からTYPE_IDとバイト数をコンパイル時に決めるので, 型IDやvalue_lenを手で渡さなくてよい
+ * 対応していない型(int, long, char等の幅が決まっていない型を含む)を渡すとコンパイルエラーになる
+ *
+ *   SipfTxBatchAddValue(&batch, 0x01, (uint32_t)cnt);
+ *   uint32_t v;
+ *   if (SipfObjGet(obj, &v) == 0) { ... }
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sipf_client.h"
+#include "sipf_hex.h"
+
+/**
+ * C++の型とSipfObjTypeIdの対応
+ * bits_tは値をビット列として扱うときの同じ幅の符号なし整数
+ */
+template <typename T> struct SipfObjTraits;
+
+#define SIPF_OBJ_TRAITS(T, ID, BITS)                                \
+    template <> struct SipfObjTraits<T> {                           \
+        typedef BITS bits_t;                                        \
+        static constexpr SipfObjTypeId type_id = ID;                \
+    }
+
+SIPF_OBJ_TRAITS(uint8_t,  OBJ_TYPE_UINT8,   uint8_t);
+SIPF_OBJ_TRAITS(int8_t,   OBJ_TYPE_INT8,    uint8_t);
+SIPF_OBJ_TRAITS(uint16_t, OBJ_TYPE_UINT16,  uint16_t);
+SIPF_OBJ_TRAITS(int16_t,  OBJ_TYPE_INT16,   uint16_t);
+SIPF_OBJ_TRAITS(uint32_t, OBJ_TYPE_UINT32,  uint32_t);
+SIPF_OBJ_TRAITS(int32_t,  OBJ_TYPE_INT32,   uint32_t);
+SIPF_OBJ_TRAITS(uint64_t, OBJ_TYPE_UINT64,  uint64_t);
+SIPF_OBJ_TRAITS(int64_t,  OBJ_TYPE_INT64,   uint64_t);
+SIPF_OBJ_TRAITS(float,    OBJ_TYPE_FLOAT32, uint32_t);
+SIPF_OBJ_TRAITS(double,   OBJ_TYPE_FLOAT64, uint64_t);
+
+#undef SIPF_OBJ_TRAITS
+
+/**
+ * 型に対応するTYPE_ID
+ */
+template <typename T>
+constexpr SipfObjTypeId SipfObjTypeOf(void)
+{
+    return SipfObjTraits<T>::type_id;
+}
+
+/**
+ * 値をHEX文字列(上位バイトから)に変換
+ * シフトで上位バイトから並べてからSipfHexEncode()するのでホストのバイトオーダーに依存しない
+ * return: 書き込んだ文字数
+ */
+template <typename T>
+static inline int sipfTypedEncode(char *dst, T value)
+{
+    typedef typename SipfObjTraits<T>::bits_t bits_t;
+    bits_t bits;
+    uint8_t be[sizeof(bits)];
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < (int)sizeof(bits); i++) {
+        be[i] = (uint8_t)(bits >> ((sizeof(bits) - 1 - i) * 8));
+    }
+    return SipfHexEncode(dst, be, sizeof(be));
+}
+
+/**
+ * バッチにオブジェクトを1つ追加(プリミティブ型)
+ * return: 0: 成功, -1: $$TXの1行に収まらない
+ */
+template <typename T>
+int SipfTxBatchAddValue(SipfTxBatch *batch, uint8_t tag_id, T value)
+{
+    int len = batch->len;
+
+    // " TT YY " + VALUE + "\r\n" が収まるか
+    if ((len + 7 + (int)(sizeof(T) * 2) + 2) >= SIPF_TX_LINE_MAX) {
+        return -1;
+    }
+    batch->line[len++] = ' ';
+    len += sipfTypedEncode(&batch->line[len], tag_id);
+    batch->line[len++] = ' ';
+    len += sipfTypedEncode(&batch->line[len], (uint8_t)SipfObjTypeOf<T>());
+    batch->line[len++] = ' ';
+    len += sipfTypedEncode(&batch->line[len], value);
+    batch->line[len] = '\0';
+    batch->len = len;
+    batch->obj_cnt++;
+    return 0;
+}
+
+/**
+ * バッチに文字列(UTF-8)のオブジェクトを追加
+ */
+static inline int SipfTxBatchAddValue(SipfTxBatch *batch, uint8_t tag_id, const char *str)
+{
+    size_t len = strlen(str);
+    if (len > 0xff) {
+        return -1;
+    }
+    return SipfTxBatchAdd(batch, tag_id, OBJ_TYPE_STR_UTF8, (uint8_t*)str, (uint8_t)len);
+}
+
+/**
+ * 1オブジェクトを$$TXで送信
+ * return: 0: 成功, -1: 失敗, -3: タイムアウト
+ */
+template <typename T>
+int SipfSend(uint8_t tag_id, T value, uint8_t *otid)
+{
+    SipfTxBatch batch;
+    SipfTxBatchBegin(&batch);
+    if (SipfTxBatchAddValue(&batch, tag_id, value) != 0) {
+        return -1;
+    }
+    return SipfTxBatchCommit(&batch, otid);
+}
+
+/**
+ * 受信したオブジェクトがTの型か
+ */
+template <typename T>
+bool SipfObjIs(const SipfObjObject &obj)
+{
+    return (obj.type == (uint8_t)SipfObjTypeOf<T>()) && (obj.value_len == sizeof(T));
+}
+
+/**
+ * 受信したオブジェクトの値をTとして取り出す
+ * valueは下位バイトから並んでいる(SipfCmdRx()でバイトスワップ済み)
+ * return: 0: 成功, -1: 型が違う
+ */
+template <typename T>
+int SipfObjGet(const SipfObjObject &obj, T *value)
+{
+    typedef typename SipfObjTraits<T>::bits_t bits_t;
+    if (!SipfObjIs<T>(obj)) {
+        return -1;
+    }
+    bits_t bits = 0;
+    for (int i = 0; i < (int)sizeof(bits); i++) {
+        bits |= (bits_t)obj.value[i] << (i * 8);
+    }
+    memcpy(value, &bits, sizeof(bits));
+    return 0;
+}
+
+/**
+ * 受信したオブジェクトの型に合わせてvisitorを呼ぶ
+ * visitorは operator()(uint8_t tag_id, T value) を各型ぶん,
+ * BIN/STR_UTF8用に operator()(uint8_t tag_id, SipfObjTypeId type, const uint8_t *value, uint8_t len) を持つこと
+ * return: 0: 成功, -1: 知らない型, または長さが型と合わない
+ */
+template <typename T, typename V>
+static inline int sipfObjVisitAs(const SipfObjObject &obj, V &visitor)
+{
+    T v;
+    if (SipfObjGet(obj, &v) != 0) {
+        return -1;
+    }
+    visitor(obj.tag_id, v);
+    return 0;
+}
+
+template <typename V>
+int SipfObjVisit(const SipfObjObject &obj, V &visitor)
+{
+    switch (obj.type) {
+    case OBJ_TYPE_UINT8:    return sipfObjVisitAs<uint8_t>(obj, visitor);
+    case OBJ_TYPE_INT8:     return sipfObjVisitAs<int8_t>(obj, visitor);
+    case OBJ_TYPE_UINT16:   return sipfObjVisitAs<uint16_t>(obj, visitor);
+    case OBJ_TYPE_INT16:    return sipfObjVisitAs<int16_t>(obj, visitor);
+    case OBJ_TYPE_UINT32:   return sipfObjVisitAs<uint32_t>(obj, visitor);
+    case OBJ_TYPE_INT32:    return sipfObjVisitAs<int32_t>(obj, visitor);
+    case OBJ_TYPE_UINT64:   return sipfObjVisitAs<uint64_t>(obj, visitor);
+    case OBJ_TYPE_INT64:    return sipfObjVisitAs<int64_t>(obj, visitor);
+    case OBJ_TYPE_FLOAT32:  return sipfObjVisitAs<float>(obj, visitor);
+    case OBJ_TYPE_FLOAT64:  return sipfObjVisitAs<double>(obj, visitor);
+    case OBJ_TYPE_BIN:
+    case OBJ_TYPE_STR_UTF8:
+        visitor(obj.tag_id, (SipfObjTypeId)obj.type, (const uint8_t*)obj.value, obj.value_len);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+#endif
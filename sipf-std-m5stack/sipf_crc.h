@@ -0,0 +1,20 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_CRC_H_
+#define _SIPF_CRC_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t SipfCrc32(uint32_t crc, const uint8_t *p, int len);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sipf_gnss.h"
+
+#define GNSS_FIELD_CNT  (7)     // FIXED,経度,緯度,高度,速度,方位,日時
+#define GNSS_DATETIME_LEN   (20)    // YYYY-MM-DDTHH:MM:SSZ
+
+/**
+ * 10進の小数を10^scale倍した整数に変換
+ * 空のフィールドは0(以前のstrtof()と同じ). scaleより下の桁は1桁目で四捨五入する
+ * return: 0: 成功, -2: 数値じゃない, または桁があふれた
+ */
+static int gnssParseFixed(const char *s, const char *end, int scale, int32_t *value)
+{
+    bool neg = false;
+    bool digit = false;
+    int frac = -1;      // 小数点以下の桁数(-1: 小数点なし)
+    int64_t v = 0;
+
+    if (s == end) {
+        *value = 0;
+        return 0;
+    }
+    if ((s < end) && ((*s == '-') || (*s == '+'))) {
+        neg = (*s == '-');
+        s++;
+    }
+    for (; s < end; s++) {
+        uint8_t d = (uint8_t)(*s - '0');
+        if (d <= 9) {
+            digit = true;
+            if (frac < scale) {
+                v = v * 10 + d;
+                if (v > INT32_MAX) {
+                    return -2;
+                }
+                if (frac >= 0) {
+                    frac++;
+                }
+            } else if (frac == scale) {
+                // 1つ下の桁で四捨五入して残りは捨てる
+                v += (d >= 5) ? 1 : 0;
+                frac++;
+            }
+        } else if ((*s == '.') && (frac < 0)) {
+            frac = 0;
+        } else {
+            return -2;
+        }
+    }
+    if (!digit) {
+        return -2;
+    }
+    if (frac > scale) {
+        frac = scale;
+    }
+    for (frac = (frac < 0) ? 0 : frac; frac < scale; frac++) {
+        v *= 10;
+    }
+    if (v > INT32_MAX) {
+        return -2;
+    }
+    *value = neg ? -(int32_t)v : (int32_t)v;
+    return 0;
+}
+
+/**
+ * 2桁または4桁の10進数
+ */
+static int gnssParseDigits(const char *s, int n, int *value)
+{
+    int v = 0;
+    for (int i = 0; i < n; i++) {
+        uint8_t d = (uint8_t)(s[i] - '0');
+        if (d > 9) {
+            return -2;
+        }
+        v = v * 10 + d;
+    }
+    *value = v;
+    return 0;
+}
+
+/**
+ * YYYY-MM-DDTHH:MM:SSZ
+ */
+static int gnssParseDatetime(const char *s, const char *end, GnssLocationFixed *fix)
+{
+    if ((end - s) != GNSS_DATETIME_LEN) {
+        return -2;
+    }
+    if ((s[4] != '-') || (s[7] != '-') || (s[10] != 'T') || (s[13] != ':') || (s[16] != ':') || (s[19] != 'Z')) {
+        return -2;
+    }
+    if ((gnssParseDigits(&s[0], 4, &fix->year) != 0) ||
+        (gnssParseDigits(&s[5], 2, &fix->month) != 0) ||
+        (gnssParseDigits(&s[8], 2, &fix->day) != 0) ||
+        (gnssParseDigits(&s[11], 2, &fix->hour) != 0) ||
+        (gnssParseDigits(&s[14], 2, &fix->minute) != 0) ||
+        (gnssParseDigits(&s[17], 2, &fix->second) != 0)) {
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * $$GNSSLOCの位置情報の行を解析
+ * 行を書き換えず, ヒープも使わずに1回の走査で固定小数点に変換する
+ * return: 0: 成功, -2: 形式が違う
+ */
+int SipfGnssParse(const char *line, int len, GnssLocationFixed *fix)
+{
+    const char *end = line + len;
+    const char *head = line;
+    int counter = 0;
+
+    for (;;) {
+        const char *next = head;
+        while ((next < end) && (*next != ',')) {
+            next++;
+        }
+
+        int ret = 0;
+        switch (counter) {
+        case 0: // FIXED
+            if ((next - head) != 1) {
+                return -2;
+            }
+            if (head[0] == 'A') {
+                fix->fixed = true;
+            } else if (head[0] == 'V') {
+                fix->fixed = false;
+            } else {
+                return -2;
+            }
+            break;
+        case 1: // Longitude
+            ret = gnssParseFixed(head, next, 6, &fix->longitude);
+            break;
+        case 2: // Latitude
+            ret = gnssParseFixed(head, next, 6, &fix->latitude);
+            break;
+        case 3: // Altitude
+            ret = gnssParseFixed(head, next, 3, &fix->altitude);
+            break;
+        case 4: // Speed
+            ret = gnssParseFixed(head, next, 3, &fix->speed);
+            break;
+        case 5: // Heading
+            ret = gnssParseFixed(head, next, 3, &fix->heading);
+            break;
+        case 6: // Datetime
+            ret = gnssParseDatetime(head, next, fix);
+            break;
+        default:
+            return -2;
+        }
+        if (ret != 0) {
+            return ret;
+        }
+
+        if (next >= end) {
+            break;
+        }
+        head = next + 1;
+        counter++;
+    }
+    if (counter != (GNSS_FIELD_CNT - 1)) {
+        return -2;
+    }
+    return 0;
+}
+
+/**
+ * 固定小数点の位置情報をfloatに変換
+ */
+void SipfGnssToFloat(const GnssLocationFixed *fix, GnssLocation *loc)
+{
+    loc->fixed = fix->fixed;
+    loc->longitude = (float)fix->longitude / 1000000.0f;
+    loc->latitude = (float)fix->latitude / 1000000.0f;
+    loc->altitude = (float)fix->altitude / 1000.0f;
+    loc->speed = (float)fix->speed / 1000.0f;
+    loc->heading = (float)fix->heading / 1000.0f;
+    loc->year = fix->year;
+    loc->month = fix->month;
+    loc->day = fix->day;
+    loc->hour = fix->hour;
+    loc->minute = fix->minute;
+    loc->second = fix->second;
+}
+
+/**
+ * 位置情報の日時(UTC)をUNIX時間[ms]に変換
+ * return: UNIX時間[ms], 0: 測位できていない(日時が当てにならない)
+ */
+uint64_t SipfGnssUnixMs(const GnssLocationFixed *fix)
+{
+    if (!fix->fixed || (fix->year < 1970) || (fix->month < 1) || (fix->month > 12)) {
+        return 0;
+    }
+    // 3月始まりの暦で1970-01-01からの日数を数える
+    int32_t y = fix->year - ((fix->month <= 2) ? 1 : 0);
+    int32_t m = fix->month + ((fix->month <= 2) ? 9 : -3);
+    int32_t era = y / 400;
+    int32_t yoe = y - era * 400;
+    int32_t doy = (153 * m + 2) / 5 + fix->day - 1;
+    int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = (int64_t)era * 146097 + doe - 719468;
+    int64_t sec = days * 86400 + fix->hour * 3600 + fix->minute * 60 + fix->second;
+    return (uint64_t)sec * 1000;
+}
+
+/**
+ * 2点間のおおよその距離[m](正距円筒図法で近似. 数km以内の移動の判定用)
+ * 緯度経度は1e-6度
+ */
+uint32_t SipfGnssDistance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2)
+{
+    const float m_per_udeg = 0.111195f;   // 子午線方向の1e-6度あたりの距離[m]
+    float lat = ((float)lat1 + (float)lat2) / 2 * (3.14159265f / 180000000.0f);
+    float dy = (float)(lat2 - lat1) * m_per_udeg;
+    float dx = (float)(lon2 - lon1) * m_per_udeg * cosf(lat);
+    return (uint32_t)sqrtf(dx * dx + dy * dy);
+}
+
+/**
+ * トラッカーを初期化
+ * interval_ms: 測位できている間の取得周期, max_interval_ms: 測位できていない間に延ばす上限
+ * move_threshold_m: これ以上動いたらSIPF_GNSS_EV_MOVEDを通知する(0なら通知しない)
+ */
+void SipfGnssTrackerInit(SipfGnssTracker *trk, uint32_t interval_ms, uint32_t max_interval_ms, uint32_t move_threshold_m, SipfGnssTrackerCallback cb, void *arg)
+{
+    memset(trk, 0, sizeof(SipfGnssTracker));
+    trk->interval_ms = interval_ms;
+    trk->max_interval_ms = (max_interval_ms < interval_ms) ? interval_ms : max_interval_ms;
+    trk->cur_interval_ms = interval_ms;
+    trk->move_threshold_m = move_threshold_m;
+    trk->cb = cb;
+    trk->arg = arg;
+}
+
+void SipfGnssTrackerStart(SipfGnssTracker *trk)
+{
+    trk->running = true;
+    trk->cur_interval_ms = trk->interval_ms;
+    // すぐに1回目を取得する
+    trk->t_poll = SipfClientMillis() - trk->cur_interval_ms;
+}
+
+/**
+ * 取得をやめる(投入済みの$$GNSSLOCは完了まで進む)
+ */
+void SipfGnssTrackerStop(SipfGnssTracker *trk)
+{
+    trk->running = false;
+}
+
+/**
+ * 周期を延ばす
+ */
+static void gnssTrackerBackoff(SipfGnssTracker *trk)
+{
+    uint32_t next = trk->cur_interval_ms * 2;
+    trk->cur_interval_ms = (next > trk->max_interval_ms) ? trk->max_interval_ms : next;
+}
+
+/**
+ * $$GNSSLOCの完了
+ */
+static void gnssTrackerOnDone(SipfReq *req, int result, void *arg)
+{
+    SipfGnssTracker *trk = (SipfGnssTracker*)arg;
+    uint32_t events = 0;
+
+    if (result == SIPF_RESULT_EXPIRED) {
+        // 期限までに送れなかった問い合わせは捨てただけ(次の周期で問い合わせ直す). エラーにはしない
+        return;
+    }
+    if (result != 0) {
+        if (!trk->error) {
+            events |= SIPF_GNSS_EV_ERROR;
+        }
+        trk->error = true;
+        gnssTrackerBackoff(trk);
+    } else {
+        if (!trk->valid || trk->error || (trk->fix.fixed != trk->recv.fixed)) {
+            // エラーから戻ったときも測位状態を通知し直す
+            events |= SIPF_GNSS_EV_FIX;
+        }
+        trk->error = false;
+        trk->fix = trk->recv;
+        trk->valid = true;
+        trk->t_fix = SipfClientMillis();
+
+        if (trk->fix.fixed) {
+            trk->cur_interval_ms = trk->interval_ms;
+            if (!trk->notified) {
+                // 測位できた位置を基準にする
+                trk->notified = true;
+                trk->notified_lat = trk->fix.latitude;
+                trk->notified_lon = trk->fix.longitude;
+            } else if ((trk->move_threshold_m > 0) &&
+                       (SipfGnssDistance(trk->notified_lat, trk->notified_lon, trk->fix.latitude, trk->fix.longitude) >= trk->move_threshold_m)) {
+                events |= SIPF_GNSS_EV_MOVED;
+                trk->notified_lat = trk->fix.latitude;
+                trk->notified_lon = trk->fix.longitude;
+            }
+        } else {
+            gnssTrackerBackoff(trk);
+        }
+    }
+
+    if ((events != 0) && (trk->cb != NULL)) {
+        trk->cb(trk, events, trk->valid ? &trk->fix : NULL, trk->arg);
+    }
+}
+
+/**
+ * 周期が来ていたら$$GNSSLOCを投入する(loop()から呼ぶ)
+ */
+void SipfGnssTrackerPoll(SipfGnssTracker *trk)
+{
+    if (!trk->running || trk->req.busy) {
+        return;
+    }
+    uint32_t now = SipfClientMillis();
+    if ((now - trk->t_poll) < trk->cur_interval_ms) {
+        return;
+    }
+    trk->t_poll = now;
+    SipfSubmitGnssLocationFixed(&trk->req, &trk->recv, gnssTrackerOnDone, trk);
+}
+
+/**
+ * 最新の位置情報を取り出す(モジュールには問い合わせない)
+ * age_ms: 受信してからの経過時間[ms](NULL可)
+ * return: 0: 成功, -1: まだ受信していない
+ */
+int SipfGnssTrackerGet(const SipfGnssTracker *trk, GnssLocationFixed *fix, uint32_t *age_ms)
+{
+    if (!trk->valid) {
+        return -1;
+    }
+    *fix = trk->fix;
+    if (age_ms != NULL) {
+        *age_ms = SipfClientMillis() - trk->t_fix;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_GNSS_H_
+#define _SIPF_GNSS_H_
+
+#include <stdint.h>
+
+#include "sipf_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int SipfGnssParse(const char *line, int len, GnssLocationFixed *fix);
+void SipfGnssToFloat(const GnssLocationFixed *fix, GnssLocation *loc);
+uint64_t SipfGnssUnixMs(const GnssLocationFixed *fix);
+
+/* トラッカーの通知 */
+#define SIPF_GNSS_EV_FIX    (0x01)  // 測位できた/できなくなった(SIPF_GNSS_EV_ERRORの後に成功したときも)
+#define SIPF_GNSS_EV_MOVED  (0x02)  // 前回通知した位置から閾値以上動いた
+#define SIPF_GNSS_EV_ERROR  (0x04)  // $$GNSSLOCが失敗するようになった
+
+typedef struct SipfGnssTracker SipfGnssTracker;
+typedef void (*SipfGnssTrackerCallback)(SipfGnssTracker *trk, uint32_t events, const GnssLocationFixed *fix, void *arg);
+
+/**
+ * 位置情報を定期的に取得して最新の値を持っておく
+ * SipfGnssTrackerPoll()をloop()から呼ぶと, 周期が来たら$$GNSSLOCを投入する
+ * 測位できていない間や失敗している間は周期をmax_interval_msまで倍々に延ばす
+ */
+struct SipfGnssTracker {
+    SipfReq req;
+    GnssLocationFixed recv;     // 受信中
+    GnssLocationFixed fix;      // 最新の位置情報
+    bool valid;                 // fixに値がある
+    bool error;                 // 直前の$$GNSSLOCが失敗した
+    uint32_t t_fix;             // fixを受信した時刻[ms](SipfClientMillis())
+    int32_t notified_lat;       // 最後にMOVEDを通知した位置
+    int32_t notified_lon;
+    bool notified;
+    uint32_t interval_ms;
+    uint32_t max_interval_ms;
+    uint32_t cur_interval_ms;
+    uint32_t t_poll;            // 最後に$$GNSSLOCを投入した時刻[ms](SipfClientMillis())
+    uint32_t move_threshold_m;
+    bool running;
+    SipfGnssTrackerCallback cb;
+    void *arg;
+};
+
+void SipfGnssTrackerInit(SipfGnssTracker *trk, uint32_t interval_ms, uint32_t max_interval_ms, uint32_t move_threshold_m, SipfGnssTrackerCallback cb, void *arg);
+void SipfGnssTrackerStart(SipfGnssTracker *trk);
+void SipfGnssTrackerStop(SipfGnssTracker *trk);
+void SipfGnssTrackerPoll(SipfGnssTracker *trk);
+int SipfGnssTrackerGet(const SipfGnssTracker *trk, GnssLocationFixed *fix, uint32_t *age_ms);
+uint32_t SipfGnssDistance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
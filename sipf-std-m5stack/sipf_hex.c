@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "sipf_hex.h"
+
+/**
+ * 1バイト -> 2桁のHEX文字列
+ */
+static const char hex_enc_table[512 + 1] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+/**
+ * HEX文字 -> 値(HEXじゃない文字は0xff)
+ */
+static const uint8_t hex_dec_table[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#define HEX_SWAR
+#endif
+
+#ifdef HEX_SWAR
+#define SWAR_ONES   (0x0101010101010101ULL)
+#define SWAR_HIGH   (SWAR_ONES * 0x80)
+// 各バイトが m < x < n なら0x80を立てる(各バイトが0x80未満であること)
+#define SWAR_BETWEEN(x, m, n) \
+    (((SWAR_ONES * (127 + (n)) - ((x) & (SWAR_ONES * 127))) & ~(x) & (((x) & (SWAR_ONES * 127)) + SWAR_ONES * (127 - (m)))) & SWAR_HIGH)
+
+/**
+ * 4バイトを8文字のHEXにまとめて変換
+ */
+static inline void hexEncodeSwar4(char *dst, const uint8_t *src)
+{
+    uint32_t in;
+    memcpy(&in, src, 4);
+    uint64_t x = in;
+    // 1バイトを16bitのレーンに広げる
+    x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+    // 上位ニブルを先に並べる
+    x = ((x >> 4) & 0x000f000f000f000fULL) | ((x & 0x000f000f000f000fULL) << 8);
+    // 0-9 -> '0'-'9', 10-15 -> 'A'-'F'
+    uint64_t alpha = ((x + SWAR_ONES * 6) >> 4) & SWAR_ONES;
+    x += (SWAR_ONES * '0') + (alpha * 7);
+    memcpy(dst, &x, 8);
+}
+
+/**
+ * 8文字のHEXを4バイトにまとめて変換
+ * return: 0: 成功, -1: HEXじゃない文字がある
+ */
+static inline int hexDecodeSwar4(uint8_t *dst, const char *src)
+{
+    uint64_t x;
+    memcpy(&x, src, 8);
+    if (x & SWAR_HIGH) {
+        return -1;
+    }
+    uint64_t digit = SWAR_BETWEEN(x, '0' - 1, '9' + 1);
+    uint64_t alpha = SWAR_BETWEEN(x | (SWAR_ONES * 0x20), 'a' - 1, 'f' + 1);
+    if ((digit | alpha) != SWAR_HIGH) {
+        return -1;
+    }
+    uint64_t nib = (x & (SWAR_ONES * 0x0f)) + ((alpha >> 7) * 9);
+    // 2文字を1バイトに詰める
+    uint64_t v = ((nib & 0x00ff00ff00ff00ffULL) << 4) | ((nib >> 8) & 0x00ff00ff00ff00ffULL);
+    v = (v | (v >> 8)) & 0x0000ffff0000ffffULL;
+    v = (v | (v >> 16)) & 0x00000000ffffffffULL;
+    uint32_t out = (uint32_t)v;
+    memcpy(dst, &out, 4);
+    return 0;
+}
+#endif
+
+/**
+ * バイト列をそのままの順でHEX文字列に変換('\0'は付けない)
+ * return: 書き込んだ文字数
+ */
+int SipfHexEncode(char *dst, const uint8_t *src, int len)
+{
+    int i = 0;
+#ifdef HEX_SWAR
+    for (; (i + 4) <= len; i += 4) {
+        hexEncodeSwar4(&dst[i * 2], &src[i]);
+    }
+#endif
+    for (; i < len; i++) {
+        memcpy(&dst[i * 2], &hex_enc_table[src[i] * 2], 2);
+    }
+    return len * 2;
+}
+
+/**
+ * バイト列を逆順(リトルエンディアンの数値を上位から)でHEX文字列に変換
+ * return: 書き込んだ文字数
+ */
+int SipfHexEncodeRev(char *dst, const uint8_t *src, int len)
+{
+    for (int i = 0; i < len; i++) {
+        memcpy(&dst[i * 2], &hex_enc_table[src[len - 1 - i] * 2], 2);
+    }
+    return len * 2;
+}
+
+/**
+ * HEX文字列(len*2文字)をそのままの順でバイト列に変換
+ * return: 0: 成功, -1: HEXじゃない文字がある
+ */
+int SipfHexDecode(uint8_t *dst, const char *src, int len)
+{
+    int i = 0;
+#ifdef HEX_SWAR
+    for (; (i + 4) <= len; i += 4) {
+        if (hexDecodeSwar4(&dst[i], &src[i * 2]) != 0) {
+            return -1;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        uint8_t h = hex_dec_table[(uint8_t)src[i * 2]];
+        uint8_t l = hex_dec_table[(uint8_t)src[i * 2 + 1]];
+        if ((h | l) & 0xf0) {
+            return -1;
+        }
+        dst[i] = (h << 4) | l;
+    }
+    return 0;
+}
+
+/**
+ * HEX文字列(len*2文字)を逆順(上位から並んだ数値をリトルエンディアン)でバイト列に変換
+ * return: 0: 成功, -1: HEXじゃない文字がある
+ */
+int SipfHexDecodeRev(uint8_t *dst, const char *src, int len)
+{
+    for (int i = 0; i < len; i++) {
+        uint8_t h = hex_dec_table[(uint8_t)src[i * 2]];
+        uint8_t l = hex_dec_table[(uint8_t)src[i * 2 + 1]];
+        if ((h | l) & 0xf0) {
+            return -1;
+        }
+        dst[len - 1 - i] = (h << 4) | l;
+    }
+    return 0;
+}
+
+/**
+ * 2桁のHEX文字列を数値に変換
+ * return: 0: 成功, -1: HEXじゃない文字がある
+ */
+int SipfHexDecodeU8(const char *src, uint8_t *value)
+{
+    return SipfHexDecode(value, src, 1);
+}
+
+/**
+ * 16桁のHEX文字列(上位から)を64bitの数値に変換
+ * return: 0: 成功, -1: HEXじゃない文字がある
+ */
+int SipfHexDecodeU64(const char *src, uint64_t *value)
+{
+    uint8_t b[8];
+    if (SipfHexDecode(b, src, 8) != 0) {
+        return -1;
+    }
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v = (v << 8) | b[i];
+    }
+    *value = v;
+    return 0;
+}
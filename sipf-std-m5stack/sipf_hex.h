@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_HEX_H_
+#define _SIPF_HEX_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int SipfHexEncode(char *dst, const uint8_t *src, int len);
+int SipfHexEncodeRev(char *dst, const uint8_t *src, int len);
+int SipfHexDecode(uint8_t *dst, const char *src, int len);
+int SipfHexDecodeRev(uint8_t *dst, const char *src, int len);
+int SipfHexDecodeU8(const char *src, uint8_t *value);
+int SipfHexDecodeU64(const char *src, uint64_t *value);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sipf_line.h"
+#include "sipf_transport.h"
+
+#define RING_MASK   (SIPF_LINE_RING_SZ - 1)
+
+/**
+ * 受信済みのデータを全部捨てる
+ */
+void SipfLineReaderReset(SipfLineReader *r)
+{
+    r->head = 0;
+    r->tail = 0;
+    r->scan = 0;
+    r->release = 0;
+    r->discarding = false;
+}
+
+/**
+ * UARTの受信済みデータをまとめてリングバッファに読み込む(ブロックしない)
+ * return: 読み込んだバイト数
+ */
+int SipfLineReaderFill(SipfLineReader *r)
+{
+    int total = 0;
+    for (;;) {
+        uint32_t space = SIPF_LINE_RING_SZ - (r->head - r->tail);
+        if (space == 0) {
+            // いっぱい. 残りはUART側に置いておく
+            break;
+        }
+        uint32_t off = r->head & RING_MASK;
+        uint32_t contig = SIPF_LINE_RING_SZ - off;
+        if (contig > space) {
+            contig = space;
+        }
+        int n = SipfTransportRead(&r->ring[off], contig);
+        if (n <= 0) {
+            break;
+        }
+        r->head += n;
+        total += n;
+        if ((uint32_t)n < contig) {
+            // 受信済みのデータは読み切った
+            break;
+        }
+    }
+    return total;
+}
+
+/**
+ * tailからlenバイトを連続した'\0'終端の文字列として見せる
+ */
+static void lineReaderEmit(SipfLineReader *r, SipfLineView *view, uint32_t len, bool overflow)
+{
+    uint32_t start = r->tail & RING_MASK;
+    if (start + len > SIPF_LINE_RING_SZ) {
+        // 折り返している部分を末尾の余白に写す
+        memcpy(&r->ring[SIPF_LINE_RING_SZ], &r->ring[0], start + len - SIPF_LINE_RING_SZ);
+    }
+    // 行末(またはあふれて捨てる位置)を終端にする
+    r->ring[start + len] = '\0';
+
+    view->ptr = (char*)&r->ring[start];
+    view->len = len;
+    view->overflow = overflow;
+}
+
+/**
+ * 次の1行を取り出す
+ * 空行は読み飛ばす. SIPF_LINE_MAXを超えた行は先頭だけをoverflow=trueで返して残りは行末まで捨てる
+ * return: true: 行を取り出した, false: まだ行がそろっていない
+ */
+bool SipfLineReaderNext(SipfLineReader *r, SipfLineView *view)
+{
+    // 前回返した行を解放
+    r->tail = r->release;
+    if ((int32_t)(r->scan - r->tail) < 0) {
+        r->scan = r->tail;
+    }
+
+    while (r->scan != r->head) {
+        uint8_t b = r->ring[r->scan & RING_MASK];
+        if ((b == '\r') || (b == '\n')) {
+            uint32_t len = r->scan - r->tail;
+            r->scan++;
+            if (r->discarding || (len == 0)) {
+                // あふれた行の終わり, または空行
+                r->discarding = false;
+                r->tail = r->release = r->scan;
+                continue;
+            }
+            lineReaderEmit(r, view, len, false);
+            r->release = r->scan;
+            return true;
+        }
+        if (r->discarding) {
+            r->scan++;
+            r->tail = r->release = r->scan;
+            continue;
+        }
+        if ((r->scan - r->tail) >= SIPF_LINE_MAX) {
+            // 行が長すぎる
+            r->overflow_cnt++;
+            r->discarding = true;
+            lineReaderEmit(r, view, SIPF_LINE_MAX, true);
+            r->release = r->scan;
+            return true;
+        }
+        r->scan++;
+    }
+    return false;
+}
+
+/**
+ * まだ行として取り出していないバイト数
+ */
+int SipfLineReaderPending(const SipfLineReader *r)
+{
+    return r->head - r->release;
+}
+
+/**
+ * まだ行として取り出していないデータを行に分けずにそのまま取り出す(改行も含む)
+ * complete: trueなら最後の改行までにする(途中の行は残す)
+ * return: 取り出したバイト数
+ */
+int SipfLineReaderTake(SipfLineReader *r, uint8_t *buff, int len, bool complete)
+{
+    r->tail = r->release;
+    uint32_t end = r->head;
+    if (complete) {
+        while ((end != r->tail) && (r->ring[(end - 1) & RING_MASK] != '\r') && (r->ring[(end - 1) & RING_MASK] != '\n')) {
+            end--;
+        }
+    }
+    uint32_t n = end - r->tail;
+    if (n > (uint32_t)len) {
+        n = len;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        buff[i] = r->ring[(r->tail + i) & RING_MASK];
+    }
+    r->tail += n;
+    r->release = r->tail;
+    if ((int32_t)(r->scan - r->tail) < 0) {
+        r->scan = r->tail;
+    }
+    if ((n > 0) && ((buff[n - 1] == '\r') || (buff[n - 1] == '\n'))) {
+        r->discarding = false;
+    }
+    return n;
+}
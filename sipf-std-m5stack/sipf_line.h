@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_LINE_H_
+#define _SIPF_LINE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SIPF_LINE_RING_SZ   (2048)  // リングバッファのサイズ(2のべき乗)
+#define SIPF_LINE_MAX       (1024)  // 1行の最大長(これを超えたらあふれとして報告する)
+
+/**
+ * 行のビュー
+ * ptrはリングバッファ内を直接指していて'\0'で終端されている
+ * 次にSipfLineReaderNext()かSipfLineReaderReset()を呼ぶまで有効
+ */
+typedef struct {
+    char *ptr;
+    int len;
+    bool overflow;  // SIPF_LINE_MAXを超えたので先頭だけを切り出した
+}   SipfLineView;
+
+typedef struct {
+    // 折り返した行を連続して見せるため末尾にSIPF_LINE_MAX+1バイトの余白を持つ
+    uint8_t ring[SIPF_LINE_RING_SZ + SIPF_LINE_MAX + 1];
+    uint32_t head;      // 書き込み位置
+    uint32_t tail;      // 次の行の先頭
+    uint32_t scan;      // 行末を探し終わった位置
+    uint32_t release;   // 前回返した行の次の位置(次のNext()でtailをここまで進める)
+    bool discarding;    // あふれた行の残りを行末まで捨てている
+    uint32_t overflow_cnt;
+}   SipfLineReader;
+
+void SipfLineReaderReset(SipfLineReader *r);
+int SipfLineReaderFill(SipfLineReader *r);
+bool SipfLineReaderNext(SipfLineReader *r, SipfLineView *view);
+int SipfLineReaderPending(const SipfLineReader *r);
+int SipfLineReaderTake(SipfLineReader *r, uint8_t *buff, int len, bool complete);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,322 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "sipf_crc.h"
+#include "sipf_lz.h"
+
+#define LZ_NIL      (0xffff)
+#define LZ_MAGIC    "SLZ1"
+
+static void lzPut32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint32_t lzGet32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t lzHash(const uint8_t *p)
+{
+    uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - SIPF_LZ_HASH_BITS);
+}
+
+/**
+ * 窓1つ分を前に詰める(詰めた分だけハッシュチェインの位置をずらす)
+ */
+static void lzSlide(SipfLzEncoder *e)
+{
+    memmove(e->buf, &e->buf[SIPF_LZ_WINDOW], SIPF_LZ_WINDOW);
+    e->pos -= SIPF_LZ_WINDOW;
+    e->end -= SIPF_LZ_WINDOW;
+    for (int i = 0; i < (1 << SIPF_LZ_HASH_BITS); i++) {
+        uint16_t v = e->head[i];
+        e->head[i] = ((v == LZ_NIL) || (v < SIPF_LZ_WINDOW)) ? LZ_NIL : (uint16_t)(v - SIPF_LZ_WINDOW);
+    }
+    for (int i = 0; i < SIPF_LZ_WINDOW; i++) {
+        uint16_t v = e->prev[i];
+        e->prev[i] = ((v == LZ_NIL) || (v < SIPF_LZ_WINDOW)) ? LZ_NIL : (uint16_t)(v - SIPF_LZ_WINDOW);
+    }
+}
+
+/**
+ * 先読みが一致の最大長に足りなければreaderから読み足す
+ */
+static int lzFill(SipfLzEncoder *e)
+{
+    while (((e->end - e->pos) < SIPF_LZ_MATCH_MAX) && (e->idx_in < e->sz_in)) {
+        if (e->end == (int)sizeof(e->buf)) {
+            lzSlide(e);
+        }
+        uint32_t n = sizeof(e->buf) - e->end;
+        if (n > (e->sz_in - e->idx_in)) {
+            n = e->sz_in - e->idx_in;
+        }
+        int ret = e->reader(&e->buf[e->end], (int)n, e->arg);
+        if ((ret <= 0) || ((uint32_t)ret > n)) {
+            return -1;
+        }
+        e->crc = SipfCrc32(e->crc, &e->buf[e->end], ret);
+        e->end += ret;
+        e->idx_in += ret;
+    }
+    return 0;
+}
+
+static void lzInsert(SipfLzEncoder *e, int p)
+{
+    if ((p + SIPF_LZ_MATCH_MIN) > e->end) {
+        return;
+    }
+    uint32_t h = lzHash(&e->buf[p]);
+    e->prev[p & (SIPF_LZ_WINDOW - 1)] = e->head[h];
+    e->head[h] = (uint16_t)p;
+}
+
+/**
+ * posから始まる最長の一致をハッシュチェインからSIPF_LZ_CHAIN個まで探す
+ * return: 一致の長さ(SIPF_LZ_MATCH_MIN未満なら一致なし)
+ */
+static int lzMatch(SipfLzEncoder *e, int pos, int *dist)
+{
+    int avail = e->end - pos;
+    if (avail < SIPF_LZ_MATCH_MIN) {
+        return 0;
+    }
+    int max = (avail < SIPF_LZ_MATCH_MAX) ? avail : SIPF_LZ_MATCH_MAX;
+    const uint8_t *p = &e->buf[pos];
+    int best = 0;
+    uint16_t cand = e->head[lzHash(p)];
+    for (int chain = SIPF_LZ_CHAIN; (chain > 0) && (cand != LZ_NIL); chain--) {
+        int d = pos - cand;
+        if ((d <= 0) || (d > SIPF_LZ_WINDOW)) {
+            break;
+        }
+        const uint8_t *q = &e->buf[cand];
+        if (q[best] == p[best]) {
+            int l = 0;
+            while ((l < max) && (q[l] == p[l])) {
+                l++;
+            }
+            if (l > best) {
+                best = l;
+                *dist = d;
+                if (l == max) {
+                    break;
+                }
+            }
+        }
+        uint16_t nxt = e->prev[cand & (SIPF_LZ_WINDOW - 1)];
+        if ((nxt != LZ_NIL) && (nxt >= cand)) {
+            // 窓1つ分より古い位置は上書きされている
+            break;
+        }
+        cand = nxt;
+    }
+    return best;
+}
+
+/**
+ * フラグ1Byteと最大8要素をoutに組み立てる
+ */
+static int lzEncodeGroup(SipfLzEncoder *e)
+{
+    uint8_t flags = 0;
+    int n = 1;
+    int i;
+    for (i = 0; i < 8; i++) {
+        if (lzFill(e) != 0) {
+            return -1;
+        }
+        if (e->pos >= e->end) {
+            break;
+        }
+        int dist = 0;
+        int len = lzMatch(e, e->pos, &dist);
+        lzInsert(e, e->pos);
+        if ((len >= SIPF_LZ_MATCH_MIN) && (len < SIPF_LZ_MATCH_MAX)) {
+            // 1Byte後ろからの方が長く一致するならここはリテラルにする
+            int dist_next;
+            if (lzMatch(e, e->pos + 1, &dist_next) > len) {
+                len = 0;
+            }
+        }
+        if (len >= SIPF_LZ_MATCH_MIN) {
+            flags |= (uint8_t)(1 << i);
+            e->out[n++] = (uint8_t)(dist - 1);
+            e->out[n++] = (uint8_t)((((dist - 1) >> 8) << 4) | (len - SIPF_LZ_MATCH_MIN));
+        } else {
+            len = 1;
+            e->out[n++] = e->buf[e->pos];
+        }
+        e->pos++;
+        for (len--; len > 0; len--) {
+            lzInsert(e, e->pos);
+            e->pos++;
+        }
+    }
+    e->out[0] = flags;
+    e->out_len = (i > 0) ? n : 0;
+    e->out_idx = 0;
+    if (e->pos >= e->end) {
+        // 全部読んで符号化した
+        e->done = true;
+        if (e->check_crc && (e->crc != e->crc_expect)) {
+            // 1回目(SipfLzMeasure())と内容が変わった
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 圧縮を始める
+ * sz_in: 元の大きさ
+ * crc: ヘッダに書く元データのCRC-32(SipfLzMeasure()で求める). 読み終えたときに一致しなければエラーにする
+ * reader: 元データをbuffにlenバイトまで読み込んで読んだバイト数を返す
+ */
+void SipfLzEncodeBegin(SipfLzEncoder *e, uint32_t sz_in, uint32_t crc, SipfLzReader reader, void *arg)
+{
+    e->reader = reader;
+    e->arg = arg;
+    e->sz_in = sz_in;
+    e->idx_in = 0;
+    e->crc = 0;
+    e->crc_expect = crc;
+    e->check_crc = true;
+    e->done = false;
+    e->err = false;
+    e->pos = 0;
+    e->end = 0;
+    memset(e->head, 0xff, sizeof(e->head));
+    memset(e->prev, 0xff, sizeof(e->prev));
+
+    memcpy(e->out, LZ_MAGIC, 4);
+    lzPut32(&e->out[4], sz_in);
+    lzPut32(&e->out[8], crc);
+    e->out_len = SIPF_LZ_SZ_HEADER;
+    e->out_idx = 0;
+}
+
+/**
+ * 圧縮したデータをbuffにlenバイトまで取り出す(SipfFputReaderとして使える. arg: SipfLzEncoder*)
+ * return: 取り出したバイト数, -1: 終わりかエラー
+ */
+int SipfLzEncodeRead(uint8_t *buff, int len, void *arg)
+{
+    SipfLzEncoder *e = (SipfLzEncoder*)arg;
+    int got = 0;
+    while (got < len) {
+        if (e->out_idx < e->out_len) {
+            int n = e->out_len - e->out_idx;
+            if (n > (len - got)) {
+                n = len - got;
+            }
+            memcpy(&buff[got], &e->out[e->out_idx], n);
+            e->out_idx += n;
+            got += n;
+            continue;
+        }
+        if (e->done || e->err) {
+            break;
+        }
+        if (lzEncodeGroup(e) != 0) {
+            e->err = true;
+            return -1;
+        }
+    }
+    return (got > 0) ? got : -1;
+}
+
+/**
+ * 一度圧縮して圧縮後の大きさと元データのCRC-32を求める($$FPUTは先に大きさを送るため)
+ * readerは先頭から最後まで読まれる. 圧縮したデータは捨てる
+ * return: 圧縮後の大きさ(ヘッダ込み), -1: 読み出せない
+ */
+int32_t SipfLzMeasure(SipfLzEncoder *e, uint32_t sz_in, SipfLzReader reader, void *arg, uint32_t *crc)
+{
+    SipfLzEncodeBegin(e, sz_in, 0, reader, arg);
+    e->check_crc = false;
+    int32_t total = SIPF_LZ_SZ_HEADER;
+    while (!e->done) {
+        if (lzEncodeGroup(e) != 0) {
+            return -1;
+        }
+        total += e->out_len;
+    }
+    *crc = e->crc;
+    return total;
+}
+
+/**
+ * ヘッダを読む
+ * return: ヘッダの長さ, -1: 圧縮したデータではない
+ */
+int SipfLzHeader(const uint8_t *src, size_t sz_src, uint32_t *sz_orig, uint32_t *crc)
+{
+    if ((sz_src < SIPF_LZ_SZ_HEADER) || (memcmp(src, LZ_MAGIC, 4) != 0)) {
+        return -1;
+    }
+    *sz_orig = lzGet32(&src[4]);
+    *crc = lzGet32(&src[8]);
+    return SIPF_LZ_SZ_HEADER;
+}
+
+/**
+ * 展開する(元の大きさまで展開したら後ろは読まない)
+ * return: 展開した大きさ, -1: 壊れている・dstに収まらない・CRCが合わない
+ */
+int32_t SipfLzDecode(const uint8_t *src, size_t sz_src, uint8_t *dst, size_t sz_dst)
+{
+    uint32_t sz_orig, crc;
+    if (SipfLzHeader(src, sz_src, &sz_orig, &crc) < 0) {
+        return -1;
+    }
+    if (sz_orig > sz_dst) {
+        return -1;
+    }
+    size_t idx = SIPF_LZ_SZ_HEADER;
+    uint32_t out = 0;
+    while (out < sz_orig) {
+        if (idx >= sz_src) {
+            return -1;
+        }
+        uint8_t flags = src[idx++];
+        for (int i = 0; (i < 8) && (out < sz_orig); i++) {
+            if ((flags & (1 << i)) == 0) {
+                if (idx >= sz_src) {
+                    return -1;
+                }
+                dst[out++] = src[idx++];
+                continue;
+            }
+            if ((idx + 2) > sz_src) {
+                return -1;
+            }
+            uint32_t dist = ((uint32_t)src[idx] | ((uint32_t)(src[idx + 1] >> 4) << 8)) + 1;
+            uint32_t len = (src[idx + 1] & 0x0f) + SIPF_LZ_MATCH_MIN;
+            idx += 2;
+            if ((dist > out) || ((out + len) > sz_orig)) {
+                return -1;
+            }
+            // 重なっていてもよいように1Byteずつ写す
+            for (; len > 0; len--, out++) {
+                dst[out] = dst[out - dist];
+            }
+        }
+    }
+    if (SipfCrc32(0, dst, (int)out) != crc) {
+        return -1;
+    }
+    return (int32_t)out;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_LZ_H_
+#define _SIPF_LZ_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * $$FPUT用のLZSS圧縮
+ * 形式: ヘッダ(SIPF_LZ_SZ_HEADER) + [フラグ1Byte + 8要素]の繰り返し
+ *   ヘッダ: "SLZ1", 元の大きさ(uint32 LE), 元データのCRC-32(uint32 LE)
+ *   フラグのbitが0ならリテラル1Byte, 1なら一致2Byte(距離-1を12bit, 長さ-3を4bit)
+ * 元の大きさまで展開したら終わりなので, 後ろに付いたXMODEMの埋め草(0x1A)は無視できる
+ */
+#define SIPF_LZ_WINDOW_BITS (12)    // 窓の大きさ(12以下. 小さくすると作業領域が減る)
+#define SIPF_LZ_HASH_BITS   (10)
+#define SIPF_LZ_CHAIN       (16)    // 一致を探す候補の数
+#define SIPF_LZ_WINDOW      (1 << SIPF_LZ_WINDOW_BITS)
+#define SIPF_LZ_MATCH_MIN   (3)
+#define SIPF_LZ_MATCH_MAX   (18)
+#define SIPF_LZ_SZ_HEADER   (12)
+#define SIPF_LZ_FILE_SUFFIX ".slz"  // 圧縮して送るファイルのFILE_IDに付ける
+
+typedef int (*SipfLzReader)(uint8_t *buff, int len, void *arg);
+
+/**
+ * 圧縮器の作業領域(約18KB. 窓2つ分の入力とハッシュチェイン)
+ * 入力はreaderから少しずつ読むので元データの大きさによらず一定
+ */
+typedef struct {
+    SipfLzReader reader;
+    void *arg;
+    uint32_t sz_in;         // 元の大きさ
+    uint32_t idx_in;        // readerから読んだバイト数
+    uint32_t crc;           // 読んだ分のCRC-32
+    uint32_t crc_expect;    // ヘッダに書いたCRC-32
+    bool check_crc;
+    bool done;
+    bool err;
+    int pos;                // 次に符号化する位置
+    int end;                // bufに読み込んだ終わり
+    uint8_t out[SIPF_LZ_SZ_HEADER + 2 * 8 + 1];    // ヘッダか組み立てたフラグ+8要素
+    int out_len;
+    int out_idx;
+    uint8_t buf[2 * SIPF_LZ_WINDOW];
+    uint16_t head[1 << SIPF_LZ_HASH_BITS];
+    uint16_t prev[SIPF_LZ_WINDOW];
+}   SipfLzEncoder;
+
+void SipfLzEncodeBegin(SipfLzEncoder *e, uint32_t sz_in, uint32_t crc, SipfLzReader reader, void *arg);
+int SipfLzEncodeRead(uint8_t *buff, int len, void *arg);
+int32_t SipfLzMeasure(SipfLzEncoder *e, uint32_t sz_in, SipfLzReader reader, void *arg, uint32_t *crc);
+int SipfLzHeader(const uint8_t *src, size_t sz_src, uint32_t *sz_orig, uint32_t *crc);
+int32_t SipfLzDecode(const uint8_t *src, size_t sz_src, uint8_t *dst, size_t sz_dst);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
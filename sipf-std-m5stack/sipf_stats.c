@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include "sipf_stats.h"
+
+#if SIPF_STATS
+#include <stdio.h>
+#include <string.h>
+
+static SipfStats stats_shared;
+SIPF_THREAD_LOCAL SipfStats *sipf_stats = &stats_shared;
+
+static const char *cmd_names[SIPF_STATS_CMD_NUM] = {
+    "$W", "$R", "$$TX", "$$RX", "$$GNSSEN", "$$GNSSLOC", "REGS", "CALL", "$$FPUT"
+};
+
+static const char *phase_names[SIPF_STATS_PHASE_NUM] = {
+    "echo", "resp", "done"
+};
+
+static const char *prio_names[SIPF_PRIO_NUM] = {
+    "urgent", "normal", "bulk"
+};
+
+/**
+ * 呼び出したスレッドの統計の記録先を設定する(NULLなら共通の領域)
+ * SipfClientSet()がクライアントのstatsを設定する
+ */
+void SipfStatsBind(SipfStats *stats)
+{
+    sipf_stats = (stats != NULL) ? stats : &stats_shared;
+}
+
+void SipfStatsReset(void)
+{
+    memset(sipf_stats, 0, sizeof(SipfStats));
+}
+
+/**
+ * 統計を写し取る
+ */
+void SipfStatsGet(SipfStats *stats)
+{
+    memcpy(stats, sipf_stats, sizeof(SipfStats));
+}
+
+static void statsHistAdd(SipfStatsHist *h, uint32_t us)
+{
+    uint32_t ms = us >> 10;     // 割り算しないで1024usを1msとみなす
+    int bin = 0;
+    while ((ms != 0) && (bin < (SIPF_STATS_BINS - 1))) {
+        ms >>= 1;
+        bin++;
+    }
+    h->bins[bin]++;
+    h->cnt++;
+    h->sum_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+/**
+ * 所要時間をヒストグラムに加える
+ */
+void SipfStatsLatency(int cmd, int phase, uint32_t us)
+{
+    statsHistAdd(&sipf_stats->cmd[cmd].hist[phase], us);
+}
+
+/**
+ * 要求がキューで待った時間を優先度ごとのヒストグラムに加える
+ */
+void SipfStatsQueueWait(int prio, uint32_t us)
+{
+    statsHistAdd(&sipf_stats->prio[prio].wait, us);
+}
+
+/**
+ * コマンドの結果を数える
+ * tmout_char: タイムアウトしたときにキャラクタ間タイムアウトを待っていた
+ */
+void SipfStatsResult(int cmd, int result, bool tmout_char)
+{
+    SipfStatsCmd *c = &sipf_stats->cmd[cmd];
+    if ((result == 0) || ((cmd == SIPF_REQ_RX) && (result > 0))) {
+        // $$RXは受信したオブジェクト数を返す
+        c->ok++;
+    } else if (result == -3) {
+        if (tmout_char) {
+            c->tmout_char++;
+        } else {
+            c->tmout_cmd++;
+        }
+    } else if ((result == -1) || (((cmd == SIPF_REQ_W) || (cmd == SIPF_REQ_R)) && (result == 1))) {
+        // $W/$RのNGは1
+        c->ng++;
+    } else {
+        c->err++;
+    }
+}
+
+void SipfStatsRetry(int cmd)
+{
+    sipf_stats->cmd[cmd].retry++;
+}
+
+/**
+ * ヒストグラムを1行にしてprintに渡す
+ */
+static void statsHistDump(const char *name, const SipfStatsHist *h, SipfStatsPrint print, void *arg)
+{
+    char line[160];
+    if (h->cnt == 0) {
+        return;
+    }
+    int len = snprintf(line, sizeof(line), "  %-4s n=%lu avg=%luus max=%luus |", name,
+                       (unsigned long)h->cnt, (unsigned long)(h->sum_us / h->cnt), (unsigned long)h->max_us);
+    // 空のビンは省いて "<ms:回数" で並べる
+    for (int b = 0; (b < SIPF_STATS_BINS) && (len < (int)sizeof(line)); b++) {
+        if (h->bins[b] == 0) {
+            continue;
+        }
+        if (b == (SIPF_STATS_BINS - 1)) {
+            len += snprintf(&line[len], sizeof(line) - len, " >=%u:%lu", 1u << (b - 1), (unsigned long)h->bins[b]);
+        } else {
+            len += snprintf(&line[len], sizeof(line) - len, " <%u:%lu", 1u << b, (unsigned long)h->bins[b]);
+        }
+    }
+    print(line, arg);
+}
+
+/**
+ * 統計を1行ずつprintに渡す(USBシリアルに出す用)
+ */
+void SipfStatsDump(SipfStatsPrint print, void *arg)
+{
+    char line[160];
+
+    snprintf(line, sizeof(line), "bytes in=%lu out=%lu, xmodem nak=%lu can=%lu tmout=%lu",
+             (unsigned long)sipf_stats->bytes_in, (unsigned long)sipf_stats->bytes_out,
+             (unsigned long)sipf_stats->xmodem_nak, (unsigned long)sipf_stats->xmodem_can,
+             (unsigned long)sipf_stats->xmodem_tmout);
+    print(line, arg);
+
+    for (int i = 0; i < SIPF_STATS_CMD_NUM; i++) {
+        const SipfStatsCmd *c = &sipf_stats->cmd[i];
+        if ((c->ok + c->ng + c->tmout_cmd + c->tmout_char + c->err) == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%s ok=%lu ng=%lu tmout_cmd=%lu tmout_char=%lu err=%lu retry=%lu",
+                 cmd_names[i], (unsigned long)c->ok, (unsigned long)c->ng, (unsigned long)c->tmout_cmd,
+                 (unsigned long)c->tmout_char, (unsigned long)c->err, (unsigned long)c->retry);
+        print(line, arg);
+        for (int p = 0; p < SIPF_STATS_PHASE_NUM; p++) {
+            statsHistDump(phase_names[p], &c->hist[p], print, arg);
+        }
+    }
+
+    for (int i = 0; i < SIPF_PRIO_NUM; i++) {
+        const SipfStatsPrio *q = &sipf_stats->prio[i];
+        if ((q->wait.cnt + q->expired) == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "queue %s expired=%lu", prio_names[i], (unsigned long)q->expired);
+        print(line, arg);
+        statsHistDump("wait", &q->wait, print, arg);
+    }
+}
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_STATS_H_
+#define _SIPF_STATS_H_
+
+/*
+ * コマンドごとの所要時間のヒストグラムとUARTのバイト数の統計
+ * SIPF_STATSを1にすると有効になる(ここを書き換えるか, -DSIPF_STATS=1でビルドする)
+ * 0のときは計測のコードも統計の領域も残らない
+ */
+#ifndef SIPF_STATS
+#define SIPF_STATS  (0)
+#endif
+
+#if SIPF_STATS
+#include <stdint.h>
+
+#include "sipf_client.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ヒストグラムのビン: 0: 1ms未満, i: 2^(i-1)ms以上2^i ms未満, 最後のビンはそれ以上全部 */
+#define SIPF_STATS_BINS     (16)
+
+#define SIPF_STATS_CMD_FPUT (SIPF_REQ_CALL + 1)     // $$FPUT(エンジンを通らないので別枠)
+#define SIPF_STATS_CMD_NUM  (SIPF_STATS_CMD_FPUT + 1)
+
+enum {
+    SIPF_STATS_PHASE_ECHO,  // コマンド送信からエコーバックまで(FPUTは送信要求まで)
+    SIPF_STATS_PHASE_RESP,  // コマンド送信から最初の応答行まで(FPUTはブロックごとのACK待ち)
+    SIPF_STATS_PHASE_DONE,  // コマンド送信から完了まで
+    SIPF_STATS_PHASE_NUM
+};
+
+typedef struct {
+    uint32_t cnt;
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t bins[SIPF_STATS_BINS];
+}   SipfStatsHist;
+
+typedef struct {
+    SipfStatsHist hist[SIPF_STATS_PHASE_NUM];
+    uint32_t ok;
+    uint32_t ng;            // NG応答
+    uint32_t tmout_cmd;     // TMOUT_CMD(応答待ち)のタイムアウト
+    uint32_t tmout_char;    // TMOUT_CHAR(キャラクタ間)のタイムアウト
+    uint32_t err;           // それ以外の失敗
+    uint32_t retry;         // 再送(FPUTのブロック再送)
+}   SipfStatsCmd;
+
+/* 優先度ごとのキューの待ち時間(投入から送信開始まで) */
+typedef struct {
+    SipfStatsHist wait;
+    uint32_t expired;       // 期限までに始められずに捨てた要求
+}   SipfStatsPrio;
+
+typedef struct SipfStats {
+    SipfStatsCmd cmd[SIPF_STATS_CMD_NUM];
+    SipfStatsPrio prio[SIPF_PRIO_NUM];
+    uint32_t bytes_in;
+    uint32_t bytes_out;
+    uint32_t xmodem_nak;    // 受信側からのNAK
+    uint32_t xmodem_can;    // 受信側からのCAN
+    uint32_t xmodem_tmout;  // 送信要求, ACK待ちのタイムアウト
+}   SipfStats;
+
+typedef void (*SipfStatsPrint)(const char *line, void *arg);
+
+void SipfStatsBind(SipfStats *stats);
+void SipfStatsReset(void);
+void SipfStatsGet(SipfStats *stats);
+void SipfStatsDump(SipfStatsPrint print, void *arg);
+
+void SipfStatsLatency(int cmd, int phase, uint32_t us);
+void SipfStatsResult(int cmd, int result, bool tmout_char);
+void SipfStatsRetry(int cmd);
+void SipfStatsQueueWait(int prio, uint32_t us);
+
+extern SIPF_THREAD_LOCAL SipfStats *sipf_stats;    // 呼び出したスレッドの記録先
+
+#ifdef __cplusplus
+}
+#endif
+
+#define SIPF_STATS_LATENCY(cmd, phase, us)      SipfStatsLatency((cmd), (phase), (us))
+#define SIPF_STATS_RESULT(cmd, result, tm_char) SipfStatsResult((cmd), (result), (tm_char))
+#define SIPF_STATS_RETRY(cmd)                   SipfStatsRetry(cmd)
+#define SIPF_STATS_QUEUE_WAIT(prio, us)         SipfStatsQueueWait((prio), (us))
+#define SIPF_STATS_ADD(field, n)                (sipf_stats->field += (n))
+#else
+#define SIPF_STATS_LATENCY(cmd, phase, us)      do {} while (0)
+#define SIPF_STATS_RESULT(cmd, result, tm_char) do {} while (0)
+#define SIPF_STATS_RETRY(cmd)                   do {} while (0)
+#define SIPF_STATS_QUEUE_WAIT(prio, us)         do {} while (0)
+#define SIPF_STATS_ADD(field, n)                do {} while (0)
+#endif
+
+#endif
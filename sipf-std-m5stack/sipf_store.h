@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_STORE_H_
+#define _SIPF_STORE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * 電源を切っても残る記憶領域(固定サイズ)を抽象化したもの
+ * sipf_txq.c はこれを経由して送信待ちのメッセージを保存する
+ */
+typedef struct {
+    void *ctx;
+    uint32_t size;                                                      // 領域のサイズ
+    int (*read)(void *ctx, uint32_t off, uint8_t *buff, int len);       // offからlenバイト読む
+    int (*write)(void *ctx, uint32_t off, const uint8_t *buff, int len);// offからlenバイト書く
+    int (*sync)(void *ctx);                                             // 書いた内容を記憶媒体に反映する
+}   SipfStore;
+
+#if !defined(ARDUINO)
+/**
+ * Linux(POSIX)用: 普通のファイル
+ */
+typedef struct {
+    int fd;
+}   SipfStorePosix;
+
+int SipfStorePosixOpen(SipfStore *st, SipfStorePosix *p, const char *path, uint32_t size);
+void SipfStorePosixClose(SipfStorePosix *p);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(ARDUINO) && defined(__cplusplus)
+#include <FS.h>
+/**
+ * Arduino用: SPIFFSなどのファイル
+ */
+typedef struct {
+    fs::File file;
+}   SipfStoreArduino;
+
+int SipfStoreArduinoOpen(SipfStore *st, SipfStoreArduino *a, fs::FS &fs, const char *path, uint32_t size);
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include <FS.h>
+#include "sipf_store.h"
+
+static int arduinoRead(void *ctx, uint32_t off, uint8_t *buff, int len)
+{
+    SipfStoreArduino *a = (SipfStoreArduino*)ctx;
+    if (!a->file.seek(off)) {
+        return -1;
+    }
+    return a->file.read(buff, len);
+}
+
+static int arduinoWrite(void *ctx, uint32_t off, const uint8_t *buff, int len)
+{
+    SipfStoreArduino *a = (SipfStoreArduino*)ctx;
+    if (!a->file.seek(off)) {
+        return -1;
+    }
+    return a->file.write(buff, len);
+}
+
+static int arduinoSync(void *ctx)
+{
+    SipfStoreArduino *a = (SipfStoreArduino*)ctx;
+    a->file.flush();
+    return 0;
+}
+
+/**
+ * ファイルを開いて(無ければ作って)sizeバイトの記憶領域として使う
+ * SPIFFSは末尾より先にseekできないので, 作るときにsizeバイトまで0で埋めておく
+ * return: 0: 成功, -1: 失敗
+ */
+int SipfStoreArduinoOpen(SipfStore *st, SipfStoreArduino *a, fs::FS &fs, const char *path, uint32_t size)
+{
+    if (fs.exists(path)) {
+        a->file = fs.open(path, "r+");
+    } else {
+        a->file = fs.open(path, "w+");
+    }
+    if (!a->file) {
+        return -1;
+    }
+    if (a->file.size() < size) {
+        static const uint8_t zero[64] = { 0 };
+        a->file.seek(a->file.size());
+        for (uint32_t n = a->file.size(); n < size; ) {
+            uint32_t len = ((size - n) < sizeof(zero)) ? (size - n) : sizeof(zero);
+            if (a->file.write(zero, len) != len) {
+                a->file.close();
+                return -1;
+            }
+            n += len;
+        }
+        a->file.flush();
+    }
+
+    st->ctx = a;
+    st->size = size;
+    st->read = arduinoRead;
+    st->write = arduinoWrite;
+    st->sync = arduinoSync;
+    return 0;
+}
+
+#endif
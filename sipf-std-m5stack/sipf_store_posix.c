@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#if !defined(ARDUINO)
+
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sipf_store.h"
+
+static int posixRead(void *ctx, uint32_t off, uint8_t *buff, int len)
+{
+    SipfStorePosix *p = (SipfStorePosix*)ctx;
+    ssize_t ret = pread(p->fd, buff, len, off);
+    return (ret < 0) ? -1 : (int)ret;
+}
+
+static int posixWrite(void *ctx, uint32_t off, const uint8_t *buff, int len)
+{
+    SipfStorePosix *p = (SipfStorePosix*)ctx;
+    ssize_t ret = pwrite(p->fd, buff, len, off);
+    return (ret < 0) ? -1 : (int)ret;
+}
+
+static int posixSync(void *ctx)
+{
+    SipfStorePosix *p = (SipfStorePosix*)ctx;
+    return (fdatasync(p->fd) == 0) ? 0 : -1;
+}
+
+/**
+ * ファイルを開いて(無ければ作って)sizeバイトの記憶領域として使う
+ * return: 0: 成功, -1: 失敗
+ */
+int SipfStorePosixOpen(SipfStore *st, SipfStorePosix *p, const char *path, uint32_t size)
+{
+    p->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (p->fd < 0) {
+        return -1;
+    }
+    struct stat sb;
+    if ((fstat(p->fd, &sb) != 0) || ((sb.st_size < size) && (ftruncate(p->fd, size) != 0))) {
+        close(p->fd);
+        p->fd = -1;
+        return -1;
+    }
+
+    st->ctx = p;
+    st->size = size;
+    st->read = posixRead;
+    st->write = posixWrite;
+    st->sync = posixSync;
+    return 0;
+}
+
+void SipfStorePosixClose(SipfStorePosix *p)
+{
+    if (p->fd >= 0) {
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+#endif
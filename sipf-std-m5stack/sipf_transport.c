@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sipf_stats.h"
+#include "sipf_transport.h"
+
+static SIPF_THREAD_LOCAL const SipfTransport *transport = NULL;
+
+/**
+ * 使用するトランスポートを設定(呼び出したスレッドだけ)
+ */
+void SipfTransportSet(const SipfTransport *tr)
+{
+    transport = tr;
+}
+
+const SipfTransport *SipfTransportGet(void)
+{
+    return transport;
+}
+
+int SipfTransportAvailable(void)
+{
+    if (transport == NULL) {
+        return 0;
+    }
+    return transport->available(transport->ctx);
+}
+
+int SipfTransportRead(uint8_t *buff, int len)
+{
+    if (transport == NULL) {
+        return -1;
+    }
+    int n = transport->read(transport->ctx, buff, len);
+    if (n > 0) {
+        SIPF_STATS_ADD(bytes_in, n);
+    }
+    return n;
+}
+
+/**
+ * 1バイト読む
+ * return: 読んだバイト, 受信データが無い場合は-1
+ */
+int SipfTransportReadByte(void)
+{
+    uint8_t b;
+    if (SipfTransportRead(&b, 1) != 1) {
+        return -1;
+    }
+    return b;
+}
+
+int SipfTransportWrite(const uint8_t *buff, int len)
+{
+    if (transport == NULL) {
+        return -1;
+    }
+    int n = transport->write(transport->ctx, buff, len);
+    if (n > 0) {
+        SIPF_STATS_ADD(bytes_out, n);
+    }
+    return n;
+}
+
+uint32_t SipfTransportMillis(void)
+{
+    if (transport == NULL) {
+        return 0;
+    }
+    return transport->millis(transport->ctx);
+}
+
+uint32_t SipfTransportMicros(void)
+{
+    if (transport == NULL) {
+        return 0;
+    }
+    return transport->micros(transport->ctx);
+}
+
+void SipfTransportDelay(uint32_t ms)
+{
+    if (transport == NULL) {
+        return;
+    }
+    transport->delay(transport->ctx, ms);
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_TRANSPORT_H_
+#define _SIPF_TRANSPORT_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* スレッドごとに持つ変数(スレッドごとに別のモジュールを操作できるように) */
+#if defined(__GNUC__)
+#define SIPF_THREAD_LOCAL   __thread
+#else
+#define SIPF_THREAD_LOCAL
+#endif
+
+/**
+ * モジュールとのUARTと時計を抽象化したもの
+ * sipf_client.cpp と xmodem.c はこれを経由してモジュールと通信する
+ */
+typedef struct {
+    void *ctx;
+    int (*available)(void *ctx);                            // 受信済みのバイト数
+    int (*read)(void *ctx, uint8_t *buff, int len);         // 受信済みのデータを最大lenバイト読む(ブロックしない)
+    int (*write)(void *ctx, const uint8_t *buff, int len);  // lenバイト送信する
+    uint32_t (*millis)(void *ctx);                          // 経過時間[ms]
+    uint32_t (*micros)(void *ctx);                          // 経過時間[us]
+    void (*delay)(void *ctx, uint32_t ms);                  // 待つ[ms]
+}   SipfTransport;
+
+/* 呼び出したスレッドで使うトランスポートを設定する */
+void SipfTransportSet(const SipfTransport *tr);
+const SipfTransport *SipfTransportGet(void);
+
+int SipfTransportAvailable(void);
+int SipfTransportRead(uint8_t *buff, int len);
+int SipfTransportReadByte(void);
+int SipfTransportWrite(const uint8_t *buff, int len);
+uint32_t SipfTransportMillis(void);
+uint32_t SipfTransportMicros(void);
+void SipfTransportDelay(uint32_t ms);
+
+#if !defined(ARDUINO)
+/**
+ * Linux(POSIX)用: PTYやsocketpairのファイルディスクリプタ
+ */
+typedef struct {
+    int fd;
+    int owned;  // Close()でfdを閉じるか
+}   SipfTransportPosix;
+
+int SipfTransportPosixOpen(SipfTransport *tr, SipfTransportPosix *p, const char *path, int baud);
+void SipfTransportPosixAttach(SipfTransport *tr, SipfTransportPosix *p, int fd);
+void SipfTransportPosixClose(SipfTransportPosix *p);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#if defined(ARDUINO) && defined(__cplusplus)
+class HardwareSerial;
+/**
+ * Arduino用: HardwareSerial(Serial2など)
+ */
+void SipfTransportArduinoInit(SipfTransport *tr, HardwareSerial *serial);
+#endif
+
+#endif
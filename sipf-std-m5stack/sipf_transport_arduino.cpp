@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifdef ARDUINO
+
+#include <Arduino.h>
+#include "sipf_transport.h"
+
+static int arduinoAvailable(void *ctx)
+{
+    return ((HardwareSerial*)ctx)->available();
+}
+
+static int arduinoRead(void *ctx, uint8_t *buff, int len)
+{
+    HardwareSerial *serial = (HardwareSerial*)ctx;
+    int avail = serial->available();
+    if (avail <= 0) {
+        return 0;
+    }
+    if (len > avail) {
+        len = avail;
+    }
+    return serial->readBytes(buff, len);
+}
+
+static int arduinoWrite(void *ctx, const uint8_t *buff, int len)
+{
+    return ((HardwareSerial*)ctx)->write(buff, len);
+}
+
+static uint32_t arduinoMillis(void *ctx)
+{
+    return millis();
+}
+
+static uint32_t arduinoMicros(void *ctx)
+{
+    return micros();
+}
+
+static void arduinoDelay(void *ctx, uint32_t ms)
+{
+    delay(ms);
+}
+
+/**
+ * HardwareSerialをトランスポートとして使う
+ */
+void SipfTransportArduinoInit(SipfTransport *tr, HardwareSerial *serial)
+{
+    tr->ctx = serial;
+    tr->available = arduinoAvailable;
+    tr->read = arduinoRead;
+    tr->write = arduinoWrite;
+    tr->millis = arduinoMillis;
+    tr->micros = arduinoMicros;
+    tr->delay = arduinoDelay;
+}
+
+#endif
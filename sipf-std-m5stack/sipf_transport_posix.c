@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#if !defined(ARDUINO)
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sipf_transport.h"
+
+static int posixAvailable(void *ctx)
+{
+    SipfTransportPosix *p = (SipfTransportPosix*)ctx;
+    int len = 0;
+    if (ioctl(p->fd, FIONREAD, &len) < 0) {
+        return 0;
+    }
+    return len;
+}
+
+static int posixRead(void *ctx, uint8_t *buff, int len)
+{
+    SipfTransportPosix *p = (SipfTransportPosix*)ctx;
+    ssize_t ret = read(p->fd, buff, len);
+    if (ret < 0) {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+            return 0;   // まだ何も来てない
+        }
+        return -1;
+    }
+    return (int)ret;
+}
+
+static int posixWrite(void *ctx, const uint8_t *buff, int len)
+{
+    SipfTransportPosix *p = (SipfTransportPosix*)ctx;
+    int idx = 0;
+    while (idx < len) {
+        ssize_t ret = write(p->fd, &buff[idx], len - idx);
+        if (ret < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                // 送信できるようになるまで待つ
+                struct pollfd pfd = { p->fd, POLLOUT, 0 };
+                poll(&pfd, 1, 10);
+                continue;
+            }
+            return -1;
+        }
+        idx += ret;
+    }
+    return idx;
+}
+
+static uint32_t posixMillis(void *ctx)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint32_t posixMicros(void *ctx)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void posixDelay(void *ctx, uint32_t ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+static speed_t posixBaud(int baud)
+{
+    switch (baud) {
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    case 115200:
+    default:     return B115200;
+    }
+}
+
+/**
+ * 既に開いているファイルディスクリプタ(socketpairなど)をトランスポートとして使う
+ */
+void SipfTransportPosixAttach(SipfTransport *tr, SipfTransportPosix *p, int fd)
+{
+    p->fd = fd;
+    p->owned = 0;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    tr->ctx = p;
+    tr->available = posixAvailable;
+    tr->read = posixRead;
+    tr->write = posixWrite;
+    tr->millis = posixMillis;
+    tr->micros = posixMicros;
+    tr->delay = posixDelay;
+}
+
+/**
+ * シリアルデバイスやPTYを開いてトランスポートとして使う
+ * return: 0: 成功, -1: 失敗
+ */
+int SipfTransportPosixOpen(SipfTransport *tr, SipfTransportPosix *p, const char *path, int baud)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        // RAWモード 8N1
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, posixBaud(baud));
+        cfsetospeed(&tio, posixBaud(baud));
+        tio.c_cflag |= (CLOCAL | CREAD);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    SipfTransportPosixAttach(tr, p, fd);
+    p->owned = 1;
+    return 0;
+}
+
+void SipfTransportPosixClose(SipfTransportPosix *p)
+{
+    if (p->owned && (p->fd >= 0)) {
+        close(p->fd);
+    }
+    p->fd = -1;
+}
+
+#endif
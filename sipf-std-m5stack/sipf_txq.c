@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sipf_crc.h"
+#include "sipf_txq.h"
+
+/*
+ * 記憶領域の配置
+ *   [0, 32)      管理情報A
+ *   [32, 64)     管理情報B(世代の大きい方が有効. 交互に書くので書きかけで壊れても片方は残る)
+ *   [64, size)   メッセージのリングバッファ
+ * メッセージはヘッダ(CRC付き)+オブジェクト部分のHEX文字列. 末尾に収まらないときは折り返しの印を置いて先頭から書く
+ * 起動時は管理情報の先頭から連番とCRCが合う間だけ続けて読み, 書きかけのメッセージは捨てる
+ */
+#define TXQ_MAGIC_META  (0x51545853)    // "SXTQ"
+#define TXQ_MAGIC_REC   (0x4d51)        // "QM"
+#define TXQ_MAGIC_WRAP  (0x5751)        // "QW"
+#define TXQ_META_SZ     (32)
+#define TXQ_DATA_OFS    (TXQ_META_SZ * 2)
+#define TXQ_PAYLOAD_MAX (SIPF_TX_LINE_MAX - 4 - 3)  // "$$TX"と"\r\n"を除いた長さ
+#define TXQ_ALIGN(n)    (((n) + 3) & ~(uint32_t)3)
+
+#define TXQ_RETRY_MS        (1000)
+#define TXQ_RETRY_MAX_MS    (60000)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t gen;
+    uint32_t head_off;
+    uint32_t head_seq;
+    uint32_t crc;
+}   TxqMeta;
+
+typedef struct {
+    uint16_t magic;
+    uint16_t len;           // オブジェクト部分の長さ
+    uint32_t seq;
+    uint64_t timestamp_ms;
+    uint32_t crc;           // crc=0にしたヘッダとオブジェクト部分のCRC-32
+    uint8_t obj_cnt;
+    uint8_t reserved[3];
+}   TxqRec;
+
+#define TXQ_REC_SZ      ((uint32_t)sizeof(TxqRec))
+
+static uint32_t txqRecCrc(const TxqRec *rec, const uint8_t *payload)
+{
+    TxqRec tmp = *rec;
+    tmp.crc = 0;
+    uint32_t crc = SipfCrc32(0, (const uint8_t*)&tmp, sizeof(tmp));
+    return SipfCrc32(crc, payload, rec->len);
+}
+
+static int txqRead(SipfTxQueue *q, uint32_t off, void *buff, int len)
+{
+    return (q->store->read(q->store->ctx, off, (uint8_t*)buff, len) == len) ? 0 : -1;
+}
+
+static int txqWrite(SipfTxQueue *q, uint32_t off, const void *buff, int len)
+{
+    return (q->store->write(q->store->ctx, off, (const uint8_t*)buff, len) == len) ? 0 : -1;
+}
+
+/**
+ * 管理情報を次の世代として書く
+ */
+static int txqCommit(SipfTxQueue *q)
+{
+    TxqMeta meta;
+    meta.magic = TXQ_MAGIC_META;
+    meta.gen = q->gen + 1;
+    meta.head_off = q->head_off;
+    meta.head_seq = q->head_seq;
+    meta.crc = 0;
+    meta.crc = SipfCrc32(0, (const uint8_t*)&meta, sizeof(meta));
+    if ((txqWrite(q, (meta.gen & 1) * TXQ_META_SZ, &meta, sizeof(meta)) != 0) || (q->store->sync(q->store->ctx) != 0)) {
+        return -1;
+    }
+    q->gen = meta.gen;
+    return 0;
+}
+
+/**
+ * offに折り返しがあれば先頭に進める
+ */
+static uint32_t txqSkipWrap(SipfTxQueue *q, uint32_t off, uint32_t seq)
+{
+    TxqRec rec;
+    if ((q->store->size - off) < TXQ_REC_SZ) {
+        // ヘッダも入らないので印を置かずに折り返した
+        return TXQ_DATA_OFS;
+    }
+    if ((txqRead(q, off, &rec, sizeof(rec)) == 0) && (rec.magic == TXQ_MAGIC_WRAP) &&
+        (rec.seq == seq) && (rec.crc == txqRecCrc(&rec, NULL))) {
+        return TXQ_DATA_OFS;
+    }
+    return off;
+}
+
+/**
+ * offのメッセージを読んでpayloadに置く
+ * return: 0: 成功, -1: 連番かCRCが合わない
+ */
+static int txqReadRec(SipfTxQueue *q, uint32_t off, uint32_t seq, TxqRec *rec, uint8_t *payload)
+{
+    if ((txqRead(q, off, rec, sizeof(TxqRec)) != 0) || (rec->magic != TXQ_MAGIC_REC) || (rec->seq != seq)) {
+        return -1;
+    }
+    if ((rec->len > TXQ_PAYLOAD_MAX) || ((off + TXQ_REC_SZ + rec->len) > q->store->size)) {
+        return -1;
+    }
+    if ((txqRead(q, off + TXQ_REC_SZ, payload, rec->len) != 0) || (rec->crc != txqRecCrc(rec, payload))) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * 残りのメッセージを全部捨てて書いた位置から続ける(壊れたメッセージの長さは当てにならないので読み飛ばせない)
+ */
+static int txqResync(SipfTxQueue *q)
+{
+    q->dropped += q->cnt;
+    q->head_off = q->tail_off;
+    q->head_seq += q->cnt;
+    q->cnt = 0;
+    return txqCommit(q);
+}
+
+/**
+ * 最も古いメッセージを外して管理情報を書く
+ * ヘッダが壊れていたら残りを全部捨てる
+ */
+static int txqPop(SipfTxQueue *q)
+{
+    TxqRec rec;
+    uint32_t off = txqSkipWrap(q, q->head_off, q->head_seq);
+    if ((txqRead(q, off, &rec, sizeof(rec)) != 0) || (rec.magic != TXQ_MAGIC_REC) || (rec.seq != q->head_seq) ||
+        (rec.len > TXQ_PAYLOAD_MAX) || ((off + TXQ_REC_SZ + rec.len) > q->store->size)) {
+        return txqResync(q);
+    }
+    q->head_off = off + TXQ_ALIGN(TXQ_REC_SZ + rec.len);
+    q->head_seq++;
+    q->cnt--;
+    if (q->cnt == 0) {
+        q->head_off = q->tail_off;
+    }
+    return txqCommit(q);
+}
+
+/**
+ * 記憶領域から送信待ちのメッセージを復元する
+ * 管理情報が無い(初めて使う)場合は空のキューとして初期化する
+ * return: 0: 成功, -1: 失敗
+ */
+int SipfTxQueueOpen(SipfTxQueue *q, const SipfStore *store, SipfTxQueuePolicy policy, SipfTxQueueCallback cb, void *arg)
+{
+    memset(q, 0, sizeof(SipfTxQueue));
+    q->store = store;
+    q->policy = policy;
+    q->retry_ms = TXQ_RETRY_MS;
+    q->retry_max_ms = TXQ_RETRY_MAX_MS;
+    q->cur_retry_ms = TXQ_RETRY_MS;
+    q->t_next = SipfClientMillis();
+    q->cb = cb;
+    q->arg = arg;
+    if (store->size < (TXQ_DATA_OFS + TXQ_REC_SZ + TXQ_PAYLOAD_MAX)) {
+        // メッセージ1つも入らない
+        return -1;
+    }
+
+    // 新しい方の管理情報を使う
+    bool found = false;
+    for (int i = 0; i < 2; i++) {
+        TxqMeta meta;
+        if (txqRead(q, i * TXQ_META_SZ, &meta, sizeof(meta)) != 0) {
+            continue;
+        }
+        uint32_t crc = meta.crc;
+        meta.crc = 0;
+        if ((meta.magic != TXQ_MAGIC_META) || (crc != SipfCrc32(0, (const uint8_t*)&meta, sizeof(meta)))) {
+            continue;
+        }
+        if ((meta.head_off < TXQ_DATA_OFS) || (meta.head_off > store->size)) {
+            continue;
+        }
+        if (!found || ((int32_t)(meta.gen - q->gen) > 0)) {
+            found = true;
+            q->gen = meta.gen;
+            q->head_off = meta.head_off;
+            q->head_seq = meta.head_seq;
+        }
+    }
+    if (!found) {
+        q->gen = 0;
+        q->head_off = TXQ_DATA_OFS;
+        q->head_seq = 1;
+        q->tail_off = TXQ_DATA_OFS;
+        return txqCommit(q);
+    }
+
+    // 連番とCRCが合う間だけ読み進める(途中で折り返すのは1回だけ)
+    uint32_t off = q->head_off;
+    uint32_t seq = q->head_seq;
+    bool wrapped = false;
+    for (;;) {
+        uint32_t next = txqSkipWrap(q, off, seq);
+        if (next != off) {
+            if (wrapped) {
+                break;
+            }
+            wrapped = true;
+            off = next;
+        }
+        TxqRec rec;
+        if (txqReadRec(q, off, seq, &rec, (uint8_t*)&q->batch.line[4]) != 0) {
+            break;
+        }
+        uint32_t end = off + TXQ_ALIGN(TXQ_REC_SZ + rec.len);
+        if (wrapped && (end > q->head_off)) {
+            // 一周して古い領域に入った
+            break;
+        }
+        off = end;
+        seq++;
+        q->cnt++;
+    }
+    q->tail_off = (q->cnt == 0) ? q->head_off : off;
+    return 0;
+}
+
+/**
+ * 送信待ちのメッセージを全部捨てる
+ */
+int SipfTxQueueClear(SipfTxQueue *q)
+{
+    if (q->sending) {
+        return -1;
+    }
+    q->head_off = q->tail_off;
+    q->head_seq += q->cnt;
+    q->cnt = 0;
+    return txqCommit(q);
+}
+
+/**
+ * needバイトを書く位置を決める
+ * return: 書く位置, 0: 空きが足りない
+ */
+static uint32_t txqFit(SipfTxQueue *q, uint32_t need, bool *wrap)
+{
+    uint32_t size = q->store->size;
+    *wrap = false;
+    if ((q->cnt == 0) || (q->tail_off > q->head_off)) {
+        if ((q->tail_off + need) <= size) {
+            return q->tail_off;
+        }
+        uint32_t limit = (q->cnt == 0) ? size : q->head_off;
+        if ((TXQ_DATA_OFS + need) <= limit) {
+            *wrap = true;
+            return TXQ_DATA_OFS;
+        }
+        return 0;
+    }
+    // 折り返した後ろにheadがある
+    if ((q->tail_off + need) <= q->head_off) {
+        return q->tail_off;
+    }
+    return 0;
+}
+
+/**
+ * バッチ(SipfTxBatchBegin()/SipfTxBatchAdd()で作ったもの)を送信待ちとして保存する
+ * 保存してから戻るので, 戻った後に電源が切れても失われない
+ * timestamp_ms: 一緒に保存してコールバックに返す時刻(再起動をまたぐのでUNIX時間[ms]などにする. 0: わからない)
+ * return: 0: 成功, -1: 失敗(いっぱいでDROP_NEWEST, 大きすぎる, 書き込めない)
+ */
+int SipfTxQueuePut(SipfTxQueue *q, const SipfTxBatch *batch, uint64_t timestamp_ms)
+{
+    if ((batch->obj_cnt == 0) || (batch->len <= 4)) {
+        return -1;
+    }
+    TxqRec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = TXQ_MAGIC_REC;
+    rec.len = batch->len - 4;
+    rec.timestamp_ms = timestamp_ms;
+    rec.obj_cnt = batch->obj_cnt;
+    uint32_t need = TXQ_ALIGN(TXQ_REC_SZ + rec.len);
+
+    bool wrap;
+    uint32_t off;
+    while ((off = txqFit(q, need, &wrap)) == 0) {
+        if (q->cnt == 0) {
+            // 空でも入らない
+            return -1;
+        }
+        if ((q->policy == SIPF_TXQ_DROP_NEWEST) || q->sending) {
+            // 送信中は最も古いメッセージを外せないので新しい方をあきらめる
+            q->dropped++;
+            return -1;
+        }
+        uint32_t dropped = q->dropped;
+        if (txqPop(q) != 0) {
+            return -1;
+        }
+        if (q->dropped == dropped) {
+            // 壊れていて全部捨てたときは数えてある
+            q->dropped++;
+        }
+    }
+
+    rec.seq = q->head_seq + q->cnt;
+    if (wrap && ((q->store->size - q->tail_off) >= TXQ_REC_SZ)) {
+        // 折り返しの印
+        TxqRec mark;
+        memset(&mark, 0, sizeof(mark));
+        mark.magic = TXQ_MAGIC_WRAP;
+        mark.seq = rec.seq;
+        mark.crc = txqRecCrc(&mark, NULL);
+        if (txqWrite(q, q->tail_off, &mark, sizeof(mark)) != 0) {
+            return -1;
+        }
+    }
+    rec.crc = txqRecCrc(&rec, (const uint8_t*)&batch->line[4]);
+    if ((txqWrite(q, off, &rec, sizeof(rec)) != 0) ||
+        (txqWrite(q, off + TXQ_REC_SZ, &batch->line[4], rec.len) != 0) ||
+        (q->store->sync(q->store->ctx) != 0)) {
+        return -1;
+    }
+    q->tail_off = off + need;
+    q->cnt++;
+    return 0;
+}
+
+/**
+ * 送信の完了
+ */
+static void txqOnSent(SipfReq *req, int result, void *arg)
+{
+    SipfTxQueue *q = (SipfTxQueue*)arg;
+    uint32_t now = SipfClientMillis();
+
+    q->sending = false;
+    if (result == 0) {
+        txqPop(q);
+        q->cur_retry_ms = q->retry_ms;
+        q->t_next = now;
+    } else {
+        // モジュールが送れない状態. しばらく待ってから同じメッセージを送り直す
+        q->t_next = now + q->cur_retry_ms;
+        q->cur_retry_ms = ((q->cur_retry_ms * 2) > q->retry_max_ms) ? q->retry_max_ms : (q->cur_retry_ms * 2);
+    }
+    if (q->cb != NULL) {
+        q->cb(q, result, q->sending_ts, q->otid, q->arg);
+    }
+}
+
+/**
+ * 送信待ちがあれば最も古いものから送信する(loop()から呼ぶ)
+ * 送信できたら続けて次を送る. 失敗したら間隔を空けて同じメッセージを送り直す
+ */
+void SipfTxQueuePoll(SipfTxQueue *q)
+{
+    if (q->sending || (q->cnt == 0)) {
+        return;
+    }
+    if ((int32_t)(SipfClientMillis() - q->t_next) < 0) {
+        return;
+    }
+
+    TxqRec rec;
+    uint32_t off = txqSkipWrap(q, q->head_off, q->head_seq);
+    if (txqReadRec(q, off, q->head_seq, &rec, (uint8_t*)&q->batch.line[4]) != 0) {
+        // 読めなくなっている. 次のメッセージの位置もわからないので残りを捨てる
+        txqResync(q);
+        return;
+    }
+    memcpy(q->batch.line, "$$TX", 4);
+    q->batch.len = 4 + rec.len;
+    q->batch.line[q->batch.len] = '\0';
+    q->batch.obj_cnt = rec.obj_cnt;
+    q->sending_ts = rec.timestamp_ms;
+    memset(q->otid, 0, sizeof(q->otid));
+    if (SipfSubmitTx(&q->req, &q->batch, q->otid, txqOnSent, q) == 0) {
+        q->sending = true;
+    }
+}
+
+/**
+ * 送信待ちのメッセージ数
+ */
+uint32_t SipfTxQueueCount(const SipfTxQueue *q)
+{
+    return q->cnt;
+}
+
+/**
+ * 空いているバイト数(目安. 折り返しで使えない末尾も含む)
+ */
+uint32_t SipfTxQueueFree(const SipfTxQueue *q)
+{
+    uint32_t ring = q->store->size - TXQ_DATA_OFS;
+    if (q->cnt == 0) {
+        return ring;
+    }
+    if (q->tail_off > q->head_off) {
+        return ring - (q->tail_off - q->head_off);
+    }
+    return q->head_off - q->tail_off;
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_TXQ_H_
+#define _SIPF_TXQ_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sipf_client.h"
+#include "sipf_store.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* いっぱいのときの扱い */
+typedef enum {
+    SIPF_TXQ_DROP_OLDEST,   // 古いメッセージから捨てて入れる
+    SIPF_TXQ_DROP_NEWEST,   // 新しいメッセージを入れない
+}   SipfTxQueuePolicy;
+
+typedef struct SipfTxQueue SipfTxQueue;
+/* 送信を試みるたびに呼ばれる(result: SipfCmdTx()と同じ, timestamp_ms: SipfTxQueuePut()に渡した値) */
+typedef void (*SipfTxQueueCallback)(SipfTxQueue *q, int result, uint64_t timestamp_ms, const uint8_t *otid, void *arg);
+
+/**
+ * 送信待ちのメッセージを記憶領域(SipfStore)に保存して, 送れるようになったら順番に送信する
+ * 電源が切れても保存済みのメッセージは次のSipfTxQueueOpen()で復元される
+ * 送信できてから送信済みを記録するまでの間に電源が切れると, そのメッセージはもう一度送信される
+ */
+struct SipfTxQueue {
+    const SipfStore *store;
+    SipfTxQueuePolicy policy;
+    uint32_t gen;           // 管理情報の世代
+    uint32_t head_off;      // 最も古いメッセージの位置
+    uint32_t head_seq;
+    uint32_t tail_off;      // 次に書く位置
+    uint32_t cnt;           // 保存しているメッセージ数
+    uint32_t dropped;       // いっぱいで, または壊れていて捨てたメッセージ数
+    uint32_t retry_ms;      // 送信に失敗したら待つ時間(失敗が続くとretry_max_msまで倍々に延ばす)
+    uint32_t retry_max_ms;
+    uint32_t cur_retry_ms;
+    uint32_t t_next;        // 次に送信してよい時刻[ms](SipfClientMillis())
+    bool sending;
+    uint64_t sending_ts;
+    SipfReq req;
+    SipfTxBatch batch;
+    uint8_t otid[33];
+    SipfTxQueueCallback cb;
+    void *arg;
+};
+
+int SipfTxQueueOpen(SipfTxQueue *q, const SipfStore *store, SipfTxQueuePolicy policy, SipfTxQueueCallback cb, void *arg);
+int SipfTxQueueClear(SipfTxQueue *q);
+int SipfTxQueuePut(SipfTxQueue *q, const SipfTxBatch *batch, uint64_t timestamp_ms);
+void SipfTxQueuePoll(SipfTxQueue *q);
+uint32_t SipfTxQueueCount(const SipfTxQueue *q);
+uint32_t SipfTxQueueFree(const SipfTxQueue *q);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
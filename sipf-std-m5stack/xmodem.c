@@ -7,12 +7,21 @@
 #include <stdint.h>
 #include <string.h>
 
+#include "sipf_stats.h"
+#include "sipf_transport.h"
 #include "xmodem.h"
 
 #define XMODEM_BLOCK_BN(b) b[1]
 #define XMODEM_BLOCK_BNC(b) b[2]
 #define XMODEM_BLOCK_DATA_P(b) &b[3]
-#define XMODEM_BLOCK_SUM(b) b[131]
+
+#define XMODEM_SOH  (0x01)
+#define XMODEM_STX  (0x02)
+#define XMODEM_EOT  (0x04)
+#define XMODEM_ACK  (0x06)
+#define XMODEM_NAK  (0x15)
+#define XMODEM_CAN  (0x18)
+#define XMODEM_CRC  ('C')
 
 #define LOG_DBG(...)
 #define LOG_INF(...)
@@ -27,6 +36,51 @@ extern int XmodemPutByte(uint8_t b);
 extern int XmodemPut(uint8_t *buff, int sz);
 extern void XmodemDelay(uint32_t delay);
 
+// 転送中の状態はトランスポートと同じくスレッドごと
+static SIPF_THREAD_LOCAL bool recv_crc;   // 受信側: 'C'で開始したのでCRC-16で検査する
+static SIPF_THREAD_LOCAL bool send_crc;   // 送信側: 受信側から'C'で要求された
+static SIPF_THREAD_LOCAL bool send_1k;    // 送信側: CRCモードなら1024Byteブロックを使う
+
+/* CRC-16/XMODEM (多項式0x1021, 初期値0) */
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7, 0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6, 0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485, 0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4, 0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823, 0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12, 0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41, 0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70, 0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f, 0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e, 0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d, 0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c, 0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab, 0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a, 0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9, 0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8, 0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,
+};
+
+/**
+ * CRC-16/XMODEMを計算する
+ */
+uint16_t XmodemCrc16(const uint8_t *data, int len)
+{
+    uint16_t crc = 0;
+    for (int i = 0; i < len; i++) {
+        crc = (crc << 8) ^ crc16_table[(uint8_t)(crc >> 8) ^ data[i]];
+    }
+    return crc;
+}
+
+/**
+ * 受信したブロックのデータ部の長さ(SOH: 128, STX: 1024)
+ */
+int XmodemBlockDataSize(const uint8_t *block)
+{
+    return (block[0] == XMODEM_STX) ? XMODEM_SZ_BLOCK_1K : XMODEM_SZ_BLOCK;
+}
+
 static int xmodem_block_validation(uint8_t *block, uint8_t bn)
 {
     LOG_INF("latest bn: %02x, bn: %02x, bnc: %02x", bn, XMODEM_BLOCK_BN(block), XMODEM_BLOCK_BNC(block));
@@ -47,18 +101,32 @@ static int xmodem_block_validation(uint8_t *block, uint8_t bn)
         return -1;
     }
 
-    // サムチェック
     uint8_t *d = XMODEM_BLOCK_DATA_P(block);
+    int sz = XmodemBlockDataSize(block);
+    if (recv_crc) {
+        // CRCチェック
+        uint16_t crc = XmodemCrc16(d, sz);
+        uint16_t crc_recv = ((uint16_t)d[sz] << 8) | d[sz + 1];
+        if (crc == crc_recv) {
+            LOG_DBG("BN: %d", XMODEM_BLOCK_BN(block));
+            return XMODEM_BLOCK_BN(block);
+        }
+        // CRCが一致しない
+        LOG_ERR("CRC miss match. crc=%04x recv=%04x", crc, crc_recv);
+        return -1;
+    }
+
+    // サムチェック
     uint8_t s = 0;
-    for (int i = 0; i < 128; i++) {
+    for (int i = 0; i < sz; i++) {
         s = s + d[i];
     }
-    if (s == XMODEM_BLOCK_SUM(block)) {
+    if (s == d[sz]) {
         LOG_DBG("BN: %d", XMODEM_BLOCK_BN(block));
         return XMODEM_BLOCK_BN(block);
     } else {
         // サムが一致しない
-        LOG_ERR("SUM miss match. s=%02x sum=%02x", s, XMODEM_BLOCK_SUM(block));
+        LOG_ERR("SUM miss match. s=%02x sum=%02x", s, d[sz]);
         return -1;
     }
 }
@@ -100,13 +168,27 @@ void XmodemEnd(void)
 }
 
 /**
- * 受信開始
+ * 受信開始(チェックサム)
  */
 int XmodemReceiveStart(void)
 {
+    recv_crc = false;
     return xmodemSendNak();
 }
 
+/**
+ * 受信開始(CRC-16)
+ * 送信側が対応していなければ応答がないのでXmodemReceiveStart()で開始しなおす
+ */
+int XmodemReceiveStartCrc(void)
+{
+    recv_crc = true;
+    if (XmodemPutByte(XMODEM_CRC) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * 次ブロック要求
  */
@@ -126,7 +208,7 @@ int XmodemReceiveReqCurrentBlock(void)
 /**
  * ブロック受信
  * [in/out]bn:  受信済みブロックのBlock number
- * [out]block:  受信したブロック
+ * [out]block:  受信したブロック(XMODEM_SZ_FRAME_MAXバイト必要, データ長はXmodemBlockDataSize())
  * [in]time_out:受信タイムアウト
  * return:
  */
@@ -144,14 +226,21 @@ XmodemRecvRet XmodemReceiveBlock(uint8_t *bn, uint8_t *block, int time_out)
         return ret;
     }
 
-    uint8_t idx_block = 0;
+    int idx_block = 0;
+    int sz_frame;
 
     switch (b) {
-    case 0x01: // SOH
+    case XMODEM_SOH:
         // ブロック開始
-        block[idx_block++] = 0x01;
+        block[idx_block++] = b;
+        sz_frame = 3 + XMODEM_SZ_BLOCK + (recv_crc ? 2 : 1);
+        break;
+    case XMODEM_STX:
+        // 1024Byteブロック開始
+        block[idx_block++] = b;
+        sz_frame = 3 + XMODEM_SZ_BLOCK_1K + (recv_crc ? 2 : 1);
         break;
-    case 0x04: // EOT
+    case XMODEM_EOT:
         // 転送終了
         // ACK送信
         if (xmodemSendAck() != 0) {
@@ -159,13 +248,16 @@ XmodemRecvRet XmodemReceiveBlock(uint8_t *bn, uint8_t *block, int time_out)
             return XMODEM_RECV_RET_FAILED;
         }
         return XMODEM_RECV_RET_FINISHED;
-    case 0x18: // CAN
+    case XMODEM_CAN:
         // 中断要求
         return XMODEM_RECV_RET_CANCELED;
+    default:
+        // 想定外のやつ
+        return XMODEM_RECV_RET_RETRY;
     }
 
-    // ブロックの残り131Byteを受信する
-    for (int i = 0; i < 131; i++) {
+    // ブロックの残りを受信する
+    while (idx_block < sz_frame) {
         //キャラ間タイムアウト100[ms]で受信
         ret = XmodemGetByteTimeout(&b, 100);
         if (ret == 0) {
@@ -206,36 +298,83 @@ int XmodemTransmitCancel(void)
     return 0;
 }
 
+/**
+ * CRCモードのときに1024Byteブロックを使うか
+ */
+void XmodemSetBlock1k(bool enable)
+{
+    send_1k = enable;
+}
+
+/**
+ * 送信するブロックのデータ長
+ * 1024Byteブロックは受信側が'C'で要求したとき(CRCモード)だけ使う
+ */
+int XmodemSendBlockSize(void)
+{
+    return (send_crc && send_1k) ? XMODEM_SZ_BLOCK_1K : XMODEM_SZ_BLOCK;
+}
+
+/**
+ * 受信側がCRCモードを要求したか
+ */
+bool XmodemSendIsCrc(void)
+{
+    return send_crc;
+}
+
 /**
  * 送信要求待ち
+ * 受信側の開始要求('C'ならCRC-16, NAKならチェックサム)でモードを決める
  */
 XmodemSendRet XmodemSendWaitRequest(int time_out)
 {
     int ret;
     uint8_t b;
+    bool in_line = false;
+    uint32_t t_start = SipfTransportMillis();
 
-    for (int i = 0; i < 10; i++) {
+    for (int i = 0; i < 10;) {
+        // エコーバックや雑音が途切れずに届き続けても全体でtime_outまでしか待たない
+        if ((uint32_t)(SipfTransportMillis() - t_start) >= (uint32_t)time_out) {
+            break;
+        }
         ret = XmodemGetByteTimeout(&b, time_out / 10);
         // timeoutとか見る
         if (ret < 0) {
             if (ret == -3) {
                 LOG_INF("UartBrokerByteTm() timeout.");
+                SIPF_STATS_ADD(xmodem_tmout, 1);
+                i++;
                 continue;
             }
             return XMODEM_SEND_RET_FAILED;
         }
 
+        if (in_line) {
+            // コマンドのエコーバックの途中('C'が含まれていても要求ではない)
+            if ((b == '\r') || (b == '\n')) {
+                in_line = false;
+            }
+            continue;
+        }
         switch (b) {
+        case XMODEM_CRC: // 'C'(CRCモードで送信要求)
+            send_crc = true;
+            return XMODEM_SEND_RET_OK;
         case 0x15: // NAK(送信要求)
+            send_crc = false;
             return XMODEM_SEND_RET_OK;
             break;
         case 0x18: // CAN(キャンセル)
+            SIPF_STATS_ADD(xmodem_can, 1);
             return XMODEM_SEND_RET_CANCELED;
             break;
-        default: // 想定外のやつ
+        case '$': // エコーバックの始まり
+            in_line = true;
+            break;
+        default: // 想定外のやつは読み飛ばす
             LOG_INF("Invalid response: %02x", b);
-            while (XmodemGetByte(&b) == 0);	//ゴミ捨て
-            XmodemDelay(time_out / 10);
             break;
         }
     }
@@ -261,6 +400,7 @@ XmodemSendRet XmodemSendEnd(int time_out)
     if (ret < 0) {
         if (ret == -3) {
             // タイムアウト
+            SIPF_STATS_ADD(xmodem_tmout, 1);
             return XMODEM_SEND_RET_TIMEOUT;
         }
         return XMODEM_SEND_RET_FAILED;
@@ -275,53 +415,103 @@ XmodemSendRet XmodemSendEnd(int time_out)
 }
 
 /**
- * ブロック送信
+ * ブロックを組み立てる
+ * データはframe+XMODEM_FRAME_DATA_OFSに置いておく(足りない分はパディングする)
+ * return: フレームの長さ, -1: データが長すぎる
  */
-XmodemSendRet XmodemSendBlock(uint8_t *bn, uint8_t *payload, int sz_payload, int time_out)
+int XmodemFrameBlock(uint8_t *frame, uint8_t bn, int sz_payload)
 {
-    int ret;
-    static uint8_t block[132];
+    int sz_data = XmodemSendBlockSize();
 
-    if (sz_payload > 128) {
-        return XMODEM_SEND_RET_FAILED;
+    if (sz_payload > sz_data) {
+        return -1;
+    }
+    if ((sz_data == XMODEM_SZ_BLOCK_1K) && (sz_payload <= XMODEM_SZ_BLOCK)) {
+        // 短い最終ブロックは128Byteで送る
+        sz_data = XMODEM_SZ_BLOCK;
     }
 
-    memset(block, 0x1a, sizeof(block)); // 先にパディングのEOFで埋めておく
-
-    block[0] = 0x01;                        // SOH
-    block[1] = *bn;                         // BN
-    block[2] = ~*bn;                        // BNC
-    memcpy(&block[3], payload, sz_payload); // DATA
-    block[131] = 0;                         // SUM
-    for (int i = 3; i < 131; i++) {
-        block[131] += block[i];
+    frame[0] = (sz_data == XMODEM_SZ_BLOCK_1K) ? XMODEM_STX : XMODEM_SOH;
+    frame[1] = bn;                          // BN
+    frame[2] = ~bn;                         // BNC
+    memset(&frame[3 + sz_payload], 0x1a, sz_data - sz_payload); // パディングのEOF
+    int sz_frame = 3 + sz_data;
+    if (send_crc) {
+        uint16_t crc = XmodemCrc16(&frame[3], sz_data);
+        frame[sz_frame++] = crc >> 8;       // CRC
+        frame[sz_frame++] = crc & 0xff;
+    } else {
+        uint8_t sum = 0;                    // SUM
+        for (int i = 3; i < 3 + sz_data; i++) {
+            sum += frame[i];
+        }
+        frame[sz_frame++] = sum;
     }
+    return sz_frame;
+}
 
-    ret = XmodemPut(block, 132);
-    if (ret < 0) {
+/**
+ * 組み立て済みのブロックを送る(応答は待たない)
+ */
+XmodemSendRet XmodemSendFrame(const uint8_t *frame, int sz_frame)
+{
+    if (XmodemPut((uint8_t*)frame, sz_frame) < 0) {
         return XMODEM_SEND_RET_FAILED;
     }
+    return XMODEM_SEND_RET_OK;
+}
 
-    // 応答を待つ
+/**
+ * 送ったブロックへの応答を待つ
+ */
+XmodemSendRet XmodemSendWaitAck(int time_out)
+{
+    int ret;
     uint8_t b;
-    ret = XmodemGetByteTimeout(&b, time_out);
-    if (ret == -3) {
-    	LOG_ERR("XmodemGetByteTimeout() timeout.");
-        return XMODEM_SEND_RET_TIMEOUT;
-    } else if (ret < 0) {
-    	LOG_ERR("XmodemGetByteTimeout() failed.");
-        return XMODEM_SEND_RET_FAILED;
-    }
+    do {
+        ret = XmodemGetByteTimeout(&b, time_out);
+        if (ret == -3) {
+            LOG_ERR("XmodemGetByteTimeout() timeout.");
+            SIPF_STATS_ADD(xmodem_tmout, 1);
+            return XMODEM_SEND_RET_TIMEOUT;
+        } else if (ret < 0) {
+            LOG_ERR("XmodemGetByteTimeout() failed.");
+            return XMODEM_SEND_RET_FAILED;
+        }
+    } while (b == XMODEM_CRC);  // 開始要求の'C'が重ねて来ることがある
 
     LOG_DBG("Received: %02x", b);
     if (b == 0x06) { // ACK
         return XMODEM_SEND_RET_OK;
     } else if (b == 0x15) { // NAK
+        SIPF_STATS_ADD(xmodem_nak, 1);
         return XMODEM_SEND_RET_RETRY;
     } else if (b == 0x18) { // CAN
+        SIPF_STATS_ADD(xmodem_can, 1);
         return XMODEM_SEND_RET_CANCELED;
     } else {
         // 想定外のなにか来た
         return XMODEM_SEND_RET_FAILED;
     }
 }
+
+/**
+ * ブロック送信
+ */
+XmodemSendRet XmodemSendBlock(uint8_t *bn, uint8_t *payload, int sz_payload, int time_out)
+{
+    static uint8_t block[XMODEM_SZ_FRAME_MAX];
+
+    if ((sz_payload < 0) || (sz_payload > XmodemSendBlockSize())) {
+        return XMODEM_SEND_RET_FAILED;
+    }
+    memcpy(&block[XMODEM_FRAME_DATA_OFS], payload, sz_payload); // DATA
+    int sz_frame = XmodemFrameBlock(block, *bn, sz_payload);
+
+    XmodemSendRet ret = XmodemSendFrame(block, sz_frame);
+    if (ret != XMODEM_SEND_RET_OK) {
+        return ret;
+    }
+    // 応答を待つ
+    return XmodemSendWaitAck(time_out);
+}
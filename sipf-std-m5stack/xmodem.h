@@ -10,7 +10,13 @@
 extern "C" {
 #endif
 
-#define XMODEM_SZ_BLOCK (128)
+#include <stdbool.h>
+#include <stdint.h>
+
+#define XMODEM_SZ_BLOCK     (128)
+#define XMODEM_SZ_BLOCK_1K  (1024)
+#define XMODEM_SZ_FRAME_MAX (3 + XMODEM_SZ_BLOCK_1K + 2)    // STX, BN, BNC, DATA, CRC16
+#define XMODEM_FRAME_DATA_OFS   (3)                         // フレーム内のDATAの位置
 
 typedef enum xmodem_recv_ret {
     XMODEM_RECV_RET_OK,
@@ -30,18 +36,28 @@ typedef enum xmodem_send_ret {
     XMODEM_SEND_RET_TIMEOUT = -2,
 } XmodemSendRet;
 
+uint16_t XmodemCrc16(const uint8_t *data, int len);
+int XmodemBlockDataSize(const uint8_t *block);
+
 void XmodemBegin(void);
 void XmodemEnd(void);
 
 int XmodemTransmitCancel(void);
 
 int XmodemReceiveStart(void);
+int XmodemReceiveStartCrc(void);
 XmodemRecvRet XmodemReceiveBlock(uint8_t *bn, uint8_t *block, int time_out);
 int XmodemReceiveReqNextBlock(void);
 int XmodemReceiveReqCurrentBlock(void);
 
+void XmodemSetBlock1k(bool enable);
+int XmodemSendBlockSize(void);
+bool XmodemSendIsCrc(void);
 XmodemSendRet XmodemSendWaitRequest(int time_out);
 XmodemSendRet XmodemSendEnd(int time_out);
+int XmodemFrameBlock(uint8_t *frame, uint8_t bn, int sz_payload);
+XmodemSendRet XmodemSendFrame(const uint8_t *frame, int sz_frame);
+XmodemSendRet XmodemSendWaitAck(int time_out);
 XmodemSendRet XmodemSendBlock(uint8_t *bn, uint8_t *payload, int sz_payload, int time_out);
 
 #ifdef __cplusplus
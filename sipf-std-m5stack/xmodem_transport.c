@@ -4,19 +4,18 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <Arduino.h>
 #include <stdint.h>
 
-extern "C" {
+#include "sipf_transport.h"
 
 int XmodemGetByte(uint8_t *b)
 {
-  int len = Serial2.available();
+  int len = SipfTransportAvailable();
   if (len == 0) {
     return -1;  //EMPTY
   }
 
-  int ret = Serial2.read();
+  int ret = SipfTransportReadByte();
   if (ret < 0) {
     return -1;  //ERROR
   }
@@ -28,24 +27,20 @@ int XmodemGetByte(uint8_t *b)
 
 int XmodemGetByteTimeout(uint8_t *b, uint32_t timeout)
 {
-  int ret, len;
+  int ret;
   uint32_t t_recved, t_now;
 
-  t_recved = millis();
+  t_recved = SipfTransportMillis();
   for (;;) {
-    t_now = millis();
+    t_now = SipfTransportMillis();
     //タイムアウト判定
     if ((int32_t)((t_recved + timeout) - t_now) < 0) {
         //タイムアウト
         return -3;
     }
 
-    len = Serial2.available();
-    if (len > 0) {
-      ret = Serial2.read();
-      if (ret < 0) {
-        return -1;  // ERROR
-      }
+    ret = SipfTransportReadByte();
+    if (ret >= 0) {
       *b = (uint8_t)ret;
       return 0; // OK
     }
@@ -55,7 +50,7 @@ int XmodemGetByteTimeout(uint8_t *b, uint32_t timeout)
 int XmodemPutByte(uint8_t b)
 {
   int ret;
-  ret = Serial2.write(b);
+  ret = SipfTransportWrite(&b, 1);
   if (ret < 0) {
     return -1;
   }
@@ -65,7 +60,7 @@ int XmodemPutByte(uint8_t b)
 int XmodemPut(uint8_t *buff, int sz)
 {
   int ret;
-  ret = Serial2.write(buff, sz);
+  ret = SipfTransportWrite(buff, sz);
   if (ret < 0) {
     return -1;
   }
@@ -74,8 +69,5 @@ int XmodemPut(uint8_t *buff, int sz)
 
 void XmodemDelay(uint32_t d)
 {
-  delay(d);
-}
-  
+  SipfTransportDelay(d);
 }
-
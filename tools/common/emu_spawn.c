@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * ツール共通: エミュレータ(tools/sipf_emu)の起動と停止
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emu_spawn.h"
+#include "sipf_client.h"
+
+#define EMU_ARGS_MAX    (32)
+
+/**
+ * エミュレータを起動してemu->trでつなぐ(起動完了はEmuSpawnWaitReady()で待つ)
+ * args: "-f <fd>"の後ろに渡す引数(NULL終端. NULLなら何も渡さない)
+ * return: 0: 成功, -1: 失敗
+ */
+int EmuSpawnStart(EmuSpawn *emu, const char *emu_path, const char *const *args)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return -1;
+    }
+    // 後から起動するエミュレータにこちら側を持たせない(持たれると切断が伝わらない)
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    pid_t pid = fork();
+    if (pid == 0) {
+        char fd[16];
+        const char *argv[EMU_ARGS_MAX];
+        int argc = 0;
+        close(sv[0]);
+        snprintf(fd, sizeof(fd), "%d", sv[1]);
+        argv[argc++] = "sipf_emu";
+        argv[argc++] = "-f";
+        argv[argc++] = fd;
+        for (int i = 0; (args != NULL) && (args[i] != NULL) && (argc < (EMU_ARGS_MAX - 1)); i++) {
+            argv[argc++] = args[i];
+        }
+        argv[argc] = NULL;
+        execv(emu_path, (char * const *)argv);
+        _exit(1);
+    }
+    close(sv[1]);
+    if (pid < 0) {
+        close(sv[0]);
+        return -1;
+    }
+    emu->pid = pid;
+    SipfTransportPosixAttach(&emu->tr, &emu->posix, sv[0]);
+    return 0;
+}
+
+/**
+ * 今のトランスポートで"+++ Ready +++"が来るまで待つ
+ * return: 0: 起動した, -1: 3秒以上何も来ない
+ */
+int EmuSpawnWaitReady(void)
+{
+    uint8_t buf[128];
+    for (;;) {
+        if (SipfUtilReadLine(buf, sizeof(buf), 3000) < 0) {
+            return -1;
+        }
+        if (memcmp(buf, "+++ Ready +++", 13) == 0) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * エミュレータを止める(切断するとエミュレータは終了する)
+ * return: エミュレータのCPU時間[us]
+ */
+uint64_t EmuSpawnStop(EmuSpawn *emu)
+{
+    // Attachしたfdは自分で閉じる
+    close(emu->posix.fd);
+    SipfTransportPosixClose(&emu->posix);
+    struct rusage ru;
+    if (wait4(emu->pid, NULL, 0, &ru) < 0) {
+        return 0;
+    }
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+uint64_t EmuNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
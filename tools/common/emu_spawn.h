@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _EMU_SPAWN_H_
+#define _EMU_SPAWN_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sipf_transport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * ツールから起動したエミュレータ(tools/sipf_emu)
+ * socketpairの片側をエミュレータに渡し, もう片側をトランスポートにする
+ */
+typedef struct {
+    pid_t pid;
+    SipfTransport tr;
+    SipfTransportPosix posix;
+}   EmuSpawn;
+
+int EmuSpawnStart(EmuSpawn *emu, const char *emu_path, const char *const *args);
+int EmuSpawnWaitReady(void);
+uint64_t EmuSpawnStop(EmuSpawn *emu);
+uint64_t EmuNowUs(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * SIPFクライアントのベンチマーク
+ * エミュレータ(tools/sipf_emu)をsocketpairでつないで起動し, コマンドごとに
+ * ops/s, レイテンシ(p50/p99/max), 1回あたりの送受信バイト数とCPU時間を測る
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c $S/sipf_transport.c \
+ *      $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_bench main.cpp $S/sipf_client.cpp *.o -lm
+ *
+ * 使い方:
+ *   sipf_bench [-e emu_path] [-r byte_rate] [-d resp_delay_ms] [-x err_permille]
+ *              [-n count] [-f fput_count] [-s fput_size] [-b bench,...] [-j]
+ *   -b: tx, rx, gnss, fput-sum, fput-crc, fput-1k (指定しない場合は全部)
+ *   -j: 結果を1ベンチ1行のJSONで出す
+ *   CPU時間はクライアント(このプロセス)とエミュレータのuser+sys
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "../common/emu_spawn.h"
+#include "sipf_client.h"
+#include "sipf_transport.h"
+#include "xmodem.h"
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+static uint32_t byte_rate = 11520;  // 115200bps相当
+static uint32_t resp_delay_ms = 0;
+static uint32_t err_permille = 0;
+static bool json = false;
+
+static EmuSpawn emu;
+
+/*
+ * 送受信したバイト数を数えるトランスポート(posixのトランスポートをくるむ)
+ */
+typedef struct {
+    const SipfTransport *inner;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+}   WireCounter;
+
+static WireCounter wire;
+static SipfTransport wire_tr;
+
+static int wireAvailable(void *ctx)
+{
+    WireCounter *w = (WireCounter*)ctx;
+    return w->inner->available(w->inner->ctx);
+}
+
+static int wireRead(void *ctx, uint8_t *buff, int len)
+{
+    WireCounter *w = (WireCounter*)ctx;
+    int ret = w->inner->read(w->inner->ctx, buff, len);
+    if (ret > 0) {
+        w->bytes_in += ret;
+    }
+    return ret;
+}
+
+static int wireWrite(void *ctx, const uint8_t *buff, int len)
+{
+    WireCounter *w = (WireCounter*)ctx;
+    int ret = w->inner->write(w->inner->ctx, buff, len);
+    if (ret > 0) {
+        w->bytes_out += ret;
+    }
+    return ret;
+}
+
+static uint32_t wireMillis(void *ctx)
+{
+    WireCounter *w = (WireCounter*)ctx;
+    return w->inner->millis(w->inner->ctx);
+}
+
+static uint32_t wireMicros(void *ctx)
+{
+    WireCounter *w = (WireCounter*)ctx;
+    return w->inner->micros(w->inner->ctx);
+}
+
+static void wireDelay(void *ctx, uint32_t ms)
+{
+    WireCounter *w = (WireCounter*)ctx;
+    w->inner->delay(w->inner->ctx, ms);
+}
+
+static uint64_t cpuUs(const struct rusage *ru)
+{
+    return (uint64_t)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000 + ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
+/**
+ * エミュレータを起動して起動完了まで待つ
+ * script: シナリオファイル(NULLなら指定しない)
+ */
+static pid_t startEmu(bool crc, const char *script)
+{
+    char rate[16], delay[16], err[16];
+    const char *args[16];
+    int argc = 0;
+    snprintf(rate, sizeof(rate), "%u", byte_rate);
+    snprintf(delay, sizeof(delay), "%u", resp_delay_ms);
+    snprintf(err, sizeof(err), "%u", err_permille);
+    args[argc++] = "-r";
+    args[argc++] = rate;
+    args[argc++] = "-d";
+    args[argc++] = delay;
+    args[argc++] = "-x";
+    args[argc++] = err;
+    if (crc) {
+        args[argc++] = "-c";
+    }
+    if (script != NULL) {
+        args[argc++] = "-s";
+        args[argc++] = script;
+    }
+    args[argc] = NULL;
+    if (EmuSpawnStart(&emu, emu_path, args) != 0) {
+        return -1;
+    }
+    wire.inner = &emu.tr;
+    wire_tr.ctx = &wire;
+    wire_tr.available = wireAvailable;
+    wire_tr.read = wireRead;
+    wire_tr.write = wireWrite;
+    wire_tr.millis = wireMillis;
+    wire_tr.micros = wireMicros;
+    wire_tr.delay = wireDelay;
+    SipfTransportSet(&wire_tr);
+    return (EmuSpawnWaitReady() == 0) ? emu.pid : -1;
+}
+
+/*
+ * 計測するコマンド
+ */
+typedef struct {
+    const char *name;
+    bool crc;                       // XMODEMをCRC-16で始める
+    const char *script;             // エミュレータのシナリオ(NULLなら無し)
+    int (*setup)(void);             // 計測前の準備(NULLなら無し)
+    int (*op)(void);                // 1回分. 0: 成功
+}   BenchDef;
+
+static size_t fput_size = 16 * 1024;
+static uint8_t *fput_body;
+
+static int opTx(void)
+{
+    static uint32_t value;
+    uint8_t otid[33];
+    value++;
+    return SipfCmdTx(0x01, OBJ_TYPE_UINT32, (uint8_t*)&value, sizeof(value), otid);
+}
+
+static int opRx(void)
+{
+    uint8_t otid[33];
+    uint64_t user_send_datetime_ms, sipf_recv_datetime_ms;
+    uint8_t remain, obj_cnt;
+    SipfObjObject objs[16];
+    int ret = SipfCmdRx(otid, &user_send_datetime_ms, &sipf_recv_datetime_ms, &remain, &obj_cnt, objs, 16);
+    return (ret > 0) ? 0 : -1;
+}
+
+static int setupGnss(void)
+{
+    // エラーを入れているときはNGになることがあるので何度か試す
+    for (int i = 0; i < 10; i++) {
+        if (SipfSetGnss(true) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int opGnss(void)
+{
+    GnssLocation loc;
+    return SipfGetGnssLocation(&loc);
+}
+
+static int setupFputSum(void)
+{
+    SipfSetFputBlock1k(false);
+    return 0;
+}
+
+static int setupFput1k(void)
+{
+    SipfSetFputBlock1k(true);
+    return 0;
+}
+
+static int opFput(void)
+{
+    return SipfCmdFput((char*)"bench.bin", fput_body, fput_size);
+}
+
+static const char *rx_script =
+    "rxloop 1\n"
+    "rx 01 04 78563412 02 09 0000000000000840 03 20 48656C6C6F\n";
+static const char *gnss_script =
+    "gnss A,139.745433,35.658581,40.000000,0.000000,0.000000,2022-01-01T00:00:00Z\n";
+
+static const BenchDef benches[] = {
+    { "tx",       false, NULL,        NULL,         opTx },
+    { "rx",       false, rx_script,   NULL,         opRx },
+    { "gnss",     false, gnss_script, setupGnss,    opGnss },
+    { "fput-sum", false, NULL,        setupFputSum, opFput },
+    { "fput-crc", true,  NULL,        setupFputSum, opFput },
+    { "fput-1k",  true,  NULL,        setupFput1k,  opFput },
+};
+
+static int writeScript(const char *body, char *path, size_t path_len)
+{
+    snprintf(path, path_len, "/tmp/sipf_bench_XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t len = strlen(body);
+    int ret = (write(fd, body, len) == (ssize_t)len) ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+static int runBench(const BenchDef *b, int cnt)
+{
+    char script[64] = "";
+    if ((b->script != NULL) && (writeScript(b->script, script, sizeof(script)) != 0)) {
+        fprintf(stderr, "%s: failed to write script\n", b->name);
+        return -1;
+    }
+    pid_t pid = startEmu(b->crc, (b->script != NULL) ? script : NULL);
+    if (script[0] != '\0') {
+        unlink(script);
+    }
+    if (pid < 0) {
+        fprintf(stderr, "%s: failed to start %s\n", b->name, emu_path);
+        return -1;
+    }
+    if ((b->setup != NULL) && (b->setup() != 0)) {
+        fprintf(stderr, "%s: setup failed\n", b->name);
+        EmuSpawnStop(&emu);
+        return -1;
+    }
+
+    uint32_t *lat = (uint32_t*)malloc(sizeof(uint32_t) * cnt);
+    int ok = 0, ng = 0;
+    struct rusage ru0, ru1;
+    wire.bytes_in = 0;
+    wire.bytes_out = 0;
+    getrusage(RUSAGE_SELF, &ru0);
+    uint64_t t_start = EmuNowUs();
+    for (int i = 0; i < cnt; i++) {
+        uint64_t t0 = EmuNowUs();
+        if (b->op() != 0) {
+            ng++;
+            continue;
+        }
+        lat[ok++] = (uint32_t)(EmuNowUs() - t0);
+    }
+    uint64_t t_wall = EmuNowUs() - t_start;
+    getrusage(RUSAGE_SELF, &ru1);
+    uint64_t bytes_in = wire.bytes_in, bytes_out = wire.bytes_out;
+    SipfFputTiming timing;
+    SipfFputGetTiming(&timing);
+    uint64_t emu_cpu = EmuSpawnStop(&emu);
+    uint64_t cpu = cpuUs(&ru1) - cpuUs(&ru0);
+
+    if (ok == 0) {
+        printf(json ? "{\"bench\":\"%s\",\"n\":%d,\"ok\":0,\"ng\":%d}\n" : "%-8s n=%d all failed (ng=%d)\n",
+               b->name, cnt, ng);
+        free(lat);
+        return -1;
+    }
+    std::sort(lat, lat + ok);
+    uint32_t p50 = lat[(ok - 1) * 50 / 100];
+    uint32_t p99 = lat[(ok - 1) * 99 / 100];
+    uint32_t lmax = lat[ok - 1];
+    free(lat);
+    double ops = ok * 1e6 / t_wall;
+    int n = ok + ng;    // 失敗した回の通信とCPU時間も含めて1回あたりにする
+
+    if (json) {
+        printf("{\"bench\":\"%s\",\"n\":%d,\"ok\":%d,\"ng\":%d,\"ops_per_s\":%.2f,"
+               "\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u,"
+               "\"bytes_out_per_op\":%.1f,\"bytes_in_per_op\":%.1f,"
+               "\"cpu_us_per_op\":%.1f,\"emu_cpu_us_per_op\":%.1f,"
+               "\"byte_rate\":%u,\"resp_delay_ms\":%u,\"err_permille\":%u}\n",
+               b->name, n, ok, ng, ops, p50, p99, lmax,
+               (double)bytes_out / n, (double)bytes_in / n,
+               (double)cpu / n, (double)emu_cpu / n,
+               byte_rate, resp_delay_ms, err_permille);
+    } else {
+        printf("%-8s n=%d ng=%d %.1f ops/s p50=%.2fms p99=%.2fms max=%.2fms out=%.0fB in=%.0fB cpu=%.0fus emu_cpu=%.0fus (per op)\n",
+               b->name, n, ng, ops, p50 / 1000.0, p99 / 1000.0, lmax / 1000.0,
+               (double)bytes_out / n, (double)bytes_in / n, (double)cpu / n, (double)emu_cpu / n);
+        if (b->op == opFput) {
+            // 最後の転送のブロック送信間隔の内訳
+            printf("         write=%.1fms prepare=%.1fms wait_ack=%.1fms (last transfer, %.2fKB/s)\n",
+                   timing.us_write / 1000.0, timing.us_prepare / 1000.0, timing.us_wait / 1000.0,
+                   (double)fput_size * 1000 / p50);
+        }
+    }
+    fflush(stdout);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int cnt = 1000;
+    int fput_cnt = 5;
+    const char *list = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:r:d:x:n:f:s:b:j")) != -1) {
+        switch (opt) {
+        case 'e':
+            emu_path = optarg;
+            break;
+        case 'r':
+            byte_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            resp_delay_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            err_permille = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            cnt = atoi(optarg);
+            break;
+        case 'f':
+            fput_cnt = atoi(optarg);
+            break;
+        case 's':
+            fput_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            list = optarg;
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e emu_path] [-r byte_rate] [-d resp_delay_ms] [-x err_permille]"
+                    " [-n count] [-f fput_count] [-s fput_size] [-b bench,...] [-j]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ((cnt <= 0) || (fput_cnt <= 0)) {
+        fprintf(stderr, "count must be > 0\n");
+        return 1;
+    }
+
+    fput_body = (uint8_t*)malloc(fput_size);
+    for (size_t i = 0; i < fput_size; i++) {
+        fput_body[i] = (uint8_t)rand();
+    }
+
+    int ret = 0;
+    int found = 0;
+    for (size_t i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        const BenchDef *b = &benches[i];
+        if (list != NULL) {
+            // カンマ区切りの中に名前があるか
+            size_t len = strlen(b->name);
+            const char *p = list;
+            bool hit = false;
+            while ((p = strstr(p, b->name)) != NULL) {
+                if (((p == list) || (p[-1] == ',')) && ((p[len] == '\0') || (p[len] == ','))) {
+                    hit = true;
+                    break;
+                }
+                p += len;
+            }
+            if (!hit) {
+                continue;
+            }
+        }
+        found++;
+        ret |= runBench(b, (b->op == opFput) ? fput_cnt : cnt);
+    }
+    free(fput_body);
+    if (found == 0) {
+        fprintf(stderr, "no such bench: %s\n", list);
+        return 1;
+    }
+    return (ret == 0) ? 0 : 1;
+}
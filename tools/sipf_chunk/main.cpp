@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * チャンク分割アップロード(sipf_chunk.c)の組み立てと確認
+ *   -a: モジュールから受け取ったマニフェストとチャンクから元のファイルを組み立てる(CRC-32を確かめる)
+ *   それ以外: fileをエミュレータ(tools/sipf_emu)へチャンクに分けて送り, -oのディレクトリで組み立てて元と比べる
+ *     -kを指定するとk個目のXMODEMブロックを送ったところでエミュレータを止めて(転送の途中で切れたことにする),
+ *     進み具合の記録から開き直して(再起動したことにする)続きを送る
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_chunk.c $S/sipf_store_posix.c $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c \
+ *      $S/sipf_transport.c $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_chunk main.cpp $S/sipf_client.cpp *.o -lm
+ *
+ * 使い方:
+ *   sipf_chunk -a dir file_id out
+ *   sipf_chunk [-e emu_path] [-r byte_rate] [-c chunk_size] [-z] [-k kill_block] [-o out_dir] [-p progress_path] file
+ *   -z: チャンクを圧縮して送る(SipfCmdFputLzMeasured())
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "../common/emu_spawn.h"
+#include "sipf_chunk.h"
+#include "sipf_client.h"
+#include "sipf_crc.h"
+#include "sipf_lz.h"
+#include "sipf_store.h"
+#include "sipf_transport.h"
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+static uint32_t byte_rate = 11520;  // 115200bps相当
+
+static EmuSpawn emu;
+static SipfLzEncoder lz;
+
+static bool readFile(const std::string &path, std::vector<uint8_t> &out)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    out.clear();
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out.insert(out.end(), buf, buf + n);
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * マニフェストとチャンクから元のファイルを組み立てる
+ * return: 0: 成功, -1: マニフェストが無い・チャンクが無いか壊れている
+ */
+static int assemble(const char *dir, const char *file_id, std::vector<uint8_t> &out)
+{
+    std::string base = std::string(dir) + "/";
+    std::vector<uint8_t> man;
+    if (!readFile(base + file_id + SIPF_CHUNK_MANIFEST_SUFFIX, man)) {
+        fprintf(stderr, "%s%s: no manifest\n", file_id, SIPF_CHUNK_MANIFEST_SUFFIX);
+        return -1;
+    }
+    man.push_back('\0');
+
+    char id[128];
+    unsigned long sz_file = 0, sz_chunk, cnt = 0, got = 0;
+    int ret = 0;
+    char *save = NULL;
+    for (char *line = strtok_r((char*)man.data(), "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        unsigned long idx, off, sz, crc;
+        if (strcmp(line, "SIPF-CHUNKED 1") == 0) {
+            continue;
+        }
+        if (sscanf(line, "file %127s %lu %lu %lu", id, &sz_file, &sz_chunk, &cnt) == 4) {
+            out.assign(sz_file, 0);
+            continue;
+        }
+        if ((sscanf(line, "chunk %lu %127s %lu %lu %lx", &idx, id, &off, &sz, &crc) != 5) || ((off + sz) > sz_file)) {
+            fprintf(stderr, "%s: bad manifest line: %s\n", file_id, line);
+            return -1;
+        }
+        std::vector<uint8_t> body;
+        if (!readFile(base + id, body)) {
+            fprintf(stderr, "%s: missing\n", id);
+            ret = -1;
+            continue;
+        }
+        size_t len_id = strlen(id), len_sfx = strlen(SIPF_LZ_FILE_SUFFIX);
+        if ((len_id > len_sfx) && (strcmp(&id[len_id - len_sfx], SIPF_LZ_FILE_SUFFIX) == 0)) {
+            std::vector<uint8_t> orig(sz);
+            if (SipfLzDecode(body.data(), body.size(), orig.data(), orig.size()) != (int32_t)sz) {
+                fprintf(stderr, "%s: broken\n", id);
+                ret = -1;
+                continue;
+            }
+            body.swap(orig);
+        }
+        if ((body.size() < sz) || (SipfCrc32(0, body.data(), (int)sz) != crc)) {
+            fprintf(stderr, "%s: size or CRC mismatch\n", id);
+            ret = -1;
+            continue;
+        }
+        memcpy(&out[off], body.data(), sz);
+        got++;
+    }
+    if (got != cnt) {
+        fprintf(stderr, "%s: %lu/%lu chunks\n", file_id, got, cnt);
+        ret = -1;
+    }
+    return ret;
+}
+
+/**
+ * エミュレータを起動して起動完了まで待つ
+ */
+static pid_t startEmu(const char *out_dir)
+{
+    char rate[16];
+    snprintf(rate, sizeof(rate), "%u", byte_rate);
+    const char *args[] = { "-r", rate, "-o", out_dir, NULL };
+    if (EmuSpawnStart(&emu, emu_path, args) != 0) {
+        return -1;
+    }
+    SipfTransportSet(&emu.tr);
+    return (EmuSpawnWaitReady() == 0) ? emu.pid : -1;
+}
+
+static pid_t emu_pid;
+static uint32_t kill_block;     // このブロック数を送ったらエミュレータを止める(0なら止めない)
+static uint32_t blocks;
+static bool interrupted;
+static uint32_t chunks_sent;
+
+static void onBlock(const SipfFputBlockTiming *timing, void *arg)
+{
+    if ((timing->retry == 0) && (++blocks == kill_block)) {
+        kill(emu_pid, SIGKILL);
+    }
+}
+
+static void onChunk(SipfChunkUpload *up, uint32_t idx, int result, void *arg)
+{
+    if (idx == up->cnt_chunk) {
+        printf("  manifest: %d\n", result);
+    } else {
+        printf("  chunk %u/%u: %d\n", idx + 1, up->cnt_chunk, result);
+    }
+    if (result == 0) {
+        chunks_sent++;
+    } else {
+        interrupted = true;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *progress_path = "/tmp/sipf_chunk_progress.bin";
+    const char *out_dir = NULL;
+    uint32_t sz_chunk = 16 * 1024;
+    bool use_lz = false;
+    bool assemble_only = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ae:r:c:zk:o:p:")) != -1) {
+        switch (opt) {
+        case 'a':
+            assemble_only = true;
+            break;
+        case 'e':
+            emu_path = optarg;
+            break;
+        case 'r':
+            byte_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            sz_chunk = strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            use_lz = true;
+            break;
+        case 'k':
+            kill_block = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            out_dir = optarg;
+            break;
+        case 'p':
+            progress_path = optarg;
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (assemble_only) {
+        if ((argc - optind) != 3) {
+            fprintf(stderr, "usage: %s -a dir file_id out\n", argv[0]);
+            return 1;
+        }
+        std::vector<uint8_t> body;
+        if (assemble(argv[optind], argv[optind + 1], body) != 0) {
+            return 1;
+        }
+        FILE *fp = fopen(argv[optind + 2], "wb");
+        if ((fp == NULL) || (fwrite(body.data(), 1, body.size(), fp) != body.size())) {
+            perror(argv[optind + 2]);
+            return 1;
+        }
+        fclose(fp);
+        return 0;
+    }
+    if ((argc - optind) != 1) {
+        fprintf(stderr, "usage: %s [-e emu_path] [-r byte_rate] [-c chunk_size] [-z] [-k kill_block] [-o out_dir] "
+                        "[-p progress_path] file\n", argv[0]);
+        return 1;
+    }
+
+    const char *path = argv[optind];
+    std::vector<uint8_t> orig;
+    if (!readFile(path, orig)) {
+        perror(path);
+        return 1;
+    }
+    char tmp_dir[] = "/tmp/sipf_chunk.XXXXXX";
+    if ((out_dir == NULL) && ((out_dir = mkdtemp(tmp_dir)) == NULL)) {
+        perror(tmp_dir);
+        return 1;
+    }
+    struct stat st;
+    if (stat(out_dir, &st) != 0) {
+        perror(out_dir);
+        return 1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s: not a directory\n", out_dir);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    remove(progress_path);
+
+    // 送るファイルと進み具合の記録
+    SipfStore src, progress;
+    SipfStorePosix src_file, progress_file;
+    if ((SipfStorePosixOpen(&src, &src_file, path, orig.size()) != 0) ||
+        (SipfStorePosixOpen(&progress, &progress_file, progress_path, 64 * 1024) != 0)) {
+        fprintf(stderr, "failed to open stores\n");
+        return 1;
+    }
+    SipfSetFputTimingHook(onBlock, NULL);
+
+    const char *file_id = "upload";
+    uint64_t t0 = EmuNowUs();
+    for (int session = 1;; session++) {
+        // 起動するたびに記録から開き直す
+        SipfChunkUpload up;
+        if (SipfChunkOpen(&up, &progress, &src, orig.size(), file_id, sz_chunk, use_lz ? &lz : NULL, onChunk, NULL) != 0) {
+            fprintf(stderr, "SipfChunkOpen() failed\n");
+            return 1;
+        }
+        if (SipfChunkIsDone(&up)) {
+            break;
+        }
+        printf("session %d: resume from chunk %u/%u\n", session, up.done + 1, up.cnt_chunk);
+        emu_pid = startEmu(out_dir);
+        if (emu_pid < 0) {
+            fprintf(stderr, "failed to start %s\n", emu_path);
+            return 1;
+        }
+        interrupted = false;
+        while (!SipfChunkIsDone(&up) && !interrupted) {
+            SipfChunkPoll(&up);
+            SipfPoll();
+        }
+        while (SipfIsBusy()) {
+            SipfPoll();
+        }
+        EmuSpawnStop(&emu);
+        if (!interrupted) {
+            break;
+        }
+        if (session >= 10) {
+            fprintf(stderr, "too many interruptions\n");
+            return 1;
+        }
+    }
+    uint64_t t_total = EmuNowUs() - t0;
+    SipfStorePosixClose(&src_file);
+    SipfStorePosixClose(&progress_file);
+
+    std::vector<uint8_t> body;
+    bool ok = (assemble(out_dir, file_id, body) == 0) && (body == orig);
+    printf("%s: %lu bytes, %u chunk uploads, %.1fms, %s (%s)\n", path, (unsigned long)orig.size(), chunks_sent,
+           t_total / 1000.0, ok ? "assembled OK" : "MISMATCH", out_dir);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * SIPFモジュールのエミュレータ
+ *
+ * ビルド例:
+ *   cc -I../../sipf-std-m5stack -o sipf_emu main.c sipf_emu.c \
+ *      ../../sipf-std-m5stack/sipf_transport.c ../../sipf-std-m5stack/sipf_transport_posix.c \
+ *      ../../sipf-std-m5stack/xmodem.c ../../sipf-std-m5stack/xmodem_transport.c \
+ *      ../../sipf-std-m5stack/sipf_crc.c ../../sipf-std-m5stack/sipf_lz.c
+ *
+ * 使い方:
+ *   sipf_emu [-r byte_rate] [-d resp_delay_ms] [-n] [-c] [-x err_permille] [-s script] [-o out_dir] [-f fd]
+ *   -fを指定しない場合はPTYを作成してスレーブ側のパスを標準出力に出す
+ *   -cを指定すると$$FPUTのXMODEMをCRC-16モード('C')で開始する
+ *   -xを指定するとコマンドの1/1000単位の割合でNGを返す($$FPUTは受信したブロックにNAKを返す)
+ */
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "sipf_emu.h"
+#include "sipf_transport.h"
+
+static int openPty(void)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return -1;
+    }
+    if ((grantpt(fd) != 0) || (unlockpt(fd) != 0)) {
+        close(fd);
+        return -1;
+    }
+    struct termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    // スレーブ側を開いたままにしてクライアント未接続時のEIOを避ける
+    if (open(ptsname(fd), O_RDWR | O_NOCTTY) < 0) {
+        close(fd);
+        return -1;
+    }
+    printf("%s\n", ptsname(fd));
+    fflush(stdout);
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    SipfEmuConfig cfg = { 11520, 0, 1, NULL, 0, 0 };
+    const char *script = NULL;
+    int fd = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:d:ncx:s:o:f:")) != -1) {
+        switch (opt) {
+        case 'r':
+            cfg.byte_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            cfg.resp_delay_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            cfg.echo = 0;
+            break;
+        case 'c':
+            cfg.xmodem_crc = 1;
+            break;
+        case 'x':
+            cfg.err_permille = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            script = optarg;
+            break;
+        case 'o':
+            cfg.out_dir = optarg;
+            break;
+        case 'f':
+            fd = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r byte_rate] [-d resp_delay_ms] [-n] [-c] [-x err_permille] [-s script] [-o out_dir] [-f fd]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (fd < 0) {
+        fd = openPty();
+        if (fd < 0) {
+            perror("pty");
+            return 1;
+        }
+    }
+
+    static SipfTransport tr;
+    static SipfTransportPosix posix;
+    SipfTransportPosixAttach(&tr, &posix, fd);
+    SipfEmuInit(&cfg, &tr);
+    if ((script != NULL) && (SipfEmuLoadScript(script) != 0)) {
+        return 1;
+    }
+
+    SipfEmuBoot();
+    for (;;) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) < 0) {
+            continue;
+        }
+        if (SipfEmuPoll() != 0) {
+            break;
+        }
+        if ((pfd.revents & (POLLHUP | POLLERR)) && (SipfTransportAvailable() == 0)) {
+            // 相手が切断した
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,647 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#define _DEFAULT_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "sipf_emu.h"
+#include "sipf_lz.h"
+#include "xmodem.h"
+
+#define EMU_LINE_MAX        (1024)
+#define EMU_RX_QUEUE_MAX    (64)
+#define EMU_FILE_MAX        (16 * 1024 * 1024)
+#define EMU_TOKEN_MAX       (384)
+
+static SipfEmuConfig config;
+static const SipfTransport *inner;
+static SipfTransport paced;
+
+static uint8_t regs[256];
+static int gnss_enabled;
+static char gnss_line[256] = "V,0.000000,0.000000,0.000000,0.000000,0.000000,2000-01-01T00:00:00Z";
+static char *rx_queue[EMU_RX_QUEUE_MAX];
+static int rx_head, rx_cnt;
+static int rx_loop;         // $$RXで返したメッセージを末尾に戻して繰り返し返す
+static int tx_loop;         // $$TXで受け付けたメッセージを$$RXで返すキューに入れる
+static uint32_t otid_seq;
+static uint32_t err_seed = 1;
+static uint8_t regs_boot[256];  // 再起動で戻すレジスタの値
+static int boot_cnt;
+static uint32_t cmd_seq;        // 受信したコマンドの数
+static uint32_t reboot_at;      // この番号のコマンドで応答せずに再起動する(0なら無し)
+static uint32_t event_at;       // この番号のコマンドの前にevent_lineを出す(0なら無し)
+static char event_line[EMU_LINE_MAX];
+static char line[EMU_LINE_MAX];
+static int line_len;
+
+/**
+ * UARTの速度に合わせて待つ
+ */
+static void emuPace(int len)
+{
+    static uint64_t t_wire;     // 線路が空く時刻[us]
+    if ((config.byte_rate == 0) || (len <= 0)) {
+        return;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t t_now = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    if (t_wire < t_now) {
+        t_wire = t_now;
+    }
+    t_wire += (uint64_t)len * 1000000 / config.byte_rate;
+    // 1バイトごとに寝ると遅くなりすぎるのである程度たまってから待つ
+    if (t_wire - t_now >= 1000) {
+        usleep((useconds_t)(t_wire - t_now));
+    }
+}
+
+static int pacedAvailable(void *ctx)
+{
+    return inner->available(inner->ctx);
+}
+
+static int pacedRead(void *ctx, uint8_t *buff, int len)
+{
+    int ret = inner->read(inner->ctx, buff, len);
+    emuPace(ret);
+    return ret;
+}
+
+static int pacedWrite(void *ctx, const uint8_t *buff, int len)
+{
+    emuPace(len);
+    return inner->write(inner->ctx, buff, len);
+}
+
+static uint32_t pacedMillis(void *ctx)
+{
+    return inner->millis(inner->ctx);
+}
+
+static uint32_t pacedMicros(void *ctx)
+{
+    return inner->micros(inner->ctx);
+}
+
+static void pacedDelay(void *ctx, uint32_t ms)
+{
+    inner->delay(inner->ctx, ms);
+}
+
+static void emuPuts(const char *s)
+{
+    SipfTransportWrite((const uint8_t*)s, strlen(s));
+    SipfTransportWrite((const uint8_t*)"\r\n", 2);
+}
+
+static uint64_t emuNowMs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static uint32_t emuFwVersion(void)
+{
+    return ((uint32_t)regs[0xf1] << 24) | ((uint32_t)regs[0xf2] << 16) | ((uint32_t)regs[0xf4] << 8) | regs[0xf3];
+}
+
+/* err_permille/1000の確率で真 (再現できるように固定の種から始める) */
+static int emuInjectError(void)
+{
+    if (config.err_permille == 0) {
+        return 0;
+    }
+    err_seed = err_seed * 1103515245 + 12345;
+    return ((err_seed >> 16) % 1000) < config.err_permille;
+}
+
+static int emuIsHex(const char *s, int len)
+{
+    if ((int)strlen(s) != len) {
+        return 0;
+    }
+    for (int i = 0; i < len; i++) {
+        char c = s[i];
+        if (!(((c >= '0') && (c <= '9')) || ((c >= 'A') && (c <= 'F')) || ((c >= 'a') && (c <= 'f')))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * TYPEに対するVALUEのバイト数(可変長なら-1)
+ */
+static int emuTypeSize(uint8_t type)
+{
+    switch (type) {
+    case 0x00: case 0x01:
+        return 1;
+    case 0x02: case 0x03:
+        return 2;
+    case 0x04: case 0x05: case 0x08:
+        return 4;
+    case 0x06: case 0x07: case 0x09:
+        return 8;
+    case 0x10: case 0x20:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * TAG TYPE VALUE の並びを検証する
+ * return: オブジェクト数, 不正なら-1
+ */
+static int emuValidateObjects(char **tok, int ntok)
+{
+    if ((ntok == 0) || ((ntok % 3) != 0)) {
+        return -1;
+    }
+    for (int i = 0; i < ntok; i += 3) {
+        if (!emuIsHex(tok[i], 2) || !emuIsHex(tok[i + 1], 2)) {
+            return -1;
+        }
+        int vlen = strlen(tok[i + 2]);
+        if (((vlen % 2) != 0) || (vlen == 0) || (vlen > 255 * 2) || !emuIsHex(tok[i + 2], vlen)) {
+            return -1;
+        }
+        int sz = emuTypeSize((uint8_t)strtoul(tok[i + 1], NULL, 16));
+        if ((sz == 0) || ((sz > 0) && (sz * 2 != vlen))) {
+            return -1;
+        }
+    }
+    return ntok / 3;
+}
+
+static int emuSplit(char *s, char **tok, int max)
+{
+    int n = 0;
+    char *save;
+    for (char *t = strtok_r(s, " ", &save); t != NULL; t = strtok_r(NULL, " ", &save)) {
+        if (n >= max) {
+            return -1;
+        }
+        tok[n++] = t;
+    }
+    return n;
+}
+
+static void emuCmdTx(char **tok, int ntok)
+{
+    char otid[33];
+    if (emuValidateObjects(tok, ntok) < 0) {
+        emuPuts("NG");
+        return;
+    }
+    if (tx_loop && (rx_cnt < EMU_RX_QUEUE_MAX)) {
+        // 送ったメッセージを折り返して受信できるようにする
+        char msg[EMU_LINE_MAX];
+        int len = 0;
+        for (int i = 0; i < ntok; i++) {
+            len += snprintf(&msg[len], sizeof(msg) - len, (i == 0) ? "%s" : " %s", tok[i]);
+        }
+        rx_queue[(rx_head + rx_cnt) % EMU_RX_QUEUE_MAX] = strdup(msg);
+        rx_cnt++;
+    }
+    snprintf(otid, sizeof(otid), "%016llX%08X%08X", (unsigned long long)emuNowMs(), (unsigned)getpid(), ++otid_seq);
+    emuPuts(otid);
+    emuPuts("OK");
+}
+
+static void emuCmdRx(void)
+{
+    char buf[EMU_LINE_MAX];
+    char *tok[EMU_TOKEN_MAX];
+
+    if (rx_cnt == 0) {
+        // 受信データなし
+        emuPuts("OK");
+        return;
+    }
+
+    char *msg = rx_queue[rx_head];
+    rx_head = (rx_head + 1) % EMU_RX_QUEUE_MAX;
+    rx_cnt--;
+
+    snprintf(buf, sizeof(buf), "%s", msg);
+    if (rx_loop) {
+        rx_queue[(rx_head + rx_cnt) % EMU_RX_QUEUE_MAX] = msg;
+        rx_cnt++;
+    } else {
+        free(msg);
+    }
+    int ntok = emuSplit(buf, tok, EMU_TOKEN_MAX);
+
+    uint64_t now = emuNowMs();
+    char out[EMU_LINE_MAX];
+    snprintf(out, sizeof(out), "%016llX%08X%08X", (unsigned long long)now, (unsigned)getpid(), ++otid_seq);
+    emuPuts(out);
+    snprintf(out, sizeof(out), "%016llX", (unsigned long long)(now - 1000));  // ユーザーサーバー送信時刻
+    emuPuts(out);
+    snprintf(out, sizeof(out), "%016llX", (unsigned long long)(now - 500));   // SIPF受信時刻
+    emuPuts(out);
+    snprintf(out, sizeof(out), "%02X", rx_cnt);                               // REMAIN
+    emuPuts(out);
+    snprintf(out, sizeof(out), "%02X", ntok / 3);                             // OBJQTY
+    emuPuts(out);
+    for (int i = 0; i + 2 < ntok; i += 3) {
+        unsigned tag = strtoul(tok[i], NULL, 16);
+        unsigned type = strtoul(tok[i + 1], NULL, 16);
+        if (emuFwVersion() >= 0x00030001) {
+            snprintf(out, sizeof(out), "%02X %02X %02X %s", tag, type, (unsigned)strlen(tok[i + 2]) / 2, tok[i + 2]);
+        } else {
+            snprintf(out, sizeof(out), "%02X %02X %02X %s", type, tag, (unsigned)strlen(tok[i + 2]) / 2, tok[i + 2]);
+        }
+        emuPuts(out);
+    }
+    emuPuts("OK");
+}
+
+/**
+ * 受け取ったファイルをout_dirに保存する
+ * return: 0: 成功(保存しない場合も含む), -1: 書き込めなかった
+ */
+static int emuSaveFile(const char *file_id, const uint8_t *body, size_t sz)
+{
+    char path[1024];
+    if (config.out_dir == NULL) {
+        return 0;
+    }
+    if ((strchr(file_id, '/') != NULL) || (strcmp(file_id, "..") == 0)) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%s", config.out_dir, file_id);
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    size_t n = fwrite(body, 1, sz, fp);
+    if ((fclose(fp) != 0) || (n != sz)) {
+        perror(path);
+        return -1;
+    }
+
+    // 圧縮して送られたファイルは展開したものも保存する(FILE_IDから接尾辞を除いた名前)
+    size_t len_id = strlen(file_id);
+    size_t len_sfx = strlen(SIPF_LZ_FILE_SUFFIX);
+    uint32_t sz_orig, crc;
+    if ((len_id <= len_sfx) || (strcmp(&file_id[len_id - len_sfx], SIPF_LZ_FILE_SUFFIX) != 0) ||
+        (SipfLzHeader(body, sz, &sz_orig, &crc) < 0) || (sz_orig > EMU_FILE_MAX)) {
+        return 0;
+    }
+    uint8_t *orig = (uint8_t*)malloc(sz_orig + 1);
+    if (orig == NULL) {
+        return -1;
+    }
+    if (SipfLzDecode(body, sz, orig, sz_orig) < 0) {
+        fprintf(stderr, "sipf_emu: %s: broken\n", file_id);
+        free(orig);
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s/%.*s", config.out_dir, (int)(len_id - len_sfx), file_id);
+    int ret = 0;
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        perror(path);
+        ret = -1;
+    } else {
+        n = fwrite(orig, 1, sz_orig, fp);
+        if ((fclose(fp) != 0) || (n != sz_orig)) {
+            perror(path);
+            ret = -1;
+        }
+    }
+    free(orig);
+    return ret;
+}
+
+static void emuCmdFput(char **tok, int ntok)
+{
+    static uint8_t block[XMODEM_SZ_FRAME_MAX];
+
+    if ((ntok != 2) || !emuIsHex(tok[1], 8)) {
+        emuPuts("NG");
+        return;
+    }
+    size_t sz_file = strtoul(tok[1], NULL, 16);
+    if (sz_file > EMU_FILE_MAX) {
+        emuPuts("NG");
+        return;
+    }
+    uint8_t *body = (uint8_t*)malloc(sz_file + XMODEM_SZ_BLOCK_1K);
+    if (body == NULL) {
+        emuPuts("NG");
+        return;
+    }
+
+    // XMODEMで受信
+    int crc = config.xmodem_crc;
+    if (crc) {
+        XmodemReceiveStartCrc();
+    } else {
+        XmodemReceiveStart();
+    }
+    uint8_t bn = 0;
+    size_t idx = 0;
+    int retry = 0;
+    for (;;) {
+        uint8_t bn_prev = bn;
+        XmodemRecvRet ret = XmodemReceiveBlock(&bn, block, 3000);
+        switch (ret) {
+        case XMODEM_RECV_RET_OK: {
+            if (emuInjectError()) {
+                // 壊れていたことにして再送させる
+                bn = bn_prev;
+                XmodemReceiveReqCurrentBlock();
+                continue;
+            }
+            int sz = XmodemBlockDataSize(block);
+            if (idx + sz <= sz_file + XMODEM_SZ_BLOCK_1K) {
+                memcpy(&body[idx], &block[3], sz);
+            }
+            idx += sz;
+            retry = 0;
+            XmodemReceiveReqNextBlock();
+            continue;
+        }
+        case XMODEM_RECV_RET_DUP:
+            XmodemReceiveReqNextBlock();
+            continue;
+        case XMODEM_RECV_RET_RETRY:
+            if (++retry > 10) {
+                XmodemTransmitCancel();
+                break;
+            }
+            if ((bn == 0) && crc) {
+                // まだ1ブロックも来ていない
+                if (retry < 3) {
+                    XmodemReceiveStartCrc();
+                } else {
+                    // 送信側がCRCに対応していないのでチェックサムでやりなおす
+                    crc = 0;
+                    XmodemReceiveStart();
+                }
+                continue;
+            }
+            XmodemReceiveReqCurrentBlock();
+            continue;
+        case XMODEM_RECV_RET_FINISHED:
+            if (idx >= sz_file) {
+                int ret = emuSaveFile(tok[0], body, sz_file);
+                free(body);
+                emuPuts((ret == 0) ? "OK" : "NG");
+                return;
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+    free(body);
+    emuPuts("NG");
+}
+
+static void emuHandleLine(char *l)
+{
+    char *tok[EMU_TOKEN_MAX];
+
+    cmd_seq++;
+    if (cmd_seq == event_at) {
+        // 自発的なメッセージ
+        emuPuts(event_line);
+    }
+    if (cmd_seq == reboot_at) {
+        // 応答せずに再起動する
+        memcpy(regs, regs_boot, sizeof(regs));
+        gnss_enabled = 0;
+        SipfEmuBoot();
+        return;
+    }
+
+    if (config.echo) {
+        emuPuts(l);
+    }
+    if (config.resp_delay_ms) {
+        usleep(config.resp_delay_ms * 1000);
+    }
+
+    int ntok = emuSplit(l, tok, EMU_TOKEN_MAX);
+    if (ntok <= 0) {
+        emuPuts("NG");
+        return;
+    }
+    if ((strcmp(tok[0], "$$FPUT") != 0) && emuInjectError()) {
+        emuPuts("NG");
+        return;
+    }
+
+    if (strcmp(tok[0], "$W") == 0) {
+        if ((ntok != 3) || !emuIsHex(tok[1], 2) || !emuIsHex(tok[2], 2)) {
+            emuPuts("NG");
+            return;
+        }
+        regs[strtoul(tok[1], NULL, 16)] = strtoul(tok[2], NULL, 16);
+        emuPuts("OK");
+    } else if (strcmp(tok[0], "$R") == 0) {
+        char out[8];
+        if ((ntok != 2) || !emuIsHex(tok[1], 2)) {
+            emuPuts("NG");
+            return;
+        }
+        snprintf(out, sizeof(out), "%02X", regs[strtoul(tok[1], NULL, 16)]);
+        emuPuts(out);
+        emuPuts("OK");
+    } else if (strcmp(tok[0], "$$TX") == 0) {
+        emuCmdTx(&tok[1], ntok - 1);
+    } else if (strcmp(tok[0], "$$RX") == 0) {
+        emuCmdRx();
+    } else if (strcmp(tok[0], "$$FPUT") == 0) {
+        emuCmdFput(&tok[1], ntok - 1);
+    } else if (strcmp(tok[0], "$$GNSSEN") == 0) {
+        if ((ntok != 2) || ((strcmp(tok[1], "0") != 0) && (strcmp(tok[1], "1") != 0))) {
+            emuPuts("NG");
+            return;
+        }
+        gnss_enabled = (tok[1][0] == '1');
+        emuPuts("OK");
+    } else if (strcmp(tok[0], "$$GNSSLOC") == 0) {
+        if (!gnss_enabled) {
+            emuPuts("NG");
+            return;
+        }
+        emuPuts(gnss_line);
+        emuPuts("OK");
+    } else {
+        emuPuts("NG");
+    }
+}
+
+/**
+ * エミュレータ初期化
+ * tr: モジュール側のトランスポート
+ */
+int SipfEmuInit(const SipfEmuConfig *cfg, const SipfTransport *tr)
+{
+    config = *cfg;
+    inner = tr;
+
+    paced.ctx = NULL;
+    paced.available = pacedAvailable;
+    paced.read = pacedRead;
+    paced.write = pacedWrite;
+    paced.millis = pacedMillis;
+    paced.micros = pacedMicros;
+    paced.delay = pacedDelay;
+    SipfTransportSet(&paced);
+
+    memset(regs, 0, sizeof(regs));
+    regs[0xf1] = 0; // MAJOR
+    regs[0xf2] = 4; // MINOR
+    regs[0xf3] = 1; // RELEASE下位
+    regs[0xf4] = 0; // RELEASE上位
+    line_len = 0;
+    return 0;
+}
+
+/**
+ * シナリオファイルを読み込む
+ *   fw <MAJOR> <MINOR> <RELEASE>  : Fwバージョン
+ *   reg <ADDR> <VALUE>            : レジスタの初期値(HEX)
+ *   rx <TAG> <TYPE> <VALUE> ...   : $$RXで返すメッセージ(VALUEは送信時と同じ並びのHEX)
+ *   rxloop <0|1>                  : 1なら$$RXで返したメッセージを末尾に戻して繰り返し返す
+ *   txloop <0|1>                  : 1なら$$TXで受け付けたメッセージを$$RXで返すキューに入れる
+ *   gnss <LINE>                   : $$GNSSLOCで返す行
+ *   delay <ms> / rate <byte/s> / echo <0|1> / xmodem <crc|sum> / error <permille>
+ *   reboot <N>                    : N番目のコマンドに応答せずに再起動する(起動メッセージを出してレジスタを戻す)
+ *   event <N> <LINE>              : N番目のコマンドの前に自発的なメッセージとしてLINEを出す
+ */
+int SipfEmuLoadScript(const char *path)
+{
+    char buf[EMU_LINE_MAX];
+    char work[EMU_LINE_MAX];
+    char *tok[EMU_TOKEN_MAX];
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    int lineno = 0;
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        lineno++;
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if ((buf[0] == '#') || (buf[0] == '\0')) {
+            continue;
+        }
+        char *rest = strchr(buf, ' ');
+        rest = (rest != NULL) ? rest + 1 : buf + strlen(buf);
+
+        snprintf(work, sizeof(work), "%s", buf);
+        int ntok = emuSplit(work, tok, EMU_TOKEN_MAX);
+        if (ntok <= 0) {
+            goto err;
+        }
+        if ((strcmp(tok[0], "fw") == 0) && (ntok == 4)) {
+            unsigned rel = strtoul(tok[3], NULL, 10);
+            regs[0xf1] = strtoul(tok[1], NULL, 10);
+            regs[0xf2] = strtoul(tok[2], NULL, 10);
+            regs[0xf3] = rel & 0xff;
+            regs[0xf4] = rel >> 8;
+        } else if ((strcmp(tok[0], "reg") == 0) && (ntok == 3)) {
+            regs[strtoul(tok[1], NULL, 16) & 0xff] = strtoul(tok[2], NULL, 16);
+        } else if (strcmp(tok[0], "rx") == 0) {
+            if ((emuValidateObjects(&tok[1], ntok - 1) < 0) || (rx_cnt >= EMU_RX_QUEUE_MAX)) {
+                goto err;
+            }
+            rx_queue[(rx_head + rx_cnt) % EMU_RX_QUEUE_MAX] = strdup(rest);
+            rx_cnt++;
+        } else if ((strcmp(tok[0], "gnss") == 0) && (ntok == 2)) {
+            snprintf(gnss_line, sizeof(gnss_line), "%s", tok[1]);
+        } else if ((strcmp(tok[0], "delay") == 0) && (ntok == 2)) {
+            config.resp_delay_ms = strtoul(tok[1], NULL, 10);
+        } else if ((strcmp(tok[0], "rate") == 0) && (ntok == 2)) {
+            config.byte_rate = strtoul(tok[1], NULL, 10);
+        } else if ((strcmp(tok[0], "echo") == 0) && (ntok == 2)) {
+            config.echo = atoi(tok[1]);
+        } else if ((strcmp(tok[0], "xmodem") == 0) && (ntok == 2)) {
+            config.xmodem_crc = (strcmp(tok[1], "crc") == 0);
+        } else if ((strcmp(tok[0], "error") == 0) && (ntok == 2)) {
+            config.err_permille = strtoul(tok[1], NULL, 10);
+        } else if ((strcmp(tok[0], "rxloop") == 0) && (ntok == 2)) {
+            rx_loop = atoi(tok[1]);
+        } else if ((strcmp(tok[0], "txloop") == 0) && (ntok == 2)) {
+            tx_loop = atoi(tok[1]);
+        } else if ((strcmp(tok[0], "reboot") == 0) && (ntok == 2)) {
+            reboot_at = strtoul(tok[1], NULL, 10);
+        } else if ((strcmp(tok[0], "event") == 0) && (ntok >= 3)) {
+            event_at = strtoul(tok[1], NULL, 10);
+            rest = strchr(rest, ' ');
+            snprintf(event_line, sizeof(event_line), "%s", (rest != NULL) ? rest + 1 : "");
+        } else {
+            goto err;
+        }
+    }
+    fclose(fp);
+    return 0;
+err:
+    fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+    fclose(fp);
+    return -1;
+}
+
+/**
+ * 起動メッセージを出力
+ */
+void SipfEmuBoot(void)
+{
+    if (boot_cnt++ == 0) {
+        memcpy(regs_boot, regs, sizeof(regs));
+    }
+    emuPuts("*** SIPF Client (emulator) ***");
+    emuPuts("+++ Ready +++");
+}
+
+/**
+ * 受信済みのデータを処理する(ブロックしない)
+ * return: 0: 成功, -1: トランスポートのエラー
+ */
+int SipfEmuPoll(void)
+{
+    uint8_t buf[256];
+    for (;;) {
+        int len = SipfTransportRead(buf, sizeof(buf));
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            return 0;
+        }
+        for (int i = 0; i < len; i++) {
+            uint8_t b = buf[i];
+            if ((b == '\r') || (b == '\n')) {
+                if (line_len > 0) {
+                    line[line_len] = '\0';
+                    emuHandleLine(line);
+                    line_len = 0;
+                }
+                continue;
+            }
+            if (line_len < (EMU_LINE_MAX - 1)) {
+                line[line_len++] = b;
+            }
+        }
+    }
+}
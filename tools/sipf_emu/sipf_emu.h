@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+#ifndef _SIPF_EMU_H_
+#define _SIPF_EMU_H_
+
+#include <stdint.h>
+
+#include "sipf_transport.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    uint32_t byte_rate;     // UARTの速度[byte/s] 0なら制限しない
+    uint32_t resp_delay_ms; // コマンド受信から応答までの遅延[ms]
+    int echo;               // コマンドをエコーバックするか
+    const char *out_dir;    // $$FPUTで受信したファイルの保存先(NULLなら保存しない)
+    int xmodem_crc;         // $$FPUTのXMODEMを'C'(CRC-16)で開始するか(0ならNAKで開始)
+    uint32_t err_permille;  // エラーを起こす割合[1/1000] コマンドはNGを返し, $$FPUTのブロックはNAKを返す
+}   SipfEmuConfig;
+
+int SipfEmuInit(const SipfEmuConfig *cfg, const SipfTransport *tr);
+int SipfEmuLoadScript(const char *path);
+void SipfEmuBoot(void);
+int SipfEmuPoll(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
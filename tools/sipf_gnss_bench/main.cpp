@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * $$GNSSLOCの行の解析の計測とヒープ使用量の確認
+ *   1. 以前のstrtof()を使う解析とSipfGnssParse()の速度を比べ, 結果が一致するか確かめる
+ *   2. エミュレータ(tools/sipf_emu)をつないでSipfGetGnssLocation()を繰り返し, mallocが呼ばれないことを確かめる
+ *
+ * ビルド例(glibc):
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c $S/sipf_transport.c \
+ *      $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_gnss_bench main.cpp $S/sipf_client.cpp *.o
+ *
+ * 使い方:
+ *   sipf_gnss_bench [-e emu_path] [-n parse_count] [-l loop_count]
+ */
+#include <malloc.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/emu_spawn.h"
+#include "sipf_client.h"
+#include "sipf_gnss.h"
+#include "sipf_transport.h"
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+
+/* mallocの呼び出し回数を数える */
+extern "C" void *__libc_malloc(size_t size);
+static volatile unsigned long malloc_cnt;
+
+extern "C" void *malloc(size_t size)
+{
+    malloc_cnt++;
+    return __libc_malloc(size);
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * 以前の解析(行を','で区切ってstrtof/atoi)
+ */
+static int legacyParse(char *line, GnssLocation *loc)
+{
+    int counter = 0;
+    char *head = line;
+    char *next = line;
+    for (;;) {
+        while ((*next != '\0') && (*next != ',')) {
+            next++;
+        }
+        bool is_last = (*next == '\0');
+        *next++ = '\0';
+        switch (counter) {
+        case 0:
+            if (head[0] == 'A') {
+                loc->fixed = true;
+            } else if (head[0] == 'V') {
+                loc->fixed = false;
+            } else {
+                return -2;
+            }
+            break;
+        case 1: loc->longitude = strtof(head, NULL); break;
+        case 2: loc->latitude = strtof(head, NULL); break;
+        case 3: loc->altitude = strtof(head, NULL); break;
+        case 4: loc->speed = strtof(head, NULL); break;
+        case 5: loc->heading = strtof(head, NULL); break;
+        case 6:
+            if ((strlen(head) != 20) || (head[4] != '-') || (head[7] != '-') || (head[10] != 'T') ||
+                (head[13] != ':') || (head[16] != ':') || (head[19] != 'Z')) {
+                return -2;
+            }
+            head[4] = head[7] = head[10] = head[13] = head[16] = head[19] = '\0';
+            loc->year = atoi(&head[0]);
+            loc->month = atoi(&head[5]);
+            loc->day = atoi(&head[8]);
+            loc->hour = atoi(&head[11]);
+            loc->minute = atoi(&head[14]);
+            loc->second = atoi(&head[17]);
+            break;
+        }
+        if (is_last) {
+            return (counter == 6) ? 0 : -2;
+        }
+        head = next;
+        counter++;
+    }
+}
+
+#define LINE_CNT    (256)
+static char lines[LINE_CNT][96];
+
+static void makeLines(void)
+{
+    for (int i = 0; i < LINE_CNT; i++) {
+        snprintf(lines[i], sizeof(lines[i]), "%c,%.6f,%.6f,%.3f,%.3f,%.3f,20%02d-%02d-%02dT%02d:%02d:%02dZ",
+                 (i % 4) ? 'A' : 'V',
+                 (rand() % 360000000 - 180000000) / 1e6, (rand() % 180000000 - 90000000) / 1e6,
+                 (rand() % 4000000) / 1e3, (rand() % 300000) / 1e3, (rand() % 360000) / 1e3,
+                 rand() % 100, rand() % 12 + 1, rand() % 28 + 1, rand() % 24, rand() % 60, rand() % 60);
+    }
+}
+
+static bool nearlyEqual(float a, float b)
+{
+    return fabsf(a - b) <= fabsf(a) * 1e-6f + 1e-6f;
+}
+
+static int benchParse(long cnt)
+{
+    GnssLocation ref, loc;
+    GnssLocationFixed fix;
+    char work[96];
+
+    // 結果の比較
+    int mismatch = 0;
+    for (int i = 0; i < LINE_CNT; i++) {
+        strcpy(work, lines[i]);
+        if ((legacyParse(work, &ref) != 0) || (SipfGnssParse(lines[i], strlen(lines[i]), &fix) != 0)) {
+            printf("parse error: %s\n", lines[i]);
+            mismatch++;
+            continue;
+        }
+        SipfGnssToFloat(&fix, &loc);
+        if ((ref.fixed != loc.fixed) || !nearlyEqual(ref.longitude, loc.longitude) ||
+            !nearlyEqual(ref.latitude, loc.latitude) || !nearlyEqual(ref.altitude, loc.altitude) ||
+            !nearlyEqual(ref.speed, loc.speed) || !nearlyEqual(ref.heading, loc.heading) ||
+            (ref.year != loc.year) || (ref.month != loc.month) || (ref.day != loc.day) ||
+            (ref.hour != loc.hour) || (ref.minute != loc.minute) || (ref.second != loc.second)) {
+            printf("mismatch: %s\n", lines[i]);
+            mismatch++;
+        }
+    }
+
+    int lens[LINE_CNT];
+    for (int i = 0; i < LINE_CNT; i++) {
+        lens[i] = strlen(lines[i]);
+    }
+    volatile float sink = 0;
+    uint64_t t0 = nowNs();
+    for (long n = 0; n < cnt; n++) {
+        int i = n % LINE_CNT;
+        memcpy(work, lines[i], lens[i] + 1);   // 行を書き換えるのでコピーする
+        legacyParse(work, &ref);
+        sink += ref.latitude;
+    }
+    uint64_t t1 = nowNs();
+    for (long n = 0; n < cnt; n++) {
+        int i = n % LINE_CNT;
+        memcpy(work, lines[i], lens[i] + 1);   // 条件をそろえる
+        SipfGnssParse(work, lens[i], &fix);
+        SipfGnssToFloat(&fix, &loc);
+        sink += loc.latitude;
+    }
+    uint64_t t2 = nowNs();
+    int32_t isink = 0;
+    for (long n = 0; n < cnt; n++) {
+        int i = n % LINE_CNT;
+        memcpy(work, lines[i], lens[i] + 1);
+        SipfGnssParse(work, lens[i], &fix);
+        isink += fix.latitude;
+    }
+    uint64_t t3 = nowNs();
+    (void)isink;
+
+    printf("parse n=%ld mismatch=%d\n", cnt, mismatch);
+    printf("  strtof     %.1f ns/line\n", (double)(t1 - t0) / cnt);
+    printf("  fixed+float %.1f ns/line\n", (double)(t2 - t1) / cnt);
+    printf("  fixed      %.1f ns/line\n", (double)(t3 - t2) / cnt);
+    return (mismatch == 0) ? 0 : -1;
+}
+
+static EmuSpawn emu;
+
+/**
+ * エミュレータを起動して起動完了まで待つ
+ */
+static pid_t startEmu(const char *script)
+{
+    const char *args[] = { "-r", "0", "-s", script, NULL };
+    if (EmuSpawnStart(&emu, emu_path, args) != 0) {
+        return -1;
+    }
+    SipfTransportSet(&emu.tr);
+    return (EmuSpawnWaitReady() == 0) ? emu.pid : -1;
+}
+
+/**
+ * SipfGetGnssLocation()を繰り返してヒープの使用量が変わらないことを確かめる
+ */
+static int benchHeap(long cnt)
+{
+    char script[] = "/tmp/sipf_gnss_benchXXXXXX";
+    int sfd = mkstemp(script);
+    if (sfd < 0) {
+        return -1;
+    }
+    dprintf(sfd, "gnss A,139.767125,35.681236,40.123,1.500,270.250,2022-04-01T12:34:56Z\n");
+    close(sfd);
+
+    pid_t pid = startEmu(script);
+    if (pid < 0) {
+        fprintf(stderr, "failed to start %s\n", emu_path);
+        unlink(script);
+        return -1;
+    }
+    int ng = SipfSetGnss(true);
+
+    GnssLocation loc;
+    struct mallinfo2 mi0 = mallinfo2();
+    unsigned long m0 = malloc_cnt;
+    uint64_t t0 = nowNs();
+    for (long n = 0; (n < cnt) && (ng == 0); n++) {
+        if (SipfGetGnssLocation(&loc) != 0) {
+            ng = -1;
+        }
+    }
+    uint64_t t1 = nowNs();
+    unsigned long m1 = malloc_cnt;
+    struct mallinfo2 mi1 = mallinfo2();
+
+    EmuSpawnStop(&emu);
+    unlink(script);
+
+    printf("loop n=%ld %s %.1f us/req malloc=%lu heap_in_use=%zd bytes\n", cnt, (ng == 0) ? "OK" : "NG",
+           (double)(t1 - t0) / 1000 / cnt, m1 - m0, (ssize_t)(mi1.uordblks - mi0.uordblks));
+    printf("  last: %c %.6f %.6f\n", loc.fixed ? 'A' : 'V', loc.latitude, loc.longitude);
+    return ((ng == 0) && (m1 == m0) && (mi1.uordblks == mi0.uordblks)) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    long parse_cnt = 1000000;
+    long loop_cnt = 10000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:n:l:")) != -1) {
+        switch (opt) {
+        case 'e':
+            emu_path = optarg;
+            break;
+        case 'n':
+            parse_cnt = atol(optarg);
+            break;
+        case 'l':
+            loop_cnt = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e emu_path] [-n parse_count] [-l loop_count]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    makeLines();
+    int ret = benchParse(parse_cnt);
+    if (loop_cnt > 0) {
+        ret |= benchHeap(loop_cnt);
+    }
+    return (ret == 0) ? 0 : 1;
+}
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * HEXの変換(sipf_hex.c)の計測
+ * $$TXの値の変換を以前のsprintf("%02X")の繰り返しとSipfHexEncode()/SipfHexEncodeRev()で,
+ * $$RXの値の変換を以前のutilHexToUint8()の繰り返しとSipfHexDecode()/SipfHexDecodeU64()で比べる
+ * 大きさごとに ns/byte と速度比を出し, 結果が一致するかも確かめる
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_hex.c
+ *   c++ -O2 -I$S -o sipf_hex_bench main.cpp sipf_hex.o
+ *
+ * 使い方:
+ *   sipf_hex_bench [-n bytes_per_case]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sipf_hex.h"
+
+#define VALUE_MAX   (255)   // $$TX/$$RXの値の最大長
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * 以前の$$TXの値の変換
+ */
+static int legacyEncode(char *dst, const uint8_t *value, int value_len, bool rev)
+{
+    int len = 0;
+    if (!rev) {
+        for (int i = 0; i < value_len; i++) {
+            len += sprintf(&dst[len], "%02X", value[i]);
+        }
+    } else {
+        for (int i = (value_len - 1); i >= 0; i--) {
+            len += sprintf(&dst[len], "%02X", value[i]);
+        }
+    }
+    return len;
+}
+
+/**
+ * 以前の$$RXの値の変換(2文字ずつ)
+ */
+static int utilHexToUint8(const char *hex, uint8_t *value)
+{
+    if ((hex[0] >= '0') && (hex[0] <= '9')) {
+        *value = (hex[0] - '0') << 4;
+    } else if ((hex[0] >= 'A') && (hex[0] <= 'F')) {
+        *value = (hex[0] - 'A' + 10) << 4;
+    } else if ((hex[0] >= 'a') && (hex[0] <= 'f')) {
+        *value = (hex[0] - 'a' + 10) << 4;
+    } else {
+        return -1;
+    }
+
+    if ((hex[1] >= '0') && (hex[1] <= '9')) {
+        *value |= (hex[1] - '0') & 0x0f;
+    } else if ((hex[1] >= 'A') && (hex[1] <= 'F')) {
+        *value |= (hex[1] - 'A' + 10) & 0x0f;
+    } else if ((hex[1] >= 'a') && (hex[1] <= 'f')) {
+        *value |= (hex[1] - 'a' + 10) & 0x0f;
+    } else {
+        return -1;
+    }
+
+    return *value;
+}
+
+static int legacyDecode(uint8_t *dst, const char *src, int len)
+{
+    for (int i = 0; i < len; i++) {
+        if (utilHexToUint8(&src[i * 2], &dst[i]) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int legacyDecodeU64(const char *src, uint64_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        uint8_t v;
+        if (utilHexToUint8(&src[i * 2], &v) == -1) {
+            return -1;
+        }
+        *value |= (uint64_t)v << (56 - (i * 8));
+    }
+    return 0;
+}
+
+static volatile uint32_t sink;
+
+static void report(const char *name, int len, long iter, uint64_t t_old, uint64_t t_new)
+{
+    double bytes = (double)len * iter;
+    printf("  %-10s %3dB  old %7.2f ns/B  new %6.2f ns/B  x%.1f\n",
+           name, len, t_old / bytes, t_new / bytes, (double)t_old / (t_new ? t_new : 1));
+}
+
+int main(int argc, char *argv[])
+{
+    long total = 64L * 1024 * 1024;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            total = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n bytes_per_case]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    static const int sizes[] = { 1, 4, 8, 16, 64, VALUE_MAX };
+    uint8_t value[VALUE_MAX], out_old[VALUE_MAX], out_new[VALUE_MAX];
+    char hex_old[VALUE_MAX * 2 + 1], hex_new[VALUE_MAX * 2 + 1];
+    int mismatch = 0;
+
+    for (int i = 0; i < VALUE_MAX; i++) {
+        value[i] = (uint8_t)rand();
+    }
+
+    printf("encode ($$TX)\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int len = sizes[s];
+        long iter = total / len;
+        for (int rev = 0; rev < 2; rev++) {
+            legacyEncode(hex_old, value, len, rev);
+            int n = rev ? SipfHexEncodeRev(hex_new, value, len) : SipfHexEncode(hex_new, value, len);
+            if ((n != len * 2) || (memcmp(hex_old, hex_new, n) != 0)) {
+                printf("mismatch: encode len=%d rev=%d\n", len, rev);
+                mismatch++;
+            }
+            uint64_t t0 = nowNs();
+            for (long k = 0; k < iter; k++) {
+                value[0] = (uint8_t)k;
+                sink += legacyEncode(hex_old, value, len, rev) + hex_old[0];
+            }
+            uint64_t t1 = nowNs();
+            for (long k = 0; k < iter; k++) {
+                value[0] = (uint8_t)k;
+                sink += (rev ? SipfHexEncodeRev(hex_new, value, len) : SipfHexEncode(hex_new, value, len)) + hex_new[0];
+            }
+            uint64_t t2 = nowNs();
+            report(rev ? "EncodeRev" : "Encode", len, iter, t1 - t0, t2 - t1);
+        }
+    }
+
+    printf("decode ($$RX)\n");
+    SipfHexEncode(hex_new, value, VALUE_MAX);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int len = sizes[s];
+        long iter = total / len;
+        if ((legacyDecode(out_old, hex_new, len) != 0) || (SipfHexDecode(out_new, hex_new, len) != 0) ||
+            (memcmp(out_old, out_new, len) != 0)) {
+            printf("mismatch: decode len=%d\n", len);
+            mismatch++;
+        }
+        uint64_t t0 = nowNs();
+        for (long k = 0; k < iter; k++) {
+            sink += legacyDecode(out_old, hex_new, len) + out_old[0];
+        }
+        uint64_t t1 = nowNs();
+        for (long k = 0; k < iter; k++) {
+            sink += SipfHexDecode(out_new, hex_new, len) + out_new[0];
+        }
+        uint64_t t2 = nowNs();
+        report("Decode", len, iter, t1 - t0, t2 - t1);
+    }
+
+    // 受信時刻などの16桁の数値
+    {
+        long iter = total / 8;
+        uint64_t v_old, v_new;
+        if ((legacyDecodeU64(hex_new, &v_old) != 0) || (SipfHexDecodeU64(hex_new, &v_new) != 0) || (v_old != v_new)) {
+            printf("mismatch: DecodeU64\n");
+            mismatch++;
+        }
+        uint64_t t0 = nowNs();
+        for (long k = 0; k < iter; k++) {
+            legacyDecodeU64(hex_new, &v_old);
+            sink += (uint32_t)v_old;
+        }
+        uint64_t t1 = nowNs();
+        for (long k = 0; k < iter; k++) {
+            SipfHexDecodeU64(hex_new, &v_new);
+            sink += (uint32_t)v_new;
+        }
+        uint64_t t2 = nowNs();
+        report("DecodeU64", 8, iter, t1 - t0, t2 - t1);
+    }
+
+    // HEXじゃない文字を含むものは両方ともエラーになること
+    for (int i = 0; i < 16; i++) {
+        char bad[17];
+        uint8_t b[8];
+        memcpy(bad, hex_new, 16);
+        bad[i] = (i & 1) ? 'g' : ' ';
+        if ((legacyDecode(b, bad, 8) != -1) || (SipfHexDecode(b, bad, 8) != -1)) {
+            printf("mismatch: invalid char at %d\n", i);
+            mismatch++;
+        }
+    }
+
+    printf("mismatch=%d\n", mismatch);
+    return (mismatch == 0) ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * 行の読み出し(sipf_line.c)の計測
+ * モジュールの応答らしい行をメモリ上のトランスポートから流し込み, 以前の1バイトずつ読む方法と
+ * SipfLineReaderの lines/s と cycles/byte を比べる. 取り出した行が一致するかも確かめる
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_line.c $S/sipf_transport.c
+ *   c++ -O2 -I$S -o sipf_line_bench main.cpp *.o
+ *
+ * 使い方:
+ *   sipf_line_bench [-n repeat] [-c chunk]
+ *   -c: 1回のread()で受け取れる最大バイト数(UARTの受信FIFOにたまっている分. 既定は128)
+ *   cycles/byteはx86ではrdtscで測る. それ以外は3GHzとしてns/byteから換算する
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "sipf_line.h"
+#include "sipf_transport.h"
+
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return nowNs() * 3;
+#endif
+}
+
+/*
+ * メモリ上の受信データを返すトランスポート(1回のread()はchunkバイトまで)
+ */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    size_t idx;
+    int chunk;
+}   MemWire;
+
+static int memAvailable(void *ctx)
+{
+    MemWire *w = (MemWire*)ctx;
+    size_t n = w->len - w->idx;
+    return (n < (size_t)w->chunk) ? (int)n : w->chunk;
+}
+
+static int memRead(void *ctx, uint8_t *buff, int len)
+{
+    MemWire *w = (MemWire*)ctx;
+    int n = memAvailable(ctx);
+    if (n > len) {
+        n = len;
+    }
+    memcpy(buff, &w->data[w->idx], n);
+    w->idx += n;
+    return n;
+}
+
+static int memWrite(void *ctx, const uint8_t *buff, int len)
+{
+    return len;
+}
+
+static uint32_t memMillis(void *ctx)
+{
+    return (uint32_t)(nowNs() / 1000000);
+}
+
+static uint32_t memMicros(void *ctx)
+{
+    return (uint32_t)(nowNs() / 1000);
+}
+
+static void memDelay(void *ctx, uint32_t ms)
+{
+}
+
+static MemWire wire;
+static const SipfTransport mem_tr = { &wire, memAvailable, memRead, memWrite, memMillis, memMicros, memDelay };
+
+/**
+ * 以前の読み出し(available()の分を1バイトずつread()してバッファに詰める)
+ */
+static int legacyReadLine(uint8_t *buff, int buff_len, int timeout_ms)
+{
+    uint32_t t_recved, t_now;
+    int ret;
+    int len, idx = 0;
+    uint8_t b;
+
+    memset(buff, 0, buff_len);
+    t_recved = SipfTransportMillis();
+    for (;;) {
+        t_now = SipfTransportMillis();
+        len = SipfTransportAvailable();
+        for (int i = 0; i < len; i++) {
+            ret = SipfTransportReadByte();
+            if (ret >= 0) {
+                b = (uint8_t)ret;
+                if (idx < buff_len) {
+                    if ((b == '\r') || (b == '\n')) {
+                        buff[idx] = '\0';
+                        return idx + 1;
+                    }
+                    buff[idx] = b;
+                    idx++;
+                }
+            }
+            t_recved = t_now;
+        }
+        if ((int32_t)((t_recved + timeout_ms) - t_now) < 0) {
+            return -3;
+        }
+    }
+}
+
+/**
+ * $$TX, $$RX, $$GNSSLOC, $Rの応答らしい受信データを作る
+ */
+static std::string makeStream(void)
+{
+    std::string s;
+    char line[256];
+    for (int i = 0; i < 64; i++) {
+        switch (i % 4) {
+        case 0:
+            s += "$$TX 01 04 0000002A\r\n";
+            snprintf(line, sizeof(line), "%08X%08X%08X%08X\r\nOK\r\n", rand(), rand(), rand(), rand());
+            s += line;
+            break;
+        case 1:
+            s += "$$RX\r\n";
+            snprintf(line, sizeof(line), "%08X%08X%08X%08X\r\n%016llX\r\n%016llX\r\n%02X\r\n%02X\r\n",
+                     rand(), rand(), rand(), rand(), 1654041600000ULL + i, 1654041600500ULL + i, 0, 1);
+            s += line;
+            s += "01 04 0000002A\r\n02 08 3FF0000000000000\r\n20 10 68656C6C6F2C20776F726C6421212121\r\nOK\r\n";
+            break;
+        case 2:
+            s += "$$GNSSLOC\r\nA,139.767125,35.681236,40.123,1.500,270.250,2022-04-01T12:34:56Z\r\nOK\r\n";
+            break;
+        default:
+            snprintf(line, sizeof(line), "$R %02X\r\n%02X\r\nOK\r\n", i, rand() & 0xff);
+            s += line;
+            break;
+        }
+    }
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    int repeat = 2000;
+    int chunk = 128;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            repeat = atoi(optarg);
+            break;
+        case 'c':
+            chunk = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n repeat] [-c chunk]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ((repeat <= 0) || (chunk <= 0)) {
+        return 1;
+    }
+
+    std::string stream = makeStream();
+    wire.data = (const uint8_t*)stream.data();
+    wire.len = stream.size();
+    wire.chunk = chunk;
+    SipfTransportSet(&mem_tr);
+
+    // 以前の読み出し. 空行は呼び出し側で読み飛ばしていたので同じようにする
+    std::vector<std::string> ref;
+    static uint8_t buf[SIPF_LINE_MAX + 1];
+    long legacy_lines = 0;
+    uint64_t t0 = nowNs(), c0 = cycles();
+    for (int n = 0; n < repeat; n++) {
+        wire.idx = 0;
+        while (wire.idx < wire.len) {
+            int ret = legacyReadLine(buf, sizeof(buf), 0);
+            if ((ret <= 1) || (buf[0] == '\0')) {
+                continue;
+            }
+            legacy_lines++;
+            if (n == 0) {
+                ref.push_back((char*)buf);
+            }
+        }
+    }
+    uint64_t t1 = nowNs(), c1 = cycles();
+
+    // SipfLineReader
+    static SipfLineReader reader;
+    SipfLineView view;
+    long ring_lines = 0;
+    size_t mismatch = 0;
+    for (int n = 0; n < repeat; n++) {
+        wire.idx = 0;
+        SipfLineReaderReset(&reader);
+        while (wire.idx < wire.len) {
+            SipfLineReaderFill(&reader);
+            while (SipfLineReaderNext(&reader, &view)) {
+                if ((n == 0) && ((ring_lines >= (long)ref.size()) || (ref[ring_lines] != view.ptr))) {
+                    mismatch++;
+                }
+                ring_lines++;
+            }
+        }
+    }
+    uint64_t t2 = nowNs(), c2 = cycles();
+    if (ring_lines != legacy_lines) {
+        mismatch++;
+    }
+
+    double bytes = (double)stream.size() * repeat;
+    printf("stream %zu bytes, %zu lines, chunk=%d, repeat=%d, mismatch=%zu\n",
+           stream.size(), ref.size(), chunk, repeat, mismatch);
+    printf("  legacy  %10.0f lines/s %6.2f cycles/byte\n",
+           legacy_lines / ((t1 - t0) / 1e9), (c1 - c0) / bytes);
+    printf("  ring    %10.0f lines/s %6.2f cycles/byte\n",
+           ring_lines / ((t2 - t1) / 1e9), (c2 - c1) / bytes);
+    return (mismatch == 0) ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * SipfCmdFputLz()で送ったファイルの展開(と確認用の圧縮)
+ * モジュールから受け取ったFILE_IDがSIPF_LZ_FILE_SUFFIXで終わるファイルを展開して元のファイルに戻す
+ *
+ * ビルド例:
+ *   cc -O2 -I../../sipf-std-m5stack -o sipf_lz main.c ../../sipf-std-m5stack/sipf_crc.c ../../sipf-std-m5stack/sipf_lz.c
+ *
+ * 使い方:
+ *   sipf_lz -d in.slz [out]  展開する(outを省略すると標準出力)
+ *   sipf_lz -c in [out]      圧縮する
+ *   -vで元の大きさと圧縮後の大きさを標準エラーに出す
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sipf_lz.h"
+
+static uint8_t *readAll(const char *path, size_t *sz)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    size_t cap = 64 * 1024, len = 0;
+    uint8_t *buf = (uint8_t*)malloc(cap);
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            buf = (uint8_t*)realloc(buf, cap);
+        }
+        size_t n = fread(&buf[len], 1, cap - len, fp);
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    fclose(fp);
+    *sz = len;
+    return buf;
+}
+
+static int writeAll(const char *path, const uint8_t *buf, size_t sz)
+{
+    FILE *fp = (path != NULL) ? fopen(path, "wb") : stdout;
+    if (fp == NULL) {
+        return -1;
+    }
+    size_t n = fwrite(buf, 1, sz, fp);
+    if (path != NULL) {
+        fclose(fp);
+    }
+    return (n == sz) ? 0 : -1;
+}
+
+typedef struct {
+    const uint8_t *body;
+    size_t idx;
+}   MemReader;
+
+static int readMem(uint8_t *buff, int len, void *arg)
+{
+    MemReader *m = (MemReader*)arg;
+    memcpy(buff, &m->body[m->idx], len);
+    m->idx += len;
+    return len;
+}
+
+static SipfLzEncoder lz;
+
+int main(int argc, char *argv[])
+{
+    int mode = 0;
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "dcv")) != -1) {
+        switch (opt) {
+        case 'd':
+        case 'c':
+            mode = opt;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            mode = 0;
+            break;
+        }
+    }
+    if ((mode == 0) || (optind >= argc)) {
+        fprintf(stderr, "usage: %s -d|-c [-v] in [out]\n", argv[0]);
+        return 1;
+    }
+    const char *in = argv[optind];
+    const char *out = (optind + 1 < argc) ? argv[optind + 1] : NULL;
+
+    size_t sz;
+    uint8_t *src = readAll(in, &sz);
+    if (src == NULL) {
+        perror(in);
+        return 1;
+    }
+
+    uint8_t *dst;
+    int32_t sz_dst;
+    if (mode == 'd') {
+        uint32_t sz_orig, crc;
+        if (SipfLzHeader(src, sz, &sz_orig, &crc) < 0) {
+            fprintf(stderr, "%s: not compressed\n", in);
+            return 1;
+        }
+        dst = (uint8_t*)malloc(sz_orig + 1);
+        sz_dst = SipfLzDecode(src, sz, dst, sz_orig);
+        if (sz_dst < 0) {
+            fprintf(stderr, "%s: broken\n", in);
+            return 1;
+        }
+    } else {
+        MemReader m = { src, 0 };
+        uint32_t crc;
+        sz_dst = SipfLzMeasure(&lz, (uint32_t)sz, readMem, &m, &crc);
+        dst = (uint8_t*)malloc(sz_dst);
+        m.idx = 0;
+        SipfLzEncodeBegin(&lz, (uint32_t)sz, crc, readMem, &m);
+        for (int32_t idx = 0; idx < sz_dst;) {
+            int ret = SipfLzEncodeRead(&dst[idx], sz_dst - idx, &lz);
+            if (ret < 0) {
+                fprintf(stderr, "%s: failed\n", in);
+                return 1;
+            }
+            idx += ret;
+        }
+    }
+    if (verbose) {
+        size_t sz_orig = (mode == 'd') ? (size_t)sz_dst : sz;
+        size_t sz_lz = (mode == 'd') ? sz : (size_t)sz_dst;
+        fprintf(stderr, "%s: %lu -> %lu bytes (%.2fx)\n", in, (unsigned long)sz_orig, (unsigned long)sz_lz,
+                (sz_lz > 0) ? (double)sz_orig / sz_lz : 0.0);
+    }
+    if (writeAll(out, dst, sz_dst) != 0) {
+        perror((out != NULL) ? out : "stdout");
+        return 1;
+    }
+    free(src);
+    free(dst);
+    return 0;
+}
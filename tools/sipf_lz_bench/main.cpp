@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * $$FPUTの圧縮(SipfCmdFputLz())の計測
+ * ログ(テキスト)とCSVのテレメトリを生成して(またはファイルを指定して), 入力ごとに
+ *   圧縮率, 圧縮と展開の1KBあたりのCPU時間
+ *   エミュレータ(tools/sipf_emu)へのSipfCmdFput()とSipfCmdFputLz()の転送時間
+ * を測る. エミュレータが展開したファイルが元と一致するかも確かめる
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c $S/sipf_transport.c \
+ *      $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_lz_bench main.cpp $S/sipf_client.cpp *.o -lm
+ *
+ * 使い方:
+ *   sipf_lz_bench [-e emu_path] [-r byte_rate] [-s gen_size] [-n repeat] [-k] [-j] [file...]
+ *   -k: XMODEM-1K(CRC)で送る(指定しない場合は128Byteブロック・チェックサム)
+ *   fileを指定しない場合は生成したlogとcsvを使う
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "../common/emu_spawn.h"
+#include "sipf_client.h"
+#include "sipf_lz.h"
+#include "sipf_transport.h"
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+static uint32_t byte_rate = 11520;  // 115200bps相当
+static bool block1k = false;
+static bool json = false;
+
+static EmuSpawn emu;
+static SipfLzEncoder lz;
+
+static uint64_t cpuNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t rnd_state = 1;
+
+static uint32_t rnd(uint32_t n)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state % n;
+}
+
+/**
+ * アプリケーションのログらしいテキストを作る
+ */
+static std::vector<uint8_t> genLog(size_t size)
+{
+    static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+    static const char *tags[] = { "sensor", "modem", "gnss", "txq", "power" };
+    std::string s;
+    uint32_t t = 1654041600;
+    uint32_t ms = 0;
+    char line[256];
+    rnd_state = 1;
+    while (s.size() < size) {
+        ms += 200 + rnd(1800);
+        t += ms / 1000;
+        ms %= 1000;
+        time_t tt = t;
+        struct tm tm;
+        gmtime_r(&tt, &tm);
+        int len = snprintf(line, sizeof(line), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ [%s] %s: ",
+                           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ms,
+                           levels[rnd(6)], tags[rnd(5)]);
+        switch (rnd(5)) {
+        case 0:
+            snprintf(&line[len], sizeof(line) - len, "temp=%u.%02u hum=%u.%u batt=%u.%02uV\n",
+                     20 + rnd(8), rnd(100), 40 + rnd(20), rnd(10), 3 + rnd(2), rnd(100));
+            break;
+        case 1:
+            snprintf(&line[len], sizeof(line) - len, "rssi=-%u rsrp=-%u rsrq=-%u cell=%05X\n",
+                     60 + rnd(40), 90 + rnd(30), 5 + rnd(10), 0x1a2b0 + rnd(4));
+            break;
+        case 2:
+            snprintf(&line[len], sizeof(line) - len, "fix=%u sats=%u lat=35.68%04u lon=139.76%04u\n",
+                     rnd(2), 4 + rnd(8), rnd(10000), rnd(10000));
+            break;
+        case 3:
+            snprintf(&line[len], sizeof(line) - len, "sent seq=%u otid=%08X%08X%08X%08X queued=%u\n",
+                     rnd(100000), rnd(0xffffffff), rnd(0xffffffff), rnd(0xffffffff), rnd(0xffffffff), rnd(8));
+            break;
+        default:
+            snprintf(&line[len], sizeof(line) - len, "heap free=%u min=%u uptime=%us\n",
+                     180000 + rnd(20000), 150000 + rnd(10000), t - 1654041600);
+            break;
+        }
+        s += line;
+    }
+    s.resize(size);
+    return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+/**
+ * 定期的に記録したテレメトリのCSVを作る
+ */
+static std::vector<uint8_t> genCsv(size_t size)
+{
+    std::string s = "timestamp,lat,lon,temp,hum,batt,rssi\n";
+    uint32_t t = 1654041600;
+    int32_t lat = 35681236, lon = 139767125, temp = 2341, hum = 452, batt = 398;
+    char line[128];
+    rnd_state = 2;
+    while (s.size() < size) {
+        t += 10;
+        lat += (int32_t)rnd(21) - 10;
+        lon += (int32_t)rnd(21) - 10;
+        temp += (int32_t)rnd(5) - 2;
+        hum += (int32_t)rnd(3) - 1;
+        batt -= (rnd(20) == 0) ? 1 : 0;
+        snprintf(line, sizeof(line), "%u,%d.%06d,%d.%06d,%d.%02d,%d.%d,%d.%02d,-%u\n",
+                 t, lat / 1000000, lat % 1000000, lon / 1000000, lon % 1000000,
+                 temp / 100, temp % 100, hum / 10, hum % 10, batt / 100, batt % 100, 70 + rnd(30));
+        s += line;
+    }
+    s.resize(size);
+    return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+static bool readFile(const char *path, std::vector<uint8_t> &out)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    uint8_t buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out.insert(out.end(), buf, buf + n);
+    }
+    fclose(fp);
+    return true;
+}
+
+typedef struct {
+    const uint8_t *body;
+    size_t idx;
+}   MemReader;
+
+static int readMem(uint8_t *buff, int len, void *arg)
+{
+    MemReader *m = (MemReader*)arg;
+    memcpy(buff, &m->body[m->idx], len);
+    m->idx += len;
+    return len;
+}
+
+/**
+ * エミュレータを起動して起動完了まで待つ
+ */
+static pid_t startEmu(const char *out_dir)
+{
+    char rate[16];
+    snprintf(rate, sizeof(rate), "%u", byte_rate);
+    const char *args[] = { "-r", rate, "-o", out_dir, block1k ? "-c" : NULL, NULL };
+    if (EmuSpawnStart(&emu, emu_path, args) != 0) {
+        return -1;
+    }
+    SipfTransportSet(&emu.tr);
+    SipfSetFputBlock1k(block1k);
+    return (EmuSpawnWaitReady() == 0) ? emu.pid : -1;
+}
+
+/**
+ * 1つの入力を計測する
+ * return: 0: OK, -1: 転送か展開の結果が合わない
+ */
+static int runBench(const char *name, const std::vector<uint8_t> &body, int repeat)
+{
+    size_t sz = body.size();
+    MemReader m;
+    uint32_t crc = 0;
+    int32_t sz_lz = 0;
+
+    // 圧縮(1パス分)
+    uint64_t c0 = cpuNowUs();
+    for (int i = 0; i < repeat; i++) {
+        m = { body.data(), 0 };
+        sz_lz = SipfLzMeasure(&lz, sz, readMem, &m, &crc);
+    }
+    double us_comp = (double)(cpuNowUs() - c0) / repeat;
+    if (sz_lz < 0) {
+        fprintf(stderr, "%s: compress failed\n", name);
+        return -1;
+    }
+
+    // 展開
+    std::vector<uint8_t> packed(sz_lz), unpacked(sz);
+    m = { body.data(), 0 };
+    SipfLzEncodeBegin(&lz, sz, crc, readMem, &m);
+    for (int32_t idx = 0; idx < sz_lz;) {
+        int ret = SipfLzEncodeRead(&packed[idx], sz_lz - idx, &lz);
+        if (ret < 0) {
+            fprintf(stderr, "%s: compress failed\n", name);
+            return -1;
+        }
+        idx += ret;
+    }
+    int32_t sz_un = 0;
+    c0 = cpuNowUs();
+    for (int i = 0; i < repeat; i++) {
+        sz_un = SipfLzDecode(packed.data(), packed.size(), unpacked.data(), unpacked.size());
+    }
+    double us_decomp = (double)(cpuNowUs() - c0) / repeat;
+    if ((sz_un != (int32_t)sz) || (memcmp(unpacked.data(), body.data(), sz) != 0)) {
+        fprintf(stderr, "%s: decompress mismatch\n", name);
+        return -1;
+    }
+
+    // 転送(そのまま / 圧縮)
+    char out_dir[] = "/tmp/sipf_lz_bench.XXXXXX";
+    if (mkdtemp(out_dir) == NULL) {
+        return -1;
+    }
+    pid_t pid = startEmu(out_dir);
+    if (pid < 0) {
+        fprintf(stderr, "failed to start %s\n", emu_path);
+        return -1;
+    }
+    uint64_t t0 = EmuNowUs();
+    int ret_raw = SipfCmdFput((char*)"raw.bin", (uint8_t*)body.data(), sz);
+    uint64_t t_raw = EmuNowUs() - t0;
+    t0 = EmuNowUs();
+    int ret_lz = SipfCmdFputLz((char*)"lz.bin", (uint8_t*)body.data(), sz, &lz);
+    uint64_t t_lz = EmuNowUs() - t0;
+    // 圧縮にかかった時間: 大きさを求める1回目 + ブロックを組み立てながらの2回目(ACK待ちと重なる)
+    SipfFputTiming timing;
+    SipfFputGetTiming(&timing);
+    double ms_lz_cpu = (us_comp + timing.us_prepare) / 1000.0;
+    EmuSpawnStop(&emu);
+
+    // エミュレータが展開したファイルを確かめる
+    std::string dir = out_dir;
+    std::vector<uint8_t> got;
+    bool ok = (ret_raw == 0) && (ret_lz == 0) && readFile((dir + "/lz.bin").c_str(), got) && (got == body);
+    remove((dir + "/raw.bin").c_str());
+    remove((dir + "/lz.bin" SIPF_LZ_FILE_SUFFIX).c_str());
+    remove((dir + "/lz.bin").c_str());
+    rmdir(out_dir);
+
+    double kb = sz / 1024.0;
+    double ratio = (sz_lz > 0) ? (double)sz / sz_lz : 0.0;
+    if (json) {
+        printf("{\"input\":\"%s\",\"bytes\":%lu,\"bytes_lz\":%d,\"ratio\":%.3f,\"compress_us_per_kb\":%.2f,"
+               "\"decompress_us_per_kb\":%.2f,\"fput_ms\":%.1f,\"fput_lz_ms\":%.1f,\"fput_lz_compress_ms\":%.2f,"
+               "\"block1k\":%s,\"byte_rate\":%u,\"ok\":%s}\n",
+               name, (unsigned long)sz, sz_lz, ratio, us_comp / kb, us_decomp / kb, t_raw / 1000.0, t_lz / 1000.0,
+               ms_lz_cpu, block1k ? "true" : "false", byte_rate, ok ? "true" : "false");
+    } else {
+        printf("%-10s %8lu -> %8d bytes %5.2fx  compress %6.1fus/KB  decompress %5.1fus/KB  "
+               "fput %8.1fms  fput_lz %8.1fms (%.2fx, compress %.1fms)%s\n",
+               name, (unsigned long)sz, sz_lz, ratio, us_comp / kb, us_decomp / kb, t_raw / 1000.0, t_lz / 1000.0,
+               (t_lz > 0) ? (double)t_raw / t_lz : 0.0, ms_lz_cpu, ok ? "" : "  MISMATCH");
+    }
+    fflush(stdout);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t gen_size = 64 * 1024;
+    int repeat = 20;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:r:s:n:kj")) != -1) {
+        switch (opt) {
+        case 'e':
+            emu_path = optarg;
+            break;
+        case 'r':
+            byte_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            gen_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            repeat = std::max(atoi(optarg), 1);
+            break;
+        case 'k':
+            block1k = true;
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e emu_path] [-r byte_rate] [-s gen_size] [-n repeat] [-k] [-j] [file...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (!json) {
+        printf("encoder work area %lu bytes\n", (unsigned long)sizeof(SipfLzEncoder));
+    }
+
+    int ret = 0;
+    if (optind >= argc) {
+        ret |= runBench("log", genLog(gen_size), repeat);
+        ret |= runBench("csv", genCsv(gen_size), repeat);
+    }
+    for (int i = optind; i < argc; i++) {
+        std::vector<uint8_t> body;
+        if (!readFile(argv[i], body)) {
+            perror(argv[i]);
+            ret = -1;
+            continue;
+        }
+        ret |= runBench(argv[i], body, repeat);
+    }
+    return (ret == 0) ? 0 : 1;
+}
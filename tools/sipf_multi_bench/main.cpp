@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * 複数モジュールの同時操作の計測
+ * エミュレータ(tools/sipf_emu)をN台起動して, モジュールごとのSipfClientで$$TXを繰り返し,
+ * 台数ごとの合計のops/sを測る
+ *   -m thread: モジュールごとにスレッドを作って, それぞれSipfClientSet()してSipfCmdTx()を回す
+ *   -m loop:   1つのループでSipfClientSet()で切り替えながらSipfSubmitTx()とSipfPoll()を回す
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c $S/sipf_transport.c \
+ *      $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_multi_bench main.cpp $S/sipf_client.cpp *.o -lm -lpthread
+ *
+ * 使い方:
+ *   sipf_multi_bench [-e emu_path] [-r byte_rate] [-d resp_delay_ms] [-N max_modules] [-t seconds] [-m thread|loop] [-j]
+ *   1台からmax_modules台まで倍々に増やして計測する
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/emu_spawn.h"
+#include "sipf_client.h"
+#include "sipf_transport.h"
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+static uint32_t byte_rate = 11520;  // 115200bps相当
+static uint32_t resp_delay_ms = 0;
+static bool json = false;
+
+/* モジュール1台ぶん */
+typedef struct {
+    EmuSpawn emu;
+    SipfClient client;
+    // loop用
+    SipfReq req;
+    SipfTxBatch batch;
+    uint8_t otid[33];
+    uint32_t value;
+    // 結果
+    uint32_t ok;
+    uint32_t ng;
+}   Module;
+
+static volatile bool running;
+
+/**
+ * エミュレータを起動して, そのモジュールのクライアントを作る
+ * 起動完了の待ち合わせもモジュールのクライアントで行う
+ */
+static int startModule(Module *m)
+{
+    char rate[16], delay[16];
+    snprintf(rate, sizeof(rate), "%u", byte_rate);
+    snprintf(delay, sizeof(delay), "%u", resp_delay_ms);
+    const char *args[] = { "-r", rate, "-d", delay, NULL };
+    if (EmuSpawnStart(&m->emu, emu_path, args) != 0) {
+        return -1;
+    }
+    SipfClientInit(&m->client, &m->emu.tr);
+    SipfClientSet(&m->client);
+    return EmuSpawnWaitReady();
+}
+
+static void stopModule(Module *m)
+{
+    EmuSpawnStop(&m->emu);
+}
+
+static void *threadMain(void *arg)
+{
+    Module *m = (Module*)arg;
+    uint8_t otid[33];
+
+    SipfClientSet(&m->client);
+    while (running) {
+        m->value++;
+        if (SipfCmdTx(0x01, OBJ_TYPE_UINT32, (uint8_t*)&m->value, sizeof(m->value), otid) == 0) {
+            m->ok++;
+        } else {
+            m->ng++;
+        }
+    }
+    return NULL;
+}
+
+static void onTxDone(SipfReq *req, int result, void *arg)
+{
+    Module *m = (Module*)arg;
+    if (result == 0) {
+        m->ok++;
+    } else {
+        m->ng++;
+    }
+}
+
+/* loop: 空いたモジュールには次の$$TXを積み, 全部のモジュールのエンジンを順に進める */
+static void loopMain(Module *mods, int n, uint32_t seconds)
+{
+    uint64_t t_end = EmuNowUs() + (uint64_t)seconds * 1000000;
+    while (EmuNowUs() < t_end) {
+        for (int i = 0; i < n; i++) {
+            Module *m = &mods[i];
+            SipfClientSet(&m->client);
+            if (!m->req.busy) {
+                m->value++;
+                SipfTxBatchBegin(&m->batch);
+                SipfTxBatchAdd(&m->batch, 0x01, OBJ_TYPE_UINT32, (uint8_t*)&m->value, sizeof(m->value));
+                SipfSubmitTx(&m->req, &m->batch, m->otid, onTxDone, m);
+            }
+            SipfPoll();
+        }
+    }
+    // 実行中の要求を終わらせる(完了は数えない)
+    for (int i = 0; i < n; i++) {
+        Module *m = &mods[i];
+        uint32_t ok = m->ok, ng = m->ng;
+        SipfClientSet(&m->client);
+        while (SipfIsBusy()) {
+            SipfPoll();
+        }
+        m->ok = ok;
+        m->ng = ng;
+    }
+}
+
+static int runBench(int n, uint32_t seconds, bool threaded)
+{
+    Module *mods = (Module*)calloc(n, sizeof(Module));
+    int started = 0;
+    int ret = 0;
+    for (; started < n; started++) {
+        if (startModule(&mods[started]) != 0) {
+            fprintf(stderr, "failed to start %s\n", emu_path);
+            ret = -1;
+            break;
+        }
+    }
+
+    uint64_t t0 = EmuNowUs();
+    if (ret == 0) {
+        if (threaded) {
+            pthread_t *th = (pthread_t*)calloc(n, sizeof(pthread_t));
+            running = true;
+            for (int i = 0; i < n; i++) {
+                pthread_create(&th[i], NULL, threadMain, &mods[i]);
+            }
+            sleep(seconds);
+            running = false;
+            for (int i = 0; i < n; i++) {
+                pthread_join(th[i], NULL);
+            }
+            free(th);
+        } else {
+            loopMain(mods, n, seconds);
+        }
+    }
+    uint64_t t_wall = EmuNowUs() - t0;
+
+    uint32_t ok = 0, ng = 0, ok_min = UINT32_MAX, ok_max = 0;
+    for (int i = 0; i < started; i++) {
+        SipfClientSet(&mods[i].client);
+        stopModule(&mods[i]);
+        ok += mods[i].ok;
+        ng += mods[i].ng;
+        ok_min = (mods[i].ok < ok_min) ? mods[i].ok : ok_min;
+        ok_max = (mods[i].ok > ok_max) ? mods[i].ok : ok_max;
+    }
+    SipfClientSet(NULL);
+    free(mods);
+    if (ret != 0) {
+        return ret;
+    }
+
+    double ops = ok * 1e6 / t_wall;
+    if (json) {
+        printf("{\"mode\":\"%s\",\"modules\":%d,\"ok\":%u,\"ng\":%u,\"ops_per_s\":%.2f,"
+               "\"ops_per_s_per_module\":%.2f,\"min_ok\":%u,\"max_ok\":%u,\"byte_rate\":%u}\n",
+               threaded ? "thread" : "loop", n, ok, ng, ops, ops / n, ok_min, ok_max, byte_rate);
+    } else {
+        printf("%-6s modules=%-3d ok=%-6u ng=%-3u %8.1f ops/s (%.1f per module, min %u max %u)\n",
+               threaded ? "thread" : "loop", n, ok, ng, ops, ops / n, ok_min, ok_max);
+    }
+    fflush(stdout);
+    return (ng == 0) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_modules = 8;
+    uint32_t seconds = 3;
+    const char *mode = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:r:d:N:t:m:j")) != -1) {
+        switch (opt) {
+        case 'e':
+            emu_path = optarg;
+            break;
+        case 'r':
+            byte_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            resp_delay_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'N':
+            max_modules = atoi(optarg);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            mode = optarg;
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e emu_path] [-r byte_rate] [-d resp_delay_ms] [-N max_modules] [-t seconds] [-m thread|loop] [-j]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int ret = 0;
+    for (int k = 0; k < 2; k++) {
+        bool threaded = (k == 0);
+        if ((mode != NULL) && (strcmp(mode, threaded ? "thread" : "loop") != 0)) {
+            continue;
+        }
+        for (int n = 1; n <= max_modules; n *= 2) {
+            ret |= runBench(n, seconds, threaded);
+        }
+    }
+    return (ret == 0) ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * $$TX/$$RXの最大長のオブジェクトの折り返し試験
+ * エミュレータ(tools/sipf_emu)に$$TXで送ったメッセージを$$RXで受け取れるようにして(txloop),
+ *   1. VALUEが255バイトのBIN/STR_UTF8と, 固定長の型をすべて並べたメッセージを送り
+ *   2. 呼び出し側の領域(SipfRxArena)に複数のメッセージを受け取って, 前のメッセージのVALUEが壊れないこと
+ *   3. 領域が足りないときは-1になり, それまでに受け取ったVALUEがそのまま残ること
+ *   4. 既定の領域(SipfCmdRx())でも最大長のVALUEを受け取れること
+ * を確かめる
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c $S/sipf_transport.c \
+ *      $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_rx_test main.cpp $S/sipf_client.cpp *.o
+ *
+ * 使い方:
+ *   sipf_rx_test [-e emu_path]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../common/emu_spawn.h"
+#include "sipf_client.h"
+#include "sipf_transport.h"
+
+#define VALUE_MAX   (255)   // VALUEの最大長
+#define ARENA_SZ    (1024)
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+
+static EmuSpawn emu;
+static int failed;
+
+#define CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            printf("NG %s:%d: ", __FILE__, __LINE__); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            failed++; \
+        } \
+    } while (0)
+
+/**
+ * エミュレータを起動して起動完了まで待つ
+ */
+static pid_t startEmu(const char *script)
+{
+    const char *args[] = { "-r", "0", "-s", script, NULL };
+    if (EmuSpawnStart(&emu, emu_path, args) != 0) {
+        return -1;
+    }
+    SipfTransportSet(&emu.tr);
+    return (EmuSpawnWaitReady() == 0) ? emu.pid : -1;
+}
+
+/**
+ * n番目のメッセージのVALUE
+ */
+static void makeValue(uint8_t *value, int n)
+{
+    for (int i = 0; i < VALUE_MAX; i++) {
+        value[i] = (uint8_t)(i * 7 + n * 31 + 1);
+    }
+    if (n & 1) {
+        // STR_UTF8として送るものは表示できる文字にしておく
+        for (int i = 0; i < VALUE_MAX; i++) {
+            value[i] = 0x20 + (value[i] % 0x5f);
+        }
+    }
+}
+
+/* 固定長の型(VALUEはリトルエンディアン) */
+static const struct {
+    SipfObjTypeId type;
+    uint8_t len;
+} fixed_types[] = {
+    { OBJ_TYPE_UINT8, 1 }, { OBJ_TYPE_INT8, 1 }, { OBJ_TYPE_UINT16, 2 }, { OBJ_TYPE_INT16, 2 },
+    { OBJ_TYPE_UINT32, 4 }, { OBJ_TYPE_INT32, 4 }, { OBJ_TYPE_UINT64, 8 }, { OBJ_TYPE_INT64, 8 },
+    { OBJ_TYPE_FLOAT32, 4 }, { OBJ_TYPE_FLOAT64, 8 },
+};
+#define FIXED_CNT   (sizeof(fixed_types) / sizeof(fixed_types[0]))
+
+static void makeFixed(uint8_t *value, int idx)
+{
+    for (int i = 0; i < 8; i++) {
+        value[i] = (uint8_t)(0x80 + idx * 8 + i);   // 最上位ビットを立てて符号付きの型も確かめる
+    }
+}
+
+/**
+ * 最大長のVALUEを1つ持つメッセージを受け取ったか確かめる
+ */
+static void checkMaxMsg(const char *what, int n, uint8_t obj_cnt, const SipfObjObject *obj)
+{
+    uint8_t value[VALUE_MAX];
+    makeValue(value, n);
+    CHECK(obj_cnt == 1, "%s #%d: obj_cnt=%u", what, n, obj_cnt);
+    CHECK(obj->tag_id == n, "%s #%d: tag_id=%u", what, n, obj->tag_id);
+    CHECK(obj->type == ((n & 1) ? OBJ_TYPE_STR_UTF8 : OBJ_TYPE_BIN), "%s #%d: type=%02X", what, n, obj->type);
+    CHECK(obj->value_len == VALUE_MAX, "%s #%d: value_len=%u", what, n, obj->value_len);
+    CHECK(memcmp(obj->value, value, VALUE_MAX) == 0, "%s #%d: value differs", what, n);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "e:")) != -1) {
+        switch (opt) {
+        case 'e':
+            emu_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e emu_path]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    char script[] = "/tmp/sipf_rx_testXXXXXX";
+    int sfd = mkstemp(script);
+    if (sfd < 0) {
+        return 1;
+    }
+    dprintf(sfd, "txloop 1\n");
+    close(sfd);
+    pid_t pid = startEmu(script);
+    if (pid < 0) {
+        fprintf(stderr, "failed to start %s\n", emu_path);
+        unlink(script);
+        return 1;
+    }
+    uint32_t fw;
+    CHECK(SipfGetFwVersion(&fw) == 0, "SipfGetFwVersion()");   // $$RXの行のTAGとTYPEの順番が決まる
+
+    // 1. 送る: 最大長x5, 固定長の型を並べたもの, 最大長x1
+    uint8_t otid[33];
+    uint8_t value[VALUE_MAX];
+    int cnt_max = ARENA_SZ / VALUE_MAX + 1;     // 最後の1つは領域に入りきらない
+    for (int n = 0; n < cnt_max; n++) {
+        makeValue(value, n);
+        int ret = SipfCmdTx(n, (n & 1) ? OBJ_TYPE_STR_UTF8 : OBJ_TYPE_BIN, value, VALUE_MAX, otid);
+        CHECK(ret == 0, "SipfCmdTx(#%d)=%d", n, ret);
+    }
+    SipfTxBatch batch;
+    SipfTxBatchBegin(&batch);
+    for (size_t i = 0; i < FIXED_CNT; i++) {
+        makeFixed(value, i);
+        int ret = SipfTxBatchAdd(&batch, 0x40 + i, fixed_types[i].type, value, fixed_types[i].len);
+        CHECK(ret == 0, "SipfTxBatchAdd(%02X)=%d", fixed_types[i].type, ret);
+    }
+    int ret = SipfTxBatchCommit(&batch, otid);
+    CHECK(ret == 0, "SipfTxBatchCommit()=%d", ret);
+    makeValue(value, cnt_max + 1);
+    ret = SipfCmdTx(cnt_max + 1, ((cnt_max + 1) & 1) ? OBJ_TYPE_STR_UTF8 : OBJ_TYPE_BIN, value, VALUE_MAX, otid);
+    CHECK(ret == 0, "SipfCmdTx(#%d)=%d", cnt_max + 1, ret);
+
+    // 2. 呼び出し側の領域に入るだけ受け取って, 全部そろってから中身を確かめる
+    static uint8_t arena_buff[ARENA_SZ];
+    SipfRxArena arena;
+    SipfRxArenaInit(&arena, arena_buff, sizeof(arena_buff));
+    SipfObjObject objs[8][FIXED_CNT];
+    uint8_t obj_cnt[8];
+    uint64_t t_user, t_sipf;
+    uint8_t remain;
+    int held = 0;
+    while (SipfRxArenaFree(&arena) >= VALUE_MAX) {
+        ret = SipfCmdRxArena(&arena, otid, &t_user, &t_sipf, &remain, &obj_cnt[held], objs[held], FIXED_CNT);
+        CHECK(ret == 1, "SipfCmdRxArena(#%d)=%d", held, ret);
+        held++;
+    }
+    CHECK(held == cnt_max - 1, "held=%d", held);
+    for (int n = 0; n < held; n++) {
+        checkMaxMsg("arena", n, obj_cnt[n], &objs[n][0]);
+    }
+
+    // 3. 入りきらないときは-1で, 受け取り済みのVALUEは残る
+    uint32_t used = arena.used;
+    ret = SipfCmdRxArena(&arena, otid, &t_user, &t_sipf, &remain, &obj_cnt[held], objs[held], FIXED_CNT);
+    CHECK(ret == -1, "SipfCmdRxArena(overflow)=%d", ret);
+    CHECK(arena.used == used, "arena.used %u -> %u", used, arena.used);
+    for (int n = 0; n < held; n++) {
+        checkMaxMsg("after overflow", n, obj_cnt[n], &objs[n][0]);
+    }
+
+    // 固定長の型は領域をリセットしてから
+    SipfRxArenaReset(&arena);
+    ret = SipfCmdRxArena(&arena, otid, &t_user, &t_sipf, &remain, &obj_cnt[0], objs[0], FIXED_CNT);
+    CHECK((ret == FIXED_CNT) && (obj_cnt[0] == FIXED_CNT), "SipfCmdRxArena(fixed)=%d obj_cnt=%u", ret, obj_cnt[0]);
+    for (size_t i = 0; (i < FIXED_CNT) && (i < obj_cnt[0]); i++) {
+        const SipfObjObject *obj = &objs[0][i];
+        makeFixed(value, i);
+        CHECK((obj->tag_id == 0x40 + i) && (obj->type == fixed_types[i].type) && (obj->value_len == fixed_types[i].len) &&
+              (memcmp(obj->value, value, obj->value_len) == 0), "fixed: type %02X differs", fixed_types[i].type);
+    }
+
+    // 4. 既定の領域
+    ret = SipfCmdRx(otid, &t_user, &t_sipf, &remain, &obj_cnt[0], objs[0], FIXED_CNT);
+    CHECK(ret == 1, "SipfCmdRx()=%d", ret);
+    checkMaxMsg("default", cnt_max + 1, obj_cnt[0], &objs[0][0]);
+    CHECK(remain == 0, "remain=%u", remain);
+
+    EmuSpawnStop(&emu);
+    unlink(script);
+
+    printf("%s (%d failed)\n", (failed == 0) ? "OK" : "NG", failed);
+    return (failed == 0) ? 0 : 1;
+}
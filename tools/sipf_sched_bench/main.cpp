@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * 優先度つきスケジューラの計測
+ * エミュレータ(tools/sipf_emu)を1台つないで, 1つのループで次の負荷をかけ続ける
+ *   normal: 定期送信の$$TXを常にq_depth個キューに積んでおく
+ *   bulk:   $$FPUT(SIPF_REQ_CALL)を1つずつ繰り返す
+ *   urgent: period_ms ごとに期限deadline_msつきの$$TXを投入する
+ * 優先度ごとに投入から完了までの時間(p50/p99/max)と期限切れの数を出す
+ *   -m prio: 上の優先度で投入する
+ *   -m fifo: 全部SIPF_PRIO_NORMAL・期限なしで投入する(比較用)
+ * -DSIPF_STATS=1でビルドするとライブラリのキュー待ち時間の統計も出す
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c $S/sipf_stats.c $S/sipf_transport.c \
+ *      $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_sched_bench main.cpp $S/sipf_client.cpp *.o -lm
+ *
+ * 使い方:
+ *   sipf_sched_bench [-e emu_path] [-r byte_rate] [-d resp_delay_ms] [-t seconds] [-q q_depth]
+ *                    [-p period_ms] [-D deadline_ms] [-s fput_size] [-m prio|fifo] [-j]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../common/emu_spawn.h"
+#include "sipf_client.h"
+#include "sipf_stats.h"
+#include "sipf_transport.h"
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+static uint32_t byte_rate = 11520;  // 115200bps相当
+static uint32_t resp_delay_ms = 0;
+static bool json = false;
+
+static EmuSpawn emu;
+
+#define Q_DEPTH_MAX (16)
+
+/* 優先度ごとの結果 */
+typedef struct {
+    std::vector<uint32_t> lat_us;   // 投入から完了まで
+    uint32_t ok;
+    uint32_t ng;
+    uint32_t expired;
+}   ClassResult;
+
+static ClassResult results[SIPF_PRIO_NUM];
+
+/* 1つの要求とその投入時刻 */
+typedef struct {
+    SipfReq req;
+    SipfTxBatch batch;
+    uint8_t otid[33];
+    uint32_t value;
+    int cls;                // 計測上の分類(SipfReqPrio)
+    uint64_t t_submit;
+}   Job;
+
+static Job normal_jobs[Q_DEPTH_MAX];
+static Job urgent_job;
+static Job bulk_job;
+
+static size_t fput_size = 16 * 1024;
+static uint8_t *fput_body;
+static bool use_prio = true;
+static uint32_t deadline_ms = 200;
+
+/**
+ * エミュレータを起動して起動完了まで待つ
+ */
+static pid_t startEmu(void)
+{
+    char rate[16], delay[16];
+    snprintf(rate, sizeof(rate), "%u", byte_rate);
+    snprintf(delay, sizeof(delay), "%u", resp_delay_ms);
+    const char *args[] = { "-r", rate, "-d", delay, NULL };
+    if (EmuSpawnStart(&emu, emu_path, args) != 0) {
+        return -1;
+    }
+    SipfTransportSet(&emu.tr);
+    return (EmuSpawnWaitReady() == 0) ? emu.pid : -1;
+}
+
+static void onDone(SipfReq *req, int result, void *arg)
+{
+    Job *j = (Job*)arg;
+    ClassResult *r = &results[j->cls];
+    r->lat_us.push_back((uint32_t)(EmuNowUs() - j->t_submit));
+    if (result == 0) {
+        r->ok++;
+    } else if (result == SIPF_RESULT_EXPIRED) {
+        // 送信を始める前に期限が切れた
+        r->expired++;
+    } else {
+        r->ng++;
+    }
+}
+
+static int bulkFput(void *arg)
+{
+    return SipfCmdFput((char*)"sched.bin", fput_body, fput_size);
+}
+
+static void submitTx(Job *j, SipfReqPrio prio, uint32_t deadline)
+{
+    SipfSetPriority(use_prio ? prio : SIPF_PRIO_NORMAL, use_prio ? deadline : 0);
+    j->value++;
+    SipfTxBatchBegin(&j->batch);
+    SipfTxBatchAdd(&j->batch, (uint8_t)(0x01 + j->cls), OBJ_TYPE_UINT32, (uint8_t*)&j->value, sizeof(j->value));
+    j->t_submit = EmuNowUs();
+    SipfSubmitTx(&j->req, &j->batch, j->otid, onDone, j);
+}
+
+static void submitBulk(Job *j)
+{
+    SipfSetPriority(use_prio ? SIPF_PRIO_BULK : SIPF_PRIO_NORMAL, 0);
+    j->t_submit = EmuNowUs();
+    SipfSubmitCall(&j->req, bulkFput, NULL, onDone, j);
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, int pct)
+{
+    if (v.empty()) {
+        return 0;
+    }
+    size_t i = (v.size() * pct) / 100;
+    return v[(i < v.size()) ? i : (v.size() - 1)];
+}
+
+#if SIPF_STATS
+static void printStatsLine(const char *line, void *arg)
+{
+    if (strncmp(line, "queue", 5) == 0 || strncmp(line, "  wait", 6) == 0) {
+        printf("  %s\n", line);
+    }
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+    uint32_t seconds = 5;
+    int q_depth = 4;
+    uint32_t period_ms = 250;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:r:d:t:q:p:D:s:m:j")) != -1) {
+        switch (opt) {
+        case 'e':
+            emu_path = optarg;
+            break;
+        case 'r':
+            byte_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            resp_delay_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            q_depth = std::min(std::max(atoi(optarg), 0), Q_DEPTH_MAX);
+            break;
+        case 'p':
+            period_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            deadline_ms = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            fput_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            use_prio = (strcmp(optarg, "fifo") != 0);
+            break;
+        case 'j':
+            json = true;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e emu_path] [-r byte_rate] [-d resp_delay_ms] [-t seconds] [-q q_depth] "
+                            "[-p period_ms] [-D deadline_ms] [-s fput_size] [-m prio|fifo] [-j]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    fput_body = (uint8_t*)malloc(fput_size);
+    for (size_t i = 0; i < fput_size; i++) {
+        fput_body[i] = (uint8_t)i;
+    }
+    pid_t pid = startEmu();
+    if (pid < 0) {
+        fprintf(stderr, "failed to start %s\n", emu_path);
+        return 1;
+    }
+
+    for (int i = 0; i < q_depth; i++) {
+        normal_jobs[i].cls = SIPF_PRIO_NORMAL;
+    }
+    urgent_job.cls = SIPF_PRIO_URGENT;
+    bulk_job.cls = SIPF_PRIO_BULK;
+
+    uint64_t t_end = EmuNowUs() + (uint64_t)seconds * 1000000;
+    uint64_t t_urgent = EmuNowUs() + (uint64_t)period_ms * 1000;
+    while (EmuNowUs() < t_end) {
+        for (int i = 0; i < q_depth; i++) {
+            if (!normal_jobs[i].req.busy) {
+                submitTx(&normal_jobs[i], SIPF_PRIO_NORMAL, 0);
+            }
+        }
+        if ((fput_size > 0) && !bulk_job.req.busy) {
+            submitBulk(&bulk_job);
+        }
+        if ((EmuNowUs() >= t_urgent) && !urgent_job.req.busy) {
+            t_urgent += (uint64_t)period_ms * 1000;
+            submitTx(&urgent_job, SIPF_PRIO_URGENT, deadline_ms);
+        }
+        SipfPoll();
+    }
+    // 実行中の要求を終わらせる(結果は数えない)
+    ClassResult saved[SIPF_PRIO_NUM];
+    for (int c = 0; c < SIPF_PRIO_NUM; c++) {
+        saved[c] = results[c];
+    }
+    while (SipfIsBusy()) {
+        SipfPoll();
+    }
+    EmuSpawnStop(&emu);
+
+    const char *names[SIPF_PRIO_NUM] = { "urgent", "normal", "bulk" };
+    for (int c = 0; c < SIPF_PRIO_NUM; c++) {
+        ClassResult *r = &saved[c];
+        std::sort(r->lat_us.begin(), r->lat_us.end());
+        uint32_t max = r->lat_us.empty() ? 0 : r->lat_us.back();
+        if (json) {
+            printf("{\"mode\":\"%s\",\"class\":\"%s\",\"ok\":%u,\"ng\":%u,\"expired\":%u,"
+                   "\"p50_us\":%u,\"p99_us\":%u,\"max_us\":%u}\n",
+                   use_prio ? "prio" : "fifo", names[c], r->ok, r->ng, r->expired,
+                   percentile(r->lat_us, 50), percentile(r->lat_us, 99), max);
+        } else {
+            printf("%-4s %-6s ok=%-5u ng=%-3u expired=%-3u p50=%7.1fms p99=%7.1fms max=%7.1fms\n",
+                   use_prio ? "prio" : "fifo", names[c], r->ok, r->ng, r->expired,
+                   percentile(r->lat_us, 50) / 1000.0, percentile(r->lat_us, 99) / 1000.0, max / 1000.0);
+        }
+    }
+#if SIPF_STATS
+    if (!json) {
+        SipfStatsDump(printStatsLine, NULL);
+    }
+#endif
+    free(fput_body);
+    return 0;
+}
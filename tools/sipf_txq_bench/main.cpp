@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2022 SAKURA internet Inc.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+/*
+ * 送信キュー(sipf_txq.c)の計測と電源断の確認
+ *   1. ファイルに保存するSipfTxQueuePut()の速度
+ *   2. エミュレータ(tools/sipf_emu)へ送り出す速度
+ *   3. 書き込み中にプロセスをSIGKILLしても, 開き直したキューの中身が欠けずに連番で並んでいること
+ *
+ * ビルド例:
+ *   S=../../sipf-std-m5stack
+ *   cc -O2 -c -I$S $S/sipf_txq.c $S/sipf_store_posix.c $S/sipf_gnss.c $S/sipf_hex.c $S/sipf_line.c $S/sipf_crc.c $S/sipf_lz.c \
+ *      $S/sipf_transport.c $S/sipf_transport_posix.c $S/xmodem.c $S/xmodem_transport.c ../common/emu_spawn.c
+ *   c++ -O2 -I$S -o sipf_txq_bench main.cpp $S/sipf_client.cpp *.o -lm
+ *
+ * 使い方:
+ *   sipf_txq_bench [-e emu_path] [-r byte_rate] [-f store_path] [-z store_size] [-n count] [-k kill_rounds]
+ */
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/emu_spawn.h"
+#include "sipf_client.h"
+#include "sipf_client_typed.h"
+#include "sipf_store.h"
+#include "sipf_transport.h"
+#include "sipf_txq.h"
+
+static const char *emu_path = "../sipf_emu/sipf_emu";
+static const char *store_path = "/tmp/sipf_txq_bench.bin";
+static uint32_t store_size = 64 * 1024;
+static uint32_t byte_rate = 0;
+
+static EmuSpawn emu;
+
+/**
+ * エミュレータを起動して起動完了まで待つ
+ */
+static pid_t startEmu(void)
+{
+    char rate[16];
+    snprintf(rate, sizeof(rate), "%u", byte_rate);
+    const char *args[] = { "-r", rate, NULL };
+    if (EmuSpawnStart(&emu, emu_path, args) != 0) {
+        return -1;
+    }
+    SipfTransportSet(&emu.tr);
+    return (EmuSpawnWaitReady() == 0) ? emu.pid : -1;
+}
+
+/* 送り出したメッセージの値(tag 0x01のUINT32)を確かめる */
+typedef struct {
+    uint32_t sent;
+    uint32_t ng;
+    uint32_t last;
+    uint32_t gaps;
+}   ReplayCheck;
+
+static void onSent(SipfTxQueue *q, int result, uint64_t timestamp_ms, const uint8_t *otid, void *arg)
+{
+    ReplayCheck *c = (ReplayCheck*)arg;
+    if (result != 0) {
+        c->ng++;
+        return;
+    }
+    // q->batchは送った行のまま: "$$TX 01 04 XXXXXXXX"
+    uint32_t v = strtoul(&q->batch.line[11], NULL, 16);
+    if ((c->sent > 0) && (v != c->last + 1)) {
+        c->gaps++;
+    }
+    c->last = v;
+    c->sent++;
+}
+
+static int putValue(SipfTxQueue *q, uint32_t v)
+{
+    SipfTxBatch batch;
+    SipfTxBatchBegin(&batch);
+    SipfTxBatchAddValue(&batch, 0x01, v);
+    return SipfTxQueuePut(q, &batch, (uint64_t)time(NULL) * 1000);
+}
+
+/**
+ * キューが空になるまで送り出す
+ */
+static int replayAll(SipfTxQueue *q, ReplayCheck *c)
+{
+    uint32_t t0 = SipfTransportMillis();
+    while ((SipfTxQueueCount(q) > 0) || SipfIsBusy()) {
+        SipfPoll();
+        SipfTxQueuePoll(q);
+        if ((c->ng > 0) || ((SipfTransportMillis() - t0) > 600000)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int benchThroughput(int cnt)
+{
+    SipfStore st;
+    SipfStorePosix sp;
+    SipfTxQueue q;
+    ReplayCheck c = {};
+
+    unlink(store_path);
+    if ((SipfStorePosixOpen(&st, &sp, store_path, store_size) != 0) ||
+        (SipfTxQueueOpen(&q, &st, SIPF_TXQ_DROP_NEWEST, onSent, &c) != 0)) {
+        fprintf(stderr, "failed to open %s\n", store_path);
+        return -1;
+    }
+
+    uint64_t t0 = EmuNowUs();
+    int n;
+    for (n = 0; n < cnt; n++) {
+        if (putValue(&q, n) != 0) {
+            break;  // いっぱい
+        }
+    }
+    uint64_t t1 = EmuNowUs();
+    printf("put    n=%d %.1f us/msg %.0f msg/s (store %u bytes, free %u)\n", n,
+           (double)(t1 - t0) / n, n * 1e6 / (t1 - t0), store_size, SipfTxQueueFree(&q));
+
+    pid_t pid = startEmu();
+    if (pid < 0) {
+        fprintf(stderr, "failed to start %s\n", emu_path);
+        return -1;
+    }
+    t0 = EmuNowUs();
+    int ret = replayAll(&q, &c);
+    t1 = EmuNowUs();
+    EmuSpawnStop(&emu);
+    printf("replay n=%u %.1f us/msg %.0f msg/s gaps=%u ng=%u (rate %u B/s)\n", c.sent,
+           (double)(t1 - t0) / c.sent, c.sent * 1e6 / (t1 - t0), c.gaps, c.ng, byte_rate);
+    SipfStorePosixClose(&sp);
+    return ((ret == 0) && (c.sent == (uint32_t)n) && (c.gaps == 0)) ? 0 : -1;
+}
+
+/**
+ * 書き込み中にSIGKILLして開き直す. 古い方から捨てる設定で何周もさせる
+ */
+static int benchKill(int rounds)
+{
+    uint32_t next = 0;      // 子プロセスが次に入れる値
+    int ng = 0;
+
+    unlink(store_path);
+    for (int r = 0; r < rounds; r++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            SipfStore st;
+            SipfStorePosix sp;
+            SipfTxQueue q;
+            if ((SipfStorePosixOpen(&st, &sp, store_path, store_size) != 0) ||
+                (SipfTxQueueOpen(&q, &st, SIPF_TXQ_DROP_OLDEST, NULL, NULL) != 0)) {
+                _exit(1);
+            }
+            for (uint32_t v = next; ; v++) {
+                putValue(&q, v);
+            }
+        }
+        usleep(20000 + rand() % 30000);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        // 開き直して中身を全部送り出し, 連番で途切れていないことを確かめる
+        SipfStore st;
+        SipfStorePosix sp;
+        SipfTxQueue q;
+        ReplayCheck c = {};
+        if ((SipfStorePosixOpen(&st, &sp, store_path, store_size) != 0) ||
+            (SipfTxQueueOpen(&q, &st, SIPF_TXQ_DROP_OLDEST, onSent, &c) != 0)) {
+            printf("round %d: open failed\n", r);
+            return -1;
+        }
+        uint32_t cnt = SipfTxQueueCount(&q);
+        if (startEmu() < 0) {
+            fprintf(stderr, "failed to start %s\n", emu_path);
+            return -1;
+        }
+        int ret = replayAll(&q, &c);
+        EmuSpawnStop(&emu);
+        SipfStorePosixClose(&sp);
+        if ((ret != 0) || (c.sent != cnt) || (c.gaps != 0) || (cnt == 0)) {
+            printf("round %d: NG restored=%u sent=%u gaps=%u\n", r, cnt, c.sent, c.gaps);
+            ng++;
+        }
+        next = c.last + 1;
+    }
+    printf("kill   rounds=%d ng=%d\n", rounds, ng);
+    return (ng == 0) ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int cnt = 1000;
+    int rounds = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:r:f:z:n:k:")) != -1) {
+        switch (opt) {
+        case 'e':
+            emu_path = optarg;
+            break;
+        case 'r':
+            byte_rate = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            store_path = optarg;
+            break;
+        case 'z':
+            store_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            cnt = atoi(optarg);
+            break;
+        case 'k':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-e emu_path] [-r byte_rate] [-f store_path] [-z store_size] [-n count] [-k kill_rounds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int ret = benchThroughput(cnt);
+    if (rounds > 0) {
+        ret |= benchKill(rounds);
+    }
+    unlink(store_path);
+    return (ret == 0) ? 0 : 1;
+}